@@ -0,0 +1,302 @@
+#include "stdafx.h"
+#include "BatchEngine.h"
+#include <thread>
+
+BatchEngine::BatchEngine()
+    : m_budget(GetDefaultMemoryBudget()), m_files(NULL), m_nextProbed(0), m_cancelled(false), m_usedBytes(0), 
+      m_running(0)
+{
+}
+
+BatchEngine::~BatchEngine()
+{
+}
+
+UINT64 BatchEngine::GetDefaultMemoryBudget()
+{
+    WCHAR value[32];
+    DWORD length = GetEnvironmentVariableW(L"NIKONWATERMARK_MEMORY_BUDGET_MB", value, _countof(value));
+    if (length > 0 && length < _countof(value))
+    {
+        UINT64 megabytes = _wcstoui64(value, NULL, 10);
+        if (megabytes > 0)
+            return megabytes * 1024 * 1024;
+    }
+
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    UINT64 available = GlobalMemoryStatusEx(&status) ? status.ullAvailPhys : 1024ull * 1024 * 1024;
+
+    // A job object limit is what actually gets us killed in a container
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+    ZeroMemory(&limits, sizeof(limits));
+    if (QueryInformationJobObject(NULL, JobObjectExtendedLimitInformation, &limits, sizeof(limits), NULL))
+    {
+        DWORD flags = limits.BasicLimitInformation.LimitFlags;
+        if ((flags & JOB_OBJECT_LIMIT_JOB_MEMORY) && limits.JobMemoryLimit < available)
+            available = limits.JobMemoryLimit;
+        if ((flags & JOB_OBJECT_LIMIT_PROCESS_MEMORY) && limits.ProcessMemoryLimit < available)
+            available = limits.ProcessMemoryLimit;
+    }
+
+    return available / 2;
+}
+
+UINT64 BatchEngine::GetAdmittedBytes(const Worker& worker, const Job& job) const
+{
+    // Without a header there is nothing to estimate from, so the job claims
+    // the whole budget and runs on its own
+    if (!job.probed)
+        return m_budget;
+
+    // The pooled buffer only grows, so a small frame costs nothing extra
+    return max(worker.retainedBytes, job.frameBytes) + job.transientBytes;
+}
+
+// Moves files the prober has finished onto the pending queue; returns
+// false once every file has been queued
+bool BatchEngine::QueueProbed()
+{
+    bool finished = false;
+    size_t probed = m_prober.GetProbedCount(finished);
+
+    for (; m_nextProbed < probed; m_nextProbed++)
+    {
+        const HeaderProber::Estimate& estimate = m_prober.GetEstimate(m_nextProbed);
+
+        Job job;
+        job.index = m_nextProbed;
+        job.frameBytes = estimate.frameBytes;
+        job.transientBytes = estimate.transientBytes;
+        job.probed = estimate.probed;
+        job.header = estimate.header;
+        job.bypassed = 0;
+        m_pending.push_back(job);
+    }
+
+    return !finished;
+}
+
+bool BatchEngine::TakeJob(size_t workerIndex, std::unique_lock<std::mutex>& lock, Job& job)
+{
+    Worker& worker = m_workers[workerIndex];
+
+    for (;;)
+    {
+        if (m_cancelled)
+            return false;
+
+        bool probing = QueueProbed();
+        if (m_pending.empty())
+        {
+            if (!probing)
+                return false;
+
+            // The prober wakes us after every file
+            m_released.wait(lock);
+            continue;
+        }
+
+        UINT64 others = m_usedBytes - worker.chargedBytes;
+        size_t limit = min(m_pending.size(), LOOKAHEAD);
+        size_t pick = limit;
+
+        for (size_t i = 0; i < limit; i++)
+        {
+            if (others + GetAdmittedBytes(worker, m_pending[i]) <= m_budget)
+            {
+                pick = i;
+                break;
+            }
+
+            // Nothing may overtake a job that has already waited long enough
+            if (m_pending[i].bypassed >= MAX_BYPASS)
+                break;
+        }
+
+        if (pick == limit)
+        {
+            if (worker.retainedBytes > 0)
+            {
+                // Our own pooled buffer may be what is in the way
+                worker.processor->ReleaseBuffers();
+                m_usedBytes -= worker.chargedBytes;
+                worker.retainedBytes = 0;
+                worker.chargedBytes = 0;
+                m_released.notify_all();
+                continue;
+            }
+
+            if (others > 0)
+            {
+                m_released.wait(lock);
+                continue;
+            }
+
+            // Everyone else is idle and empty-handed; the job is larger than
+            // the whole budget and can only run alone
+            pick = 0;
+            m_stats.oversized++;
+        }
+
+        for (size_t i = 0; i < pick; i++)
+            m_pending[i].bypassed++;
+        if (pick > 0)
+            m_stats.reordered++;
+
+        job = m_pending[pick];
+        m_pending.erase(m_pending.begin() + pick);
+
+        if (!job.probed)
+            m_stats.unprobed++;
+
+        UINT64 admitted = GetAdmittedBytes(worker, job);
+        m_usedBytes = m_usedBytes - worker.chargedBytes + admitted;
+        worker.chargedBytes = admitted;
+        m_stats.peakBytes = max(m_stats.peakBytes, m_usedBytes);
+        m_running++;
+        return true;
+    }
+}
+
+void BatchEngine::WorkerLoop(size_t workerIndex)
+{
+    Worker& worker = m_workers[workerIndex];
+    std::wstring outputPath = m_outputFolder + L"\\";
+    size_t folderLength = outputPath.length();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Job job;
+
+    while (TakeJob(workerIndex, lock, job))
+    {
+        lock.unlock();
+
+        outputPath.resize(folderLength);
+        outputPath += m_files->GetOutputName(job.index);
+
+        bool success = worker.processor->ProcessImage(m_files->GetFullPath(job.index), outputPath, job.header, 
+                                                      m_config);
+        if (m_callback)
+            m_callback(job.index, success);
+
+        UINT64 retained = worker.processor->GetRetainedBytes();
+
+        lock.lock();
+        m_usedBytes = m_usedBytes - worker.chargedBytes + retained;
+        worker.retainedBytes = retained;
+        worker.chargedBytes = retained;
+        m_running--;
+        m_released.notify_all();
+    }
+}
+
+void BatchEngine::Run(const FileTable& files, const std::wstring& outputFolder, const WatermarkConfig& config,
+                      const ResultCallback& callback)
+{
+    m_stats = BatchStats();
+    m_stats.budgetBytes = m_budget;
+
+    if (files.GetCount() == 0)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cancelled = false;
+        return;
+    }
+
+    m_files = &files;
+    m_outputFolder = outputFolder;
+    m_config = config;
+    m_callback = callback;
+
+    size_t workerCount = std::thread::hardware_concurrency();
+    workerCount = max(workerCount, (size_t)1);
+    workerCount = min(workerCount, MAX_WORKERS);
+    workerCount = min(workerCount, files.GetCount());
+
+    // Each worker encodes on its share of the cores
+    UINT encoderThreads = ImageProcessor::GetEncoderThreadShare(workerCount);
+
+    // Processors (and their caches) are kept from one batch to the next
+    while (m_workers.size() < workerCount)
+    {
+        Worker worker;
+        worker.processor.reset(new ImageProcessor());
+        worker.retainedBytes = 0;
+        worker.chargedBytes = 0;
+        m_workers.push_back(std::move(worker));
+    }
+
+    m_usedBytes = 0;
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        // Idle workers from a wider earlier batch would hold memory nobody accounts for
+        if (i >= workerCount && m_workers[i].retainedBytes > 0)
+        {
+            m_workers[i].processor->ReleaseBuffers();
+            m_workers[i].retainedBytes = 0;
+        }
+        m_workers[i].processor->SetEncoderThreads(encoderThreads);
+        m_workers[i].chargedBytes = m_workers[i].retainedBytes;
+        m_usedBytes += m_workers[i].chargedBytes;
+    }
+    m_running = 0;
+
+    // Workers start on the first files while the rest are still being probed
+    m_pending.clear();
+    m_nextProbed = 0;
+    m_prober.Start(files, encoderThreads, [this]()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_released.notify_all();
+    });
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < workerCount; i++)
+        threads.push_back(std::thread(&BatchEngine::WorkerLoop, this, i));
+
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    m_prober.Stop();
+    m_files = NULL;
+    m_callback = nullptr;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending.clear();
+    m_cancelled = false;
+}
+
+void BatchEngine::Cancel()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cancelled = true;
+    m_prober.Cancel();
+    m_released.notify_all();
+}
+
+AllocationStats BatchEngine::GetAllocationStats() const
+{
+    AllocationStats total;
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        AllocationStats stats = m_workers[i].processor->GetAllocationStats();
+        total.allocations += stats.allocations;
+        total.bytes += stats.bytes;
+    }
+    return total;
+}
+
+OverlayCacheStats BatchEngine::GetOverlayCacheStats() const
+{
+    OverlayCacheStats total;
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        OverlayCacheStats stats = m_workers[i].processor->GetOverlayCacheStats();
+        total.hits += stats.hits;
+        total.misses += stats.misses;
+        total.evictions += stats.evictions;
+        total.entries += stats.entries;
+    }
+    return total;
+}
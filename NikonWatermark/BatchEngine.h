@@ -0,0 +1,106 @@
+#pragma once
+#include "stdafx.h"
+#include "FileTable.h"
+#include "ImageProcessor.h"
+#include "HeaderProber.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+
+struct BatchStats
+{
+    UINT64 budgetBytes = 0;
+    UINT64 peakBytes = 0;      // Highest estimated working set admitted at once
+    UINT64 reordered = 0;      // Jobs started ahead of a larger one that did not fit
+    UINT64 unprobed = 0;       // Jobs whose header could not be read; each ran alone
+    UINT64 oversized = 0;      // Jobs larger than the whole budget; each ran alone
+};
+
+// Runs a batch on several workers, each with its own ImageProcessor. Every
+// file's peak working set is estimated from its header before it starts
+// (HeaderProber reads them ahead of the workers, so processing overlaps
+// probing), and a job is only admitted when it fits in the remaining
+// memory budget.
+// Smaller jobs may overtake one that does not fit yet, but only
+// MAX_BYPASS times before the workers drain and let it through.
+class BatchEngine
+{
+public:
+    typedef std::function<void(size_t index, bool success)> ResultCallback;
+
+    BatchEngine();
+    ~BatchEngine();
+
+    // Half the available physical memory (capped by any job object limit),
+    // unless NIKONWATERMARK_MEMORY_BUDGET_MB is set
+    static UINT64 GetDefaultMemoryBudget();
+
+    void SetMemoryBudget(UINT64 bytes) { m_budget = bytes; }
+    UINT64 GetMemoryBudget() const { return m_budget; }
+
+    // Blocks until every file has been processed or Cancel is called. The
+    // callback runs on the worker threads, in completion order.
+    void Run(const FileTable& files, const std::wstring& outputFolder, const WatermarkConfig& config,
+             const ResultCallback& callback);
+
+    // Makes a running (or about to start) Run return early: files already
+    // started finish and report, the rest are skipped without a callback.
+    // Safe to call from any thread.
+    void Cancel();
+
+    BatchStats GetStats() const { return m_stats; }
+    AllocationStats GetAllocationStats() const;
+    OverlayCacheStats GetOverlayCacheStats() const;
+
+    static const size_t MAX_WORKERS = 8;
+    static const size_t LOOKAHEAD = 64;
+    static const UINT MAX_BYPASS = 8;
+
+private:
+    BatchEngine(const BatchEngine&);
+    BatchEngine& operator=(const BatchEngine&);
+
+    struct Job
+    {
+        size_t index;
+        UINT64 frameBytes;
+        UINT64 transientBytes;
+        bool probed;
+        ImageHeaderInfo header;     // Handed to ProcessImage so it does not probe again
+        UINT bypassed;
+    };
+
+    struct Worker
+    {
+        std::unique_ptr<ImageProcessor> processor;
+        UINT64 retainedBytes;   // Pooled frame buffer kept between files
+        UINT64 chargedBytes;    // What this worker counts against the budget
+    };
+
+    void WorkerLoop(size_t workerIndex);
+    UINT64 GetAdmittedBytes(const Worker& worker, const Job& job) const;
+    bool TakeJob(size_t workerIndex, std::unique_lock<std::mutex>& lock, Job& job);
+    bool QueueProbed();
+
+    UINT64 m_budget;
+    std::vector<Worker> m_workers;
+
+    const FileTable* m_files;
+    std::wstring m_outputFolder;
+    WatermarkConfig m_config;
+    ResultCallback m_callback;
+
+    std::mutex m_mutex;
+    std::condition_variable m_released;
+    HeaderProber m_prober;
+    size_t m_nextProbed;           // First file not yet moved to m_pending
+    std::deque<Job> m_pending;
+    bool m_cancelled;
+    UINT64 m_usedBytes;
+    size_t m_running;
+    BatchStats m_stats;
+};
@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "BatchReport.h"
+
+void BatchReport::Reset(size_t fileCount)
+{
+    m_entries.assign(fileCount, BatchReportEntry());
+    m_wallMilliseconds = 0.0;
+    m_lostWorkers = 0;
+}
+
+size_t BatchReport::GetSucceeded() const
+{
+    size_t count = 0;
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        if (m_entries[i].done && m_entries[i].success)
+            count++;
+    }
+    return count;
+}
+
+size_t BatchReport::GetFailed() const
+{
+    return m_entries.size() - GetSucceeded();
+}
+
+size_t BatchReport::GetRetried() const
+{
+    size_t count = 0;
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        if (m_entries[i].attempts > 1)
+            count++;
+    }
+    return count;
+}
+
+double BatchReport::GetTotalMilliseconds() const
+{
+    double total = 0.0;
+    for (size_t i = 0; i < m_entries.size(); i++)
+        total += m_entries[i].milliseconds;
+    return total;
+}
+
+static void AppendCsvField(std::string& line, const std::wstring& value)
+{
+    int size = WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.length(), NULL, 0, NULL, NULL);
+    std::string utf8(size, '\0');
+    if (size > 0)
+        WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.length(), &utf8[0], size, NULL, NULL);
+
+    line += '"';
+    for (size_t i = 0; i < utf8.length(); i++)
+    {
+        if (utf8[i] == '"')
+            line += '"';
+        line += utf8[i];
+    }
+    line += '"';
+}
+
+bool BatchReport::WriteCsv(const std::wstring& path, const FileTable& files) const
+{
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    std::string text = "Index,File,Status,Attempts,Worker,Milliseconds,Note\r\n";
+    char numbers[96];
+
+    for (size_t i = 0; i < m_entries.size() && i < files.GetCount(); i++)
+    {
+        const BatchReportEntry& entry = m_entries[i];
+
+        sprintf_s(numbers, "%u,", (UINT)i);
+        text += numbers;
+        AppendCsvField(text, files.GetFullPath(i));
+        sprintf_s(numbers, ",%s,%u,%u,%.1f,", (entry.done && entry.success) ? "Succeeded" : "Failed",
+                  entry.attempts, entry.worker, entry.milliseconds);
+        text += numbers;
+        AppendCsvField(text, entry.note);
+        text += "\r\n";
+    }
+
+    DWORD written = 0;
+    BOOL success = WriteFile(hFile, text.c_str(), (DWORD)text.length(), &written, NULL);
+    CloseHandle(hFile);
+
+    return success && written == text.length();
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "stdafx.h"
+#include "FileTable.h"
+#include <string>
+#include <vector>
+
+struct BatchReportEntry
+{
+    bool done = false;
+    bool success = false;
+    UINT attempts = 0;        // Runs started, including ones that crashed or hung
+    UINT worker = 0;          // Worker that produced the final result, 0 if none
+    double milliseconds = 0.0;
+    std::wstring note;        // Why a file failed without a result
+};
+
+// Per-file outcome and timing of a batch, merged from every worker
+class BatchReport
+{
+public:
+    void Reset(size_t fileCount);
+
+    BatchReportEntry& GetEntry(size_t index) { return m_entries[index]; }
+    const BatchReportEntry& GetEntry(size_t index) const { return m_entries[index]; }
+    size_t GetCount() const { return m_entries.size(); }
+
+    void SetWallMilliseconds(double milliseconds) { m_wallMilliseconds = milliseconds; }
+    double GetWallMilliseconds() const { return m_wallMilliseconds; }
+
+    void AddLostWorker() { m_lostWorkers++; }
+    UINT GetLostWorkers() const { return m_lostWorkers; }
+
+    size_t GetSucceeded() const;
+    size_t GetFailed() const;
+    size_t GetRetried() const;
+    double GetTotalMilliseconds() const;
+
+    // UTF-8 CSV, one row per file in batch order
+    bool WriteCsv(const std::wstring& path, const FileTable& files) const;
+
+private:
+    std::vector<BatchReportEntry> m_entries;
+    double m_wallMilliseconds = 0.0;
+    UINT m_lostWorkers = 0;
+};
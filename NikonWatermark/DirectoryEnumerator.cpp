@@ -0,0 +1,82 @@
+#include "stdafx.h"
+#include "DirectoryEnumerator.h"
+#include <vector>
+
+DirectoryEnumerator::DirectoryEnumerator(bool recursive) : m_recursive(recursive)
+{
+}
+
+DirectoryEnumerator::~DirectoryEnumerator()
+{
+}
+
+bool DirectoryEnumerator::IsImageFile(const WCHAR* fileName)
+{
+    const WCHAR* extension = wcsrchr(fileName, L'.');
+    if (extension == NULL)
+        return false;
+
+    static const WCHAR* const SUPPORTED_EXTENSIONS[] = { L".jpg", L".jpeg", L".png", L".bmp", L".tif", L".tiff" };
+
+    for (const WCHAR* supported : SUPPORTED_EXTENSIONS)
+    {
+        if (_wcsicmp(extension, supported) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+size_t DirectoryEnumerator::Enumerate(const std::wstring& root, const FileCallback& callback)
+{
+    size_t count = 0;
+
+    // Explicit stack instead of recursion so deeply nested trees cannot
+    // exhaust the thread stack
+    std::vector<std::wstring> pending;
+    pending.push_back(root);
+
+    while (!pending.empty())
+    {
+        std::wstring directory = pending.back();
+        pending.pop_back();
+
+        std::wstring pattern = directory + L"\\*";
+
+        WIN32_FIND_DATAW findData;
+        HANDLE hFind = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &findData,
+                                        FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+        if (hFind == INVALID_HANDLE_VALUE)
+            continue;
+
+        do
+        {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            {
+                if (!m_recursive)
+                    continue;
+
+                // Skip "." / ".." and junctions, which can form cycles
+                if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
+                    continue;
+                if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+                    continue;
+
+                pending.push_back(directory + L"\\" + findData.cFileName);
+            }
+            else if (IsImageFile(findData.cFileName))
+            {
+                count++;
+                if (!callback(directory, findData.cFileName))
+                {
+                    FindClose(hFind);
+                    return count;
+                }
+            }
+        } while (FindNextFileW(hFind, &findData));
+
+        FindClose(hFind);
+    }
+
+    return count;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+#include <functional>
+
+// Walks a folder tree one directory at a time and reports each supported
+// image as it is found, so huge folders are never materialised in memory.
+class DirectoryEnumerator
+{
+public:
+    // Returning false stops the walk
+    typedef std::function<bool(const std::wstring& directory, const WCHAR* fileName)> FileCallback;
+
+    explicit DirectoryEnumerator(bool recursive);
+    ~DirectoryEnumerator();
+
+    // Number of files reported, including the one that stopped the walk
+    size_t Enumerate(const std::wstring& root, const FileCallback& callback);
+
+    static bool IsImageFile(const WCHAR* fileName);
+
+private:
+    bool m_recursive;
+};
@@ -0,0 +1,369 @@
+#include "stdafx.h"
+#include "ExifParser.h"
+#include "TiffDirectory.h"
+
+// Tags read from IFD0 and the Exif IFD
+static const USHORT TAG_MAKE = 0x010F;
+static const USHORT TAG_MODEL = 0x0110;
+static const USHORT TAG_EXIF_IFD = 0x8769;
+static const USHORT TAG_EXPOSURE_TIME = 0x829A;
+static const USHORT TAG_FNUMBER = 0x829D;
+static const USHORT TAG_ISO = 0x8827;
+
+bool MemoryExifSource::Read(UINT64 position, void* buffer, UINT size)
+{
+    if (position > m_size || size > m_size - position)
+        return false;
+
+    memcpy(buffer, m_data + position, size);
+    return true;
+}
+
+FileExifSource::FileExifSource() : m_hFile(INVALID_HANDLE_VALUE), m_size(0)
+{
+}
+
+FileExifSource::~FileExifSource()
+{
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+}
+
+bool FileExifSource::Open(const std::wstring& path)
+{
+    m_hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                          OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(m_hFile, &size))
+        return false;
+
+    m_size = (UINT64)size.QuadPart;
+    return true;
+}
+
+bool FileExifSource::Read(UINT64 position, void* buffer, UINT size)
+{
+    if (position > m_size || size > m_size - position)
+        return false;
+
+    return TiffDirectory::ReadAt(m_hFile, position, buffer, size);
+}
+
+StreamExifSource::StreamExifSource(IStream* stream) : m_stream(stream), m_size(0)
+{
+    // A stream that cannot say its size reads as empty, and every read fails
+    STATSTG stat;
+    if (SUCCEEDED(m_stream->Stat(&stat, STATFLAG_NONAME)))
+        m_size = stat.cbSize.QuadPart;
+}
+
+bool StreamExifSource::Read(UINT64 position, void* buffer, UINT size)
+{
+    if (position > m_size || size > m_size - position)
+        return false;
+
+    LARGE_INTEGER offset;
+    offset.QuadPart = (LONGLONG)position;
+    if (FAILED(m_stream->Seek(offset, STREAM_SEEK_SET, NULL)))
+        return false;
+
+    ULONG read = 0;
+    return m_stream->Read(buffer, size, &read) == S_OK && read == size;
+}
+
+void ExifFields::Clear()
+{
+    make[0] = 0;
+    model[0] = 0;
+    fNumber[0] = fNumber[1] = 0;
+    exposureTime[0] = exposureTime[1] = 0;
+    iso = 0;
+    hasFNumber = false;
+    hasExposureTime = false;
+    hasISO = false;
+}
+
+// A TIFF structure inside the source: the whole file, or an APP1 payload.
+// Offsets are relative to base and never reach past limit.
+struct TiffBlock
+{
+    IExifSource* source;
+    UINT64 base;
+    UINT64 limit;
+    bool bigEndian;
+    bool readFailed;
+
+    UINT Read16(const BYTE* p) const
+    {
+        return bigEndian ? ((p[0] << 8) | p[1]) : (p[0] | (p[1] << 8));
+    }
+
+    UINT Read32(const BYTE* p) const
+    {
+        return bigEndian ? (((UINT)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3])
+                         : (p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT)p[3] << 24));
+    }
+
+    bool Read(UINT64 offset, void* buffer, UINT size)
+    {
+        if (offset > limit || size > limit - offset)
+            return false;
+
+        if (!source->Read(base + offset, buffer, size))
+        {
+            readFailed = true;
+            return false;
+        }
+        return true;
+    }
+};
+
+// Copies the first size bytes of an entry's value, which is stored inline
+// when the whole value fits in four bytes. The full declared value has to
+// lie inside the block, not just the part that is read.
+static bool ReadEntryValue(TiffBlock& block, const BYTE* entry, UINT64 valueBytes, void* buffer, UINT size)
+{
+    if (valueBytes <= 4)
+    {
+        memcpy(buffer, entry + 8, size);
+        return true;
+    }
+
+    UINT64 offset = block.Read32(entry + 8);
+    if (offset > block.limit || valueBytes > block.limit - offset)
+        return false;
+
+    return block.Read(offset, buffer, size);
+}
+
+static void ReadString(TiffBlock& block, const BYTE* entry, UINT count, char* value)
+{
+    // The first usable occurrence wins
+    if (value[0] != 0)
+        return;
+
+    char buffer[ExifFields::MAX_STRING_LENGTH];
+    UINT length = min(count, ExifFields::MAX_STRING_LENGTH);
+    if (!ReadEntryValue(block, entry, count, buffer, length))
+        return;
+
+    // Stop at the terminator, blank out control characters and drop the
+    // padding some cameras write
+    UINT used = 0;
+    while (used < length && buffer[used] != 0)
+    {
+        unsigned char c = (unsigned char)buffer[used];
+        value[used++] = (c < 0x20 || c == 0x7F) ? ' ' : (char)c;
+    }
+    while (used > 0 && value[used - 1] == ' ')
+        used--;
+    value[used] = 0;
+}
+
+static bool ReadRational(TiffBlock& block, const BYTE* entry, UINT count, UINT* value)
+{
+    BYTE bytes[8];
+    if (!ReadEntryValue(block, entry, count * 8ull, bytes, sizeof(bytes)))
+        return false;
+
+    UINT numerator = block.Read32(bytes);
+    UINT denominator = block.Read32(bytes + 4);
+    if (numerator == 0 || denominator == 0)
+        return false;
+
+    value[0] = numerator;
+    value[1] = denominator;
+    return true;
+}
+
+// Reads the watermark's tags from one IFD. exifOffset receives the Exif
+// IFD pointer if this directory has one.
+static bool ParseIfd(TiffBlock& block, UINT offset, ExifFields& fields, UINT& exifOffset)
+{
+    BYTE countBytes[2];
+    if (!block.Read(offset, countBytes, sizeof(countBytes)))
+        return false;
+
+    UINT count = block.Read16(countBytes);
+    if (count > ExifParser::MAX_IFD_ENTRIES)
+        return false;
+
+    BYTE entries[ExifParser::MAX_IFD_ENTRIES * 12];
+    if (count > 0 && !block.Read(offset + 2ull, entries, count * 12))
+        return false;
+
+    for (UINT i = 0; i < count; i++)
+    {
+        const BYTE* entry = &entries[i * 12];
+        USHORT tag = (USHORT)block.Read16(entry);
+        USHORT type = (USHORT)block.Read16(entry + 2);
+        UINT valueCount = block.Read32(entry + 4);
+        if (valueCount == 0)
+            continue;
+
+        switch (tag)
+        {
+        case TAG_MAKE:
+        case TAG_MODEL:
+            if (type == TIFF_ASCII)
+                ReadString(block, entry, valueCount, tag == TAG_MAKE ? fields.make : fields.model);
+            break;
+
+        case TAG_EXIF_IFD:
+            if ((type == TIFF_LONG || type == TIFF_IFD) && valueCount == 1 && exifOffset == 0)
+                exifOffset = block.Read32(entry + 8);
+            break;
+
+        case TAG_FNUMBER:
+            if (type == TIFF_RATIONAL && !fields.hasFNumber)
+                fields.hasFNumber = ReadRational(block, entry, valueCount, fields.fNumber);
+            break;
+
+        case TAG_EXPOSURE_TIME:
+            if (type == TIFF_RATIONAL && !fields.hasExposureTime)
+                fields.hasExposureTime = ReadRational(block, entry, valueCount, fields.exposureTime);
+            break;
+
+        case TAG_ISO:
+            if ((type == TIFF_SHORT || type == TIFF_LONG) && !fields.hasISO)
+            {
+                BYTE bytes[4];
+                UINT size = TiffDirectory::GetTypeSize(type);
+                if (ReadEntryValue(block, entry, (UINT64)size * valueCount, bytes, size))
+                {
+                    fields.iso = (type == TIFF_SHORT) ? block.Read16(bytes) : block.Read32(bytes);
+                    fields.hasISO = (fields.iso != 0);
+                }
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+ExifParseStatus ExifParser::ParseTiff(IExifSource& source, UINT64 base, UINT64 limit, ExifFields& fields)
+{
+    TiffBlock block = { &source, base, limit, false, false };
+
+    BYTE header[8];
+    if (!block.Read(0, header, sizeof(header)))
+        return block.readFailed ? ExifParseStatus::ReadError : ExifParseStatus::Malformed;
+
+    if (header[0] == 'I' && header[1] == 'I')
+        block.bigEndian = false;
+    else if (header[0] == 'M' && header[1] == 'M')
+        block.bigEndian = true;
+    else
+        return ExifParseStatus::Malformed;
+
+    if (block.Read16(header + 2) != 42)
+        return ExifParseStatus::Malformed;
+
+    UINT firstOffset = block.Read32(header + 4);
+    UINT exifOffset = 0;
+    bool success = ParseIfd(block, firstOffset, fields, exifOffset);
+
+    // Only two directories are ever visited
+    if (success && exifOffset != 0 && exifOffset != firstOffset)
+    {
+        UINT ignored = 0;
+        success = ParseIfd(block, exifOffset, fields, ignored);
+    }
+
+    if (block.readFailed)
+        return ExifParseStatus::ReadError;
+    return success ? ExifParseStatus::Ok : ExifParseStatus::Malformed;
+}
+
+ExifParseStatus ExifParser::ParseJpeg(IExifSource& source, ExifFields& fields)
+{
+    static const BYTE EXIF_HEADER[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+
+    UINT64 size = source.GetSize();
+    UINT64 position = 2;
+
+    // Fill bytes count as segments, so this bounds the scan as well
+    for (UINT segment = 0; segment < MAX_JPEG_SEGMENTS; segment++)
+    {
+        BYTE marker[4];
+        if (position + sizeof(marker) > size)
+            return ExifParseStatus::NoExif;
+        if (!source.Read(position, marker, sizeof(marker)))
+            return ExifParseStatus::ReadError;
+
+        if (marker[0] != 0xFF)
+            return ExifParseStatus::Malformed;
+
+        if (marker[1] == 0xFF)
+        {
+            position++;
+            continue;
+        }
+
+        // EXIF always precedes the scan
+        if (marker[1] == 0xD9 || marker[1] == 0xDA)
+            return ExifParseStatus::NoExif;
+
+        // Standalone markers carry no length
+        if (marker[1] == 0x01 || (marker[1] >= 0xD0 && marker[1] <= 0xD7))
+        {
+            position += 2;
+            continue;
+        }
+
+        UINT length = (marker[2] << 8) | marker[3];
+        if (length < 2)
+            return ExifParseStatus::Malformed;
+
+        if (marker[1] == 0xE1 && length >= 2 + sizeof(EXIF_HEADER))
+        {
+            BYTE header[sizeof(EXIF_HEADER)];
+            if (position + 4 + sizeof(header) > size)
+                return ExifParseStatus::Malformed;
+            if (!source.Read(position + 4, header, sizeof(header)))
+                return ExifParseStatus::ReadError;
+
+            // The TIFF structure is confined to the segment, whatever its offsets say
+            if (memcmp(header, EXIF_HEADER, sizeof(EXIF_HEADER)) == 0)
+            {
+                UINT64 base = position + 4 + sizeof(EXIF_HEADER);
+                UINT64 limit = min((UINT64)(length - 2 - sizeof(EXIF_HEADER)), size - min(base, size));
+                return ParseTiff(source, base, limit, fields);
+            }
+        }
+
+        position += 2 + length;
+    }
+
+    return ExifParseStatus::NoExif;
+}
+
+ExifParseStatus ExifParser::Parse(IExifSource& source, ExifFields& fields)
+{
+    fields.Clear();
+
+    BYTE signature[4];
+    if (source.GetSize() < sizeof(signature))
+        return ExifParseStatus::NoExif;
+    if (!source.Read(0, signature, sizeof(signature)))
+        return ExifParseStatus::ReadError;
+
+    if (signature[0] == 0xFF && signature[1] == 0xD8)
+        return ParseJpeg(source, fields);
+
+    if ((signature[0] == 'I' && signature[1] == 'I' && signature[2] == 42 && signature[3] == 0) ||
+        (signature[0] == 'M' && signature[1] == 'M' && signature[2] == 0 && signature[3] == 42))
+        return ParseTiff(source, 0, source.GetSize(), fields);
+
+    return ExifParseStatus::NoExif;
+}
+
+ExifParseStatus ExifParser::ParseBuffer(const BYTE* data, size_t size, ExifFields& fields)
+{
+    MemoryExifSource source(data, size);
+    return Parse(source, fields);
+}
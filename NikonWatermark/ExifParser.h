@@ -0,0 +1,116 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+
+// Random access to the bytes being parsed
+class IExifSource
+{
+public:
+    virtual ~IExifSource() {}
+
+    virtual UINT64 GetSize() const = 0;
+
+    // Fails (rather than returning short data) if the range cannot be read
+    virtual bool Read(UINT64 position, void* buffer, UINT size) = 0;
+};
+
+class MemoryExifSource : public IExifSource
+{
+public:
+    MemoryExifSource(const BYTE* data, size_t size) : m_data(data), m_size(size) {}
+
+    virtual UINT64 GetSize() const { return m_size; }
+    virtual bool Read(UINT64 position, void* buffer, UINT size);
+
+private:
+    const BYTE* m_data;
+    size_t m_size;
+};
+
+// Reads with positioned I/O; a failing card surfaces as a failed read
+class FileExifSource : public IExifSource
+{
+public:
+    FileExifSource();
+    virtual ~FileExifSource();
+
+    bool Open(const std::wstring& path);
+
+    virtual UINT64 GetSize() const { return m_size; }
+    virtual bool Read(UINT64 position, void* buffer, UINT size);
+
+private:
+    FileExifSource(const FileExifSource&);
+    FileExifSource& operator=(const FileExifSource&);
+
+    HANDLE m_hFile;
+    UINT64 m_size;
+};
+
+// Reads through a stream someone else opened, so the decoder that gets the
+// stream afterwards does not have to open the file again
+class StreamExifSource : public IExifSource
+{
+public:
+    explicit StreamExifSource(IStream* stream);
+
+    virtual UINT64 GetSize() const { return m_size; }
+    virtual bool Read(UINT64 position, void* buffer, UINT size);
+
+private:
+    StreamExifSource(const StreamExifSource&);
+    StreamExifSource& operator=(const StreamExifSource&);
+
+    IStream* m_stream;
+    UINT64 m_size;
+};
+
+// The tags the watermark uses, each validated on its own: a field is only
+// set if its type, count and value range are sane
+struct ExifFields
+{
+    static const UINT MAX_STRING_LENGTH = 64;
+
+    char make[MAX_STRING_LENGTH + 1];
+    char model[MAX_STRING_LENGTH + 1];
+    UINT fNumber[2];        // Numerator, denominator
+    UINT exposureTime[2];
+    UINT iso;
+    bool hasFNumber;
+    bool hasExposureTime;
+    bool hasISO;
+
+    void Clear();
+};
+
+enum class ExifParseStatus
+{
+    Ok,
+    NoExif,       // Not a JPEG or TIFF, or no EXIF block
+    Malformed,    // Structure broken or over a limit; fields read so far are kept
+    ReadError
+};
+
+// Bounded EXIF reader for JPEG (APP1) and TIFF files. The work done is
+// fixed by the limits below, whatever the input: at most
+// MAX_JPEG_SEGMENTS marker reads, then IFD0 and the Exif IFD, each capped
+// at MAX_IFD_ENTRIES entries. The Exif IFD pointer is the only offset
+// followed, so there is no recursion and no cycle to detect. Strings are
+// cut at MAX_STRING_LENGTH, and every offset is range-checked before it
+// is read.
+class ExifParser
+{
+public:
+    static ExifParseStatus Parse(IExifSource& source, ExifFields& fields);
+
+    // Parses a complete file image held in memory; the entry point for
+    // fuzzers and throughput runs
+    static ExifParseStatus ParseBuffer(const BYTE* data, size_t size, ExifFields& fields);
+
+    static const UINT MAX_JPEG_SEGMENTS = 256;
+    static const UINT MAX_IFD_ENTRIES = 512;
+
+private:
+    static ExifParseStatus ParseJpeg(IExifSource& source, ExifFields& fields);
+    static ExifParseStatus ParseTiff(IExifSource& source, UINT64 base, UINT64 limit, ExifFields& fields);
+};
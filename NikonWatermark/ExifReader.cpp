@@ -1,135 +1,72 @@
 #include "stdafx.h"
 #include "ExifReader.h"
-#include <sstream>
-#include <iomanip>
+#include "ExposureFormatter.h"
 
 ExifReader::ExifReader()
 {
+    m_fields.Clear();
 }
 
 ExifReader::~ExifReader()
 {
 }
 
-std::wstring ExifReader::GetPropertyItemAsString(Gdiplus::Image* image, PROPID propId)
+void ExifReader::AssignString(const char* value, std::wstring& target)
 {
-    UINT size = image->GetPropertyItemSize(propId);
-    if (size == 0)
-        return L"";
-    
-    std::vector<BYTE> buffer(size);
-    Gdiplus::PropertyItem* pItem = (Gdiplus::PropertyItem*)&buffer[0];
-    
-    if (image->GetPropertyItem(propId, size, pItem) != Gdiplus::Ok)
-        return L"";
-    
-    if (pItem->type == PropertyTagTypeASCII)
-    {
-        std::string str((char*)pItem->value);
-        return std::wstring(str.begin(), str.end());
-    }
-    
-    return L"";
+    // Parser strings are bounded and terminated; bytes map to Latin-1
+    target.clear();
+    while (*value)
+        target += (wchar_t)(unsigned char)*value++;
 }
 
-std::wstring ExifReader::GetPropertyItemAsRational(Gdiplus::Image* image, PROPID propId)
-{
-    UINT size = image->GetPropertyItemSize(propId);
-    if (size == 0)
-        return L"";
-    
-    std::vector<BYTE> buffer(size);
-    Gdiplus::PropertyItem* pItem = (Gdiplus::PropertyItem*)&buffer[0];
-    
-    if (image->GetPropertyItem(propId, size, pItem) != Gdiplus::Ok)
-        return L"";
-    
-    if (pItem->type == PropertyTagTypeRational)
-    {
-        UINT* rational = (UINT*)pItem->value;
-        if (rational[1] != 0)
-        {
-            double value = (double)rational[0] / (double)rational[1];
-            std::wostringstream oss;
-            oss << std::fixed << std::setprecision(1) << value;
-            return oss.str();
-        }
-    }
-    
-    return L"";
-}
-
-std::wstring ExifReader::FormatAperture(const std::wstring& value)
-{
-    if (value.empty())
-        return L"";
-    
-    double aperture = _wtof(value.c_str());
-    std::wostringstream oss;
-    oss << L"f/" << std::fixed << std::setprecision(1) << aperture;
-    return oss.str();
-}
-
-std::wstring ExifReader::FormatShutterSpeed(const std::wstring& value)
+bool ExifReader::ReadExifData(const std::wstring& filePath, ExifData& exifData)
 {
-    if (value.empty())
-        return L"";
-    
-    double speed = _wtof(value.c_str());
+    FileExifSource source;
+    if (!source.Open(filePath))
+        return false;
     
-    if (speed < 1.0)
-    {
-        std::wostringstream oss;
-        oss << L"1/" << (int)(1.0 / speed);
-        return oss.str();
-    }
-    else
-    {
-        std::wostringstream oss;
-        oss << std::fixed << std::setprecision(1) << speed << L"s";
-        return oss.str();
-    }
+    return ReadExifData(source, exifData);
 }
 
-bool ExifReader::ReadExifData(const std::wstring& filePath, ExifData& exifData)
+bool ExifReader::ReadExifData(IExifSource& source, ExifData& exifData)
 {
-    Gdiplus::Image image(filePath.c_str());
-    
-    if (image.GetLastStatus() != Gdiplus::Ok)
+    // A malformed block still yields whatever fields were valid before the damage
+    if (ExifParser::Parse(source, m_fields) == ExifParseStatus::ReadError)
         return false;
     
     // Read manufacturer
-    exifData.manufacturer = GetPropertyItemAsString(&image, PropertyTagEquipMake);
+    AssignString(m_fields.make, exifData.manufacturer);
     
     // Read model
-    exifData.model = GetPropertyItemAsString(&image, PropertyTagEquipModel);
+    AssignString(m_fields.model, exifData.model);
+    
+    WCHAR buffer[ExposureFormatter::MAX_LENGTH];
+    size_t length;
     
     // Read aperture (F-Number)
-    std::wstring aperture = GetPropertyItemAsRational(&image, PropertyTagExifFNumber);
-    exifData.aperture = FormatAperture(aperture);
+    exifData.aperture.clear();
+    if (m_fields.hasFNumber)
+    {
+        length = ExposureFormatter::FormatAperture(m_fields.fNumber[0], m_fields.fNumber[1], buffer, _countof(buffer));
+        exifData.aperture.assign(buffer, length);
+    }
     
     // Read ISO
-    UINT size = image.GetPropertyItemSize(PropertyTagExifISOSpeed);
-    if (size > 0)
+    exifData.iso.clear();
+    if (m_fields.hasISO)
     {
-        std::vector<BYTE> buffer(size);
-        Gdiplus::PropertyItem* pItem = (Gdiplus::PropertyItem*)&buffer[0];
-        
-        if (image.GetPropertyItem(PropertyTagExifISOSpeed, size, pItem) == Gdiplus::Ok)
-        {
-            if (pItem->type == PropertyTagTypeShort)
-            {
-                USHORT* iso = (USHORT*)pItem->value;
-                std::wostringstream oss;
-                oss << L"ISO " << *iso;
-                exifData.iso = oss.str();
-            }
-        }
+        length = ExposureFormatter::FormatISO(m_fields.iso, buffer, _countof(buffer));
+        exifData.iso.assign(buffer, length);
     }
     
     // Read shutter speed (exposure time)
-    std::wstring shutter = GetPropertyItemAsRational(&image, PropertyTagExifExposureTime);
-    exifData.shutterSpeed = FormatShutterSpeed(shutter);
+    exifData.shutterSpeed.clear();
+    if (m_fields.hasExposureTime)
+    {
+        length = ExposureFormatter::FormatShutterSpeed(m_fields.exposureTime[0], m_fields.exposureTime[1], 
+                                                       buffer, _countof(buffer));
+        exifData.shutterSpeed.assign(buffer, length);
+    }
     
     return true;
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include "stdafx.h"
+#include "ExifParser.h"
 #include <string>
 #include <map>
 
@@ -12,17 +13,23 @@ struct ExifData
     std::wstring model;
 };
 
+// Fills ExifData through ExifParser, so a damaged file costs no more than
+// a good one; GDI+ is not involved. The strings in exifData are reused, so
+// a reader fed the same ExifData for every file allocates nothing once
+// warmed up.
 class ExifReader
 {
 public:
     ExifReader();
     ~ExifReader();
     
+    // Fails only if the file cannot be read; a file without (usable) EXIF
+    // yields empty fields
     bool ReadExifData(const std::wstring& filePath, ExifData& exifData);
+    bool ReadExifData(IExifSource& source, ExifData& exifData);
     
 private:
-    std::wstring GetPropertyItemAsString(Gdiplus::Image* image, PROPID propId);
-    std::wstring GetPropertyItemAsRational(Gdiplus::Image* image, PROPID propId);
-    std::wstring FormatAperture(const std::wstring& value);
-    std::wstring FormatShutterSpeed(const std::wstring& value);
+    ExifFields m_fields;
+    
+    static void AssignString(const char* value, std::wstring& target);
 };
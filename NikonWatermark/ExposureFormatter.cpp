@@ -0,0 +1,251 @@
+#include "stdafx.h"
+#include "ExposureFormatter.h"
+#include <algorithm>
+
+namespace
+{
+    struct Stop
+    {
+        double value;
+        const WCHAR* label;
+    };
+
+    // Nominal shutter speeds in seconds (1/3-stop scale plus the extra
+    // 1/2-stop markings), ascending
+    const Stop SHUTTER_STOPS[] =
+    {
+        { 1.0 / 32000, L"1/32000" }, { 1.0 / 25000, L"1/25000" }, { 1.0 / 20000, L"1/20000" },
+        { 1.0 / 16000, L"1/16000" }, { 1.0 / 12500, L"1/12500" }, { 1.0 / 10000, L"1/10000" },
+        { 1.0 / 8000, L"1/8000" }, { 1.0 / 6400, L"1/6400" }, { 1.0 / 6000, L"1/6000" },
+        { 1.0 / 5000, L"1/5000" }, { 1.0 / 4000, L"1/4000" }, { 1.0 / 3200, L"1/3200" },
+        { 1.0 / 3000, L"1/3000" }, { 1.0 / 2500, L"1/2500" }, { 1.0 / 2000, L"1/2000" },
+        { 1.0 / 1600, L"1/1600" }, { 1.0 / 1500, L"1/1500" }, { 1.0 / 1250, L"1/1250" },
+        { 1.0 / 1000, L"1/1000" }, { 1.0 / 800, L"1/800" }, { 1.0 / 750, L"1/750" },
+        { 1.0 / 640, L"1/640" }, { 1.0 / 500, L"1/500" }, { 1.0 / 400, L"1/400" },
+        { 1.0 / 350, L"1/350" }, { 1.0 / 320, L"1/320" }, { 1.0 / 250, L"1/250" },
+        { 1.0 / 200, L"1/200" }, { 1.0 / 180, L"1/180" }, { 1.0 / 160, L"1/160" },
+        { 1.0 / 125, L"1/125" }, { 1.0 / 100, L"1/100" }, { 1.0 / 90, L"1/90" },
+        { 1.0 / 80, L"1/80" }, { 1.0 / 60, L"1/60" }, { 1.0 / 50, L"1/50" },
+        { 1.0 / 45, L"1/45" }, { 1.0 / 40, L"1/40" }, { 1.0 / 30, L"1/30" },
+        { 1.0 / 25, L"1/25" }, { 1.0 / 20, L"1/20" }, { 1.0 / 15, L"1/15" },
+        { 1.0 / 13, L"1/13" }, { 1.0 / 10, L"1/10" }, { 1.0 / 8, L"1/8" },
+        { 1.0 / 6, L"1/6" }, { 1.0 / 5, L"1/5" }, { 1.0 / 4, L"1/4" },
+        { 0.3, L"0.3s" }, { 0.4, L"0.4s" }, { 0.5, L"0.5s" },
+        { 0.6, L"0.6s" }, { 0.7, L"0.7s" }, { 0.8, L"0.8s" },
+        { 1.0, L"1s" }, { 1.3, L"1.3s" }, { 1.5, L"1.5s" },
+        { 1.6, L"1.6s" }, { 2.0, L"2s" }, { 2.5, L"2.5s" },
+        { 3.0, L"3s" }, { 3.2, L"3.2s" }, { 4.0, L"4s" },
+        { 5.0, L"5s" }, { 6.0, L"6s" }, { 8.0, L"8s" },
+        { 10.0, L"10s" }, { 13.0, L"13s" }, { 15.0, L"15s" },
+        { 20.0, L"20s" }, { 25.0, L"25s" }, { 30.0, L"30s" }
+    };
+
+    // Nominal f-numbers (1/3-stop scale plus the extra 1/2-stop markings),
+    // ascending. The 1/2-stop f/13 (2^3.75 = 13.45) sits midway between the
+    // f/13 and f/14 markings, so it is also listed at its true value to keep
+    // APEX rounding from tipping it to f/14.
+    const Stop APERTURE_STOPS[] =
+    {
+        { 0.95, L"f/0.95" }, { 1.0, L"f/1" }, { 1.1, L"f/1.1" },
+        { 1.2, L"f/1.2" }, { 1.4, L"f/1.4" }, { 1.6, L"f/1.6" },
+        { 1.7, L"f/1.7" }, { 1.8, L"f/1.8" }, { 2.0, L"f/2" },
+        { 2.2, L"f/2.2" }, { 2.4, L"f/2.4" }, { 2.5, L"f/2.5" },
+        { 2.8, L"f/2.8" }, { 3.2, L"f/3.2" }, { 3.3, L"f/3.3" },
+        { 3.5, L"f/3.5" }, { 4.0, L"f/4" }, { 4.5, L"f/4.5" },
+        { 4.8, L"f/4.8" }, { 5.0, L"f/5" }, { 5.6, L"f/5.6" },
+        { 6.3, L"f/6.3" }, { 6.7, L"f/6.7" }, { 7.1, L"f/7.1" },
+        { 8.0, L"f/8" }, { 9.0, L"f/9" }, { 9.5, L"f/9.5" },
+        { 10.0, L"f/10" }, { 11.0, L"f/11" }, { 13.0, L"f/13" },
+        { 13.45, L"f/13" }, { 14.0, L"f/14" }, { 16.0, L"f/16" },
+        { 18.0, L"f/18" }, { 19.0, L"f/19" }, { 20.0, L"f/20" },
+        { 22.0, L"f/22" }, { 25.0, L"f/25" }, { 27.0, L"f/27" },
+        { 29.0, L"f/29" }, { 32.0, L"f/32" }, { 36.0, L"f/36" },
+        { 38.0, L"f/38" }, { 40.0, L"f/40" }, { 45.0, L"f/45" },
+        { 51.0, L"f/51" }, { 54.0, L"f/54" }, { 57.0, L"f/57" },
+        { 64.0, L"f/64" }
+    };
+
+    // Tolerances are ratios of the value itself. Shutter speeds allow 1/8
+    // stop. F-numbers change by sqrt(2) per stop and their nominal markings
+    // drift further from the true series (f/1.2 is really 1.26), so they
+    // allow 1/6 stop, which is still less than half the 1/2-to-1/3 gap.
+    const double SHUTTER_TOLERANCE = 1.0905077;   // 2^(1/8)
+    const double APERTURE_TOLERANCE = 1.0594631;  // 2^(1/12)
+
+    template<size_t N>
+    const WCHAR* FindStop(const Stop (&stops)[N], double value, double tolerance)
+    {
+        const Stop* upper = std::lower_bound(stops, stops + N, value,
+            [](const Stop& stop, double v) { return stop.value < v; });
+
+        // The nearest stop is either the first one not below the value or
+        // the one just before it; compare them as ratios, not differences
+        const Stop* best = NULL;
+        double bestRatio = tolerance;
+
+        if (upper != stops + N)
+        {
+            double ratio = upper->value / value;
+            if (ratio <= bestRatio)
+            {
+                best = upper;
+                bestRatio = ratio;
+            }
+        }
+
+        if (upper != stops)
+        {
+            const Stop* lower = upper - 1;
+            double ratio = value / lower->value;
+            if (ratio <= bestRatio)
+                best = lower;
+        }
+
+        return best ? best->label : NULL;
+    }
+
+    size_t CopyLabel(const WCHAR* label, WCHAR* buffer, size_t bufferLength)
+    {
+        size_t length = wcslen(label);
+        if (length + 1 > bufferLength)
+            return 0;
+
+        wmemcpy(buffer, label, length + 1);
+        return length;
+    }
+
+    // Writers below return the advanced output pointer, or NULL once the
+    // buffer has run out
+    WCHAR* AppendText(WCHAR* p, WCHAR* end, const WCHAR* text)
+    {
+        while (p != NULL && *text)
+        {
+            if (p == end)
+                return NULL;
+            *p++ = *text++;
+        }
+        return p;
+    }
+
+    WCHAR* AppendUInt(WCHAR* p, WCHAR* end, UINT64 value)
+    {
+        if (p == NULL)
+            return NULL;
+
+        WCHAR digits[20];
+        size_t count = 0;
+
+        do
+        {
+            digits[count++] = (WCHAR)(L'0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+
+        if ((size_t)(end - p) < count)
+            return NULL;
+
+        while (count > 0)
+            *p++ = digits[--count];
+        return p;
+    }
+
+    // Writes a value given in tenths as "12" or "12.5"
+    WCHAR* AppendTenths(WCHAR* p, WCHAR* end, UINT64 tenths)
+    {
+        p = AppendUInt(p, end, tenths / 10);
+        if (p != NULL && tenths % 10 != 0)
+        {
+            if (end - p < 2)
+                return NULL;
+            *p++ = L'.';
+            *p++ = (WCHAR)(L'0' + tenths % 10);
+        }
+        return p;
+    }
+
+    size_t Terminate(WCHAR* buffer, WCHAR* p, WCHAR* end)
+    {
+        if (p == NULL || p == end)
+        {
+            if (end != buffer)
+                buffer[0] = 0;
+            return 0;
+        }
+
+        *p = 0;
+        return p - buffer;
+    }
+
+    // round(numerator / denominator) in integer arithmetic
+    UINT64 RoundedQuotient(UINT64 numerator, UINT64 denominator)
+    {
+        return (numerator * 2 + denominator) / (denominator * 2);
+    }
+}
+
+size_t ExposureFormatter::FormatShutterSpeed(UINT numerator, UINT denominator, WCHAR* buffer, size_t bufferLength)
+{
+    if (numerator == 0 || denominator == 0 || bufferLength == 0)
+        return 0;
+
+    const WCHAR* label = FindStop(SHUTTER_STOPS, (double)numerator / denominator, SHUTTER_TOLERANCE);
+    if (label != NULL)
+        return CopyLabel(label, buffer, bufferLength);
+
+    WCHAR* end = buffer + bufferLength;
+    WCHAR* p = buffer;
+
+    if ((UINT64)numerator * 10 < (UINT64)denominator * 3)
+    {
+        // Below 0.3s photographers read reciprocals: "1/90"
+        p = AppendText(p, end, L"1/");
+        p = AppendUInt(p, end, RoundedQuotient(denominator, numerator));
+    }
+    else
+    {
+        p = AppendTenths(p, end, RoundedQuotient((UINT64)numerator * 10, denominator));
+        p = AppendText(p, end, L"s");
+    }
+
+    return Terminate(buffer, p, end);
+}
+
+size_t ExposureFormatter::FormatAperture(UINT numerator, UINT denominator, WCHAR* buffer, size_t bufferLength)
+{
+    if (numerator == 0 || denominator == 0 || bufferLength == 0)
+        return 0;
+
+    // Zooms and adapted lenses report exact in-between values such as 42/10,
+    // which are not a rough f/4; only APEX-derived values (566/100) and
+    // odd-denominator rationals are snapped to the nearest marking
+    if ((UINT64)numerator * 10 % denominator != 0)
+    {
+        const WCHAR* label = FindStop(APERTURE_STOPS, (double)numerator / denominator, APERTURE_TOLERANCE);
+        if (label != NULL)
+            return CopyLabel(label, buffer, bufferLength);
+    }
+
+    UINT64 tenths = RoundedQuotient((UINT64)numerator * 10, denominator);
+    if (tenths == 0)
+        return 0;
+
+    WCHAR* end = buffer + bufferLength;
+    WCHAR* p = AppendText(buffer, end, L"f/");
+    p = AppendTenths(p, end, tenths);
+
+    return Terminate(buffer, p, end);
+}
+
+size_t ExposureFormatter::FormatISO(UINT iso, WCHAR* buffer, size_t bufferLength)
+{
+    // ISO is recorded as an exact integer (auto-ISO happily picks 1/6-stop
+    // values such as 140), so it is printed as-is rather than snapped
+    if (iso == 0 || bufferLength == 0)
+        return 0;
+
+    WCHAR* end = buffer + bufferLength;
+    WCHAR* p = AppendText(buffer, end, L"ISO ");
+    p = AppendUInt(p, end, iso);
+
+    return Terminate(buffer, p, end);
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include "stdafx.h"
+
+// Formats exposure settings straight from the EXIF rationals into a
+// caller-supplied buffer. Values that fall on (or very close to) the
+// standard 1/3- and 1/2-stop scales print as the nominal camera marking, so
+// APEX-derived encodings such as 1/8192 s or f/5.66 read "1/8000" and
+// "f/5.6". F-numbers that are an exact number of tenths (42/10) are what the
+// lens reported and print unchanged. Anything else is rounded from the
+// exact rational.
+//
+// Each function returns the number of characters written (excluding the
+// terminator), or 0 if the value is invalid or the buffer is too small.
+class ExposureFormatter
+{
+public:
+    static const size_t MAX_LENGTH = 24;
+
+    static size_t FormatShutterSpeed(UINT numerator, UINT denominator, WCHAR* buffer, size_t bufferLength);
+    static size_t FormatAperture(UINT numerator, UINT denominator, WCHAR* buffer, size_t bufferLength);
+    static size_t FormatISO(UINT iso, WCHAR* buffer, size_t bufferLength);
+};
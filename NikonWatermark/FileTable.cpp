@@ -0,0 +1,172 @@
+#include "stdafx.h"
+#include "FileTable.h"
+#include <algorithm>
+#include <unordered_set>
+
+static const UINT NO_DIRECTORY = (UINT)-1;
+
+FileTable::FileTable() : m_lastDirectory(NO_DIRECTORY)
+{
+}
+
+FileTable::~FileTable()
+{
+}
+
+void FileTable::Clear()
+{
+    m_directories.clear();
+    m_directoryIndex.clear();
+    m_lastDirectory = NO_DIRECTORY;
+    m_names.clear();
+    m_entries.clear();
+    m_status.clear();
+    m_root.clear();
+    m_outputNames.clear();
+}
+
+void FileTable::Reserve(size_t count)
+{
+    m_entries.reserve(count);
+    m_status.reserve(count);
+
+    // Typical camera file names ("DSC_0001.JPG") are 12 characters
+    m_names.reserve(count * 13);
+}
+
+UINT FileTable::InternDirectory(const std::wstring& directory)
+{
+    // Enumeration yields files grouped by folder, so the previous lookup
+    // almost always matches and the hash map is only hit on folder changes
+    if (m_lastDirectory != NO_DIRECTORY && m_directories[m_lastDirectory] == directory)
+        return m_lastDirectory;
+
+    auto it = m_directoryIndex.find(directory);
+    if (it != m_directoryIndex.end())
+    {
+        m_lastDirectory = it->second;
+        return m_lastDirectory;
+    }
+
+    UINT index = (UINT)m_directories.size();
+    m_directories.push_back(directory);
+    m_directoryIndex.emplace(directory, index);
+    m_lastDirectory = index;
+    return index;
+}
+
+size_t FileTable::Add(const std::wstring& directory, const WCHAR* fileName)
+{
+    Entry entry;
+    entry.directory = InternDirectory(directory);
+    entry.nameOffset = (UINT)m_names.size();
+
+    m_names.insert(m_names.end(), fileName, fileName + wcslen(fileName) + 1);
+    m_entries.push_back(entry);
+    m_status.push_back(FileStatus::Pending);
+
+    return m_entries.size() - 1;
+}
+
+size_t FileTable::AddPath(const std::wstring& fullPath)
+{
+    size_t pos = fullPath.find_last_of(L"\\");
+    if (pos == std::wstring::npos)
+        return Add(std::wstring(), fullPath.c_str());
+
+    return Add(fullPath.substr(0, pos), fullPath.c_str() + pos + 1);
+}
+
+std::wstring FileTable::GetFullPath(size_t index) const
+{
+    const Entry& entry = m_entries[index];
+    const std::wstring& directory = m_directories[entry.directory];
+
+    if (directory.empty())
+        return &m_names[entry.nameOffset];
+
+    std::wstring path = directory;
+    path += L"\\";
+    path += &m_names[entry.nameOffset];
+    return path;
+}
+
+const WCHAR* FileTable::GetFileName(size_t index) const
+{
+    return &m_names[m_entries[index].nameOffset];
+}
+
+std::wstring FileTable::GetRelativeName(size_t index) const
+{
+    const Entry& entry = m_entries[index];
+    const std::wstring& directory = m_directories[entry.directory];
+    const WCHAR* fileName = &m_names[entry.nameOffset];
+
+    size_t rootLength = m_root.length();
+    if (rootLength == 0 || directory.length() <= rootLength ||
+        _wcsnicmp(directory.c_str(), m_root.c_str(), rootLength) != 0)
+        return fileName;
+
+    // A drive root ("D:\") already ends in the separator, and "C:\Photos2"
+    // is not under "C:\Photos"
+    size_t start = rootLength;
+    while (start < directory.length() && directory[start] == L'\\')
+        start++;
+    if (start == directory.length() || (start == rootLength && m_root[rootLength - 1] != L'\\'))
+        return fileName;
+
+    std::wstring name = directory.substr(start);
+    name += L"\\";
+    name += fileName;
+    return name;
+}
+
+void FileTable::AssignOutputNames()
+{
+    m_outputNames.clear();
+
+    // Output names clash if they differ only in case, as on NTFS
+    std::unordered_set<std::wstring> used;
+    used.reserve(m_entries.size());
+
+    std::wstring key;
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        std::wstring name = GetRelativeName(i);
+        key = name;
+        CharLowerBuffW(&key[0], (DWORD)key.length());
+        if (used.insert(key).second)
+            continue;
+
+        size_t slash = name.find_last_of(L'\\');
+        size_t dot = name.find_last_of(L'.');
+        if (dot == std::wstring::npos || (slash != std::wstring::npos && dot < slash))
+            dot = name.length();
+
+        for (UINT copy = 2; ; copy++)
+        {
+            std::wstring candidate = name.substr(0, dot) + L" (" + std::to_wstring(copy) + L")" + name.substr(dot);
+            key = candidate;
+            CharLowerBuffW(&key[0], (DWORD)key.length());
+            if (used.insert(key).second)
+            {
+                m_outputNames.emplace(i, candidate);
+                break;
+            }
+        }
+    }
+}
+
+std::wstring FileTable::GetOutputName(size_t index) const
+{
+    auto it = m_outputNames.find(index);
+    if (it != m_outputNames.end())
+        return it->second;
+
+    return GetRelativeName(index);
+}
+
+void FileTable::ResetStatus()
+{
+    std::fill(m_status.begin(), m_status.end(), FileStatus::Pending);
+}
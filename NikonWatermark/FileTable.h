@@ -0,0 +1,73 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+enum class FileStatus : BYTE
+{
+    Pending,
+    Succeeded,
+    Failed
+};
+
+// Compact list of imported files. Directory prefixes are stored once and
+// file names are packed into a single character pool, so each entry costs
+// a few bytes plus its file name regardless of how deep the folder is.
+class FileTable
+{
+public:
+    FileTable();
+    ~FileTable();
+
+    void Clear();
+    void Reserve(size_t count);
+
+    size_t Add(const std::wstring& directory, const WCHAR* fileName);
+    size_t AddPath(const std::wstring& fullPath);
+
+    size_t GetCount() const { return m_entries.size(); }
+    std::wstring GetFullPath(size_t index) const;
+
+    // The returned pointer is only valid until the next call to Add/AddPath
+    const WCHAR* GetFileName(size_t index) const;
+
+    // Files under the root keep their subfolders in the output; files
+    // outside it (and every file when there is no root) are named by their
+    // file name alone. Clear() resets it.
+    void SetRoot(const std::wstring& root) { m_root = root; }
+
+    // Gives files whose output names would clash a " (2)"-style suffix, so
+    // no two entries write the same output file. Call after the last Add.
+    void AssignOutputNames();
+
+    // Path of the entry's output file relative to the output folder
+    std::wstring GetOutputName(size_t index) const;
+
+    FileStatus GetStatus(size_t index) const { return m_status[index]; }
+    void SetStatus(size_t index, FileStatus status) { m_status[index] = status; }
+    void ResetStatus();
+
+private:
+    struct Entry
+    {
+        UINT directory;
+        UINT nameOffset;
+    };
+
+    UINT InternDirectory(const std::wstring& directory);
+    std::wstring GetRelativeName(size_t index) const;
+
+    std::vector<std::wstring> m_directories;
+    std::unordered_map<std::wstring, UINT> m_directoryIndex;
+    UINT m_lastDirectory;
+
+    std::vector<WCHAR> m_names;
+    std::vector<Entry> m_entries;
+    std::vector<FileStatus> m_status;
+
+    std::wstring m_root;
+
+    // Only the entries that had to be renamed
+    std::unordered_map<size_t, std::wstring> m_outputNames;
+};
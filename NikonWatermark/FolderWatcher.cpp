@@ -0,0 +1,391 @@
+#include "stdafx.h"
+#include "FolderWatcher.h"
+#include "DirectoryEnumerator.h"
+#include <algorithm>
+
+// Notification buffers above 64KB fail on network shares
+static const DWORD NOTIFY_BUFFER_BYTES = 64 * 1024;
+static const DWORD POLL_INTERVAL_MS = 1000;
+static const DWORD CANDIDATE_CHECK_MS = 50;
+static const DWORD NOTIFY_FILTER = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+
+static ULONGLONG ToULongLong(const FILETIME& time)
+{
+    return ((ULONGLONG)time.dwHighDateTime << 32) | time.dwLowDateTime;
+}
+
+FolderWatcher::FolderWatcher() : m_deliveredFloor(0), m_scan(0), m_settleMs(0), m_stopEvent(NULL)
+{
+}
+
+FolderWatcher::~FolderWatcher()
+{
+    Stop();
+}
+
+bool FolderWatcher::Start(const std::vector<std::wstring>& directories, DWORD settleMs, const ReadyCallback& callback)
+{
+    if (IsRunning() || directories.empty())
+        return false;
+
+    // One wait slot is taken by the stop event
+    if (directories.size() > MAXIMUM_WAIT_OBJECTS - 1)
+        return false;
+
+    m_settleMs = settleMs;
+    m_callback = callback;
+    m_candidates.clear();
+    m_delivered.clear();
+    m_deliveredFloor = 0;
+    m_scan = 0;
+
+    m_stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_stopEvent == NULL)
+        return false;
+
+    for (size_t i = 0; i < directories.size(); i++)
+    {
+        std::unique_ptr<WatchedDirectory> directory(new WatchedDirectory());
+        directory->path = directories[i];
+        directory->handle = CreateFileW(directories[i].c_str(), FILE_LIST_DIRECTORY,
+            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+            FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        directory->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+        directory->buffer.resize(NOTIFY_BUFFER_BYTES / sizeof(DWORD));
+        directory->polling = (directory->handle == INVALID_HANDLE_VALUE || directory->event == NULL);
+        directory->nextScan = 0;
+
+        // Remember what is already there so only new arrivals are processed
+        Scan(*directory, true);
+
+        if (!directory->polling && !IssueRead(*directory))
+            directory->polling = true;
+
+        m_directories.push_back(std::move(directory));
+    }
+
+    m_thread = std::thread(&FolderWatcher::Run, this);
+    return true;
+}
+
+void FolderWatcher::Stop()
+{
+    if (!IsRunning())
+        return;
+
+    SetEvent(m_stopEvent);
+    m_thread.join();
+
+    CloseDirectories();
+    CloseHandle(m_stopEvent);
+    m_stopEvent = NULL;
+}
+
+void FolderWatcher::CloseDirectories()
+{
+    for (size_t i = 0; i < m_directories.size(); i++)
+    {
+        WatchedDirectory& directory = *m_directories[i];
+
+        if (directory.handle != INVALID_HANDLE_VALUE)
+        {
+            // Wait for the cancelled read so the kernel is done with the buffer
+            if (!directory.polling && CancelIoEx(directory.handle, &directory.overlapped))
+            {
+                DWORD bytes = 0;
+                GetOverlappedResult(directory.handle, &directory.overlapped, &bytes, TRUE);
+            }
+            CloseHandle(directory.handle);
+        }
+        if (directory.event != NULL)
+            CloseHandle(directory.event);
+    }
+
+    m_directories.clear();
+}
+
+bool FolderWatcher::IssueRead(WatchedDirectory& directory)
+{
+    ZeroMemory(&directory.overlapped, sizeof(directory.overlapped));
+    directory.overlapped.hEvent = directory.event;
+    ResetEvent(directory.event);
+
+    return ReadDirectoryChangesW(directory.handle, &directory.buffer[0], NOTIFY_BUFFER_BYTES,
+        FALSE, NOTIFY_FILTER, NULL, &directory.overlapped, NULL) != FALSE;
+}
+
+void FolderWatcher::HandleNotifications(WatchedDirectory& directory, DWORD bytes)
+{
+    const BYTE* p = (const BYTE*)&directory.buffer[0];
+    const BYTE* end = p + bytes;
+
+    while (p + sizeof(FILE_NOTIFY_INFORMATION) <= end)
+    {
+        const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)p;
+        std::wstring fileName(info->FileName, info->FileNameLength / sizeof(WCHAR));
+
+        if (DirectoryEnumerator::IsImageFile(fileName.c_str()))
+        {
+            std::wstring path = directory.path + L"\\" + fileName;
+
+            switch (info->Action)
+            {
+            case FILE_ACTION_ADDED:
+            case FILE_ACTION_MODIFIED:
+            case FILE_ACTION_RENAMED_NEW_NAME:
+                Observe(path);
+                break;
+            case FILE_ACTION_REMOVED:
+            case FILE_ACTION_RENAMED_OLD_NAME:
+                Forget(path);
+                break;
+            }
+        }
+
+        if (info->NextEntryOffset == 0)
+            break;
+        p += info->NextEntryOffset;
+    }
+}
+
+void FolderWatcher::Scan(WatchedDirectory& directory, bool baseline)
+{
+    std::wstring pattern = directory.path + L"\\*";
+
+    WIN32_FIND_DATAW findData;
+    HANDLE hFind = FindFirstFileExW(pattern.c_str(), FindExInfoBasic, &findData,
+                                    FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;
+
+    UINT scan = ++m_scan;
+    do
+    {
+        if ((findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+            !DirectoryEnumerator::IsImageFile(findData.cFileName))
+            continue;
+
+        std::wstring path = directory.path + L"\\" + findData.cFileName;
+        ULONGLONG lastWrite = ToULongLong(findData.ftLastWriteTime);
+        ULONGLONG arrived = max(lastWrite, ToULongLong(findData.ftCreationTime));
+
+        if (baseline)
+        {
+            Remember(path, lastWrite);
+            continue;
+        }
+
+        auto it = m_delivered.find(path);
+        if (it != m_delivered.end())
+        {
+            it->second.scan = scan;
+            if (it->second.lastWriteTime != lastWrite)
+                Observe(path);
+        }
+        else if (arrived > m_deliveredFloor)
+        {
+            Observe(path);
+        }
+    } while (FindNextFileW(hFind, &findData));
+
+    bool complete = (GetLastError() == ERROR_NO_MORE_FILES);
+    FindClose(hFind);
+
+    // Whatever this folder no longer has is gone for good: polled folders
+    // never see removals, and an overflowed buffer may have lost them
+    if (!complete)
+        return;
+
+    std::wstring prefix = directory.path + L"\\";
+    for (auto it = m_delivered.begin(); it != m_delivered.end(); )
+    {
+        const std::wstring& path = it->first;
+        if (it->second.scan != scan && path.compare(0, prefix.length(), prefix) == 0 &&
+            path.find(L'\\', prefix.length()) == std::wstring::npos)
+            it = m_delivered.erase(it);
+        else
+            ++it;
+    }
+}
+
+void FolderWatcher::Observe(const std::wstring& path)
+{
+    // Size and timestamp are sampled by CheckCandidates; a new entry starts
+    // out unstable so it always waits at least one settle period
+    if (m_candidates.find(path) != m_candidates.end())
+        return;
+
+    Candidate candidate;
+    candidate.size = (ULONGLONG)-1;
+    candidate.lastWriteTime.dwLowDateTime = 0;
+    candidate.lastWriteTime.dwHighDateTime = 0;
+    GetSystemTimeAsFileTime(&candidate.firstSeen);
+    candidate.stableSince = GetTickCount64();
+    m_candidates.emplace(path, candidate);
+}
+
+void FolderWatcher::Forget(const std::wstring& path)
+{
+    m_candidates.erase(path);
+    m_delivered.erase(path);
+}
+
+void FolderWatcher::Remember(const std::wstring& path, ULONGLONG lastWriteTime)
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+
+    DeliveredFile& file = m_delivered[path];
+    file.lastWriteTime = lastWriteTime;
+    file.deliveredTime = ToULongLong(now);
+    file.scan = m_scan;
+
+    if (m_delivered.size() > MAX_DELIVERED)
+        PruneDelivered();
+}
+
+// Drops the quarter of m_delivered delivered longest ago and raises the
+// floor below which Scan ignores files it does not know
+void FolderWatcher::PruneDelivered()
+{
+    std::vector<ULONGLONG> times;
+    times.reserve(m_delivered.size());
+    for (auto it = m_delivered.begin(); it != m_delivered.end(); ++it)
+        times.push_back(it->second.deliveredTime);
+
+    auto cutoff = times.begin() + times.size() / 4;
+    std::nth_element(times.begin(), cutoff, times.end());
+    m_deliveredFloor = max(m_deliveredFloor, *cutoff);
+
+    for (auto it = m_delivered.begin(); it != m_delivered.end(); )
+    {
+        if (it->second.deliveredTime <= m_deliveredFloor)
+            it = m_delivered.erase(it);
+        else
+            ++it;
+    }
+}
+
+bool FolderWatcher::IsClosedByWriter(const std::wstring& path)
+{
+    // Denying write sharing fails while any writer still has the file open
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    CloseHandle(hFile);
+    return true;
+}
+
+void FolderWatcher::CheckCandidates(ULONGLONG now)
+{
+    for (auto it = m_candidates.begin(); it != m_candidates.end(); )
+    {
+        const std::wstring& path = it->first;
+        Candidate& candidate = it->second;
+
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes))
+        {
+            it = m_candidates.erase(it);
+            continue;
+        }
+
+        ULONGLONG size = ((ULONGLONG)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+        ULONGLONG lastWrite = ToULongLong(attributes.ftLastWriteTime);
+
+        if (size != candidate.size || lastWrite != ToULongLong(candidate.lastWriteTime))
+        {
+            candidate.size = size;
+            candidate.lastWriteTime = attributes.ftLastWriteTime;
+            candidate.stableSince = now;
+            ++it;
+            continue;
+        }
+
+        if (size == 0 || now - candidate.stableSince < m_settleMs || !IsClosedByWriter(path))
+        {
+            ++it;
+            continue;
+        }
+
+        auto delivered = m_delivered.find(path);
+        if (delivered == m_delivered.end() || delivered->second.lastWriteTime != lastWrite)
+        {
+            Remember(path, lastWrite);
+            m_callback(path, lastWrite > ToULongLong(candidate.firstSeen) ? candidate.lastWriteTime 
+                                                                        : candidate.firstSeen);
+        }
+
+        it = m_candidates.erase(it);
+    }
+}
+
+void FolderWatcher::Run()
+{
+    std::vector<HANDLE> handles;
+    std::vector<WatchedDirectory*> owners;
+
+    for (;;)
+    {
+        handles.clear();
+        owners.clear();
+        handles.push_back(m_stopEvent);
+
+        bool anyPolling = false;
+        for (size_t i = 0; i < m_directories.size(); i++)
+        {
+            if (m_directories[i]->polling)
+            {
+                anyPolling = true;
+            }
+            else
+            {
+                handles.push_back(m_directories[i]->event);
+                owners.push_back(m_directories[i].get());
+            }
+        }
+
+        DWORD timeout = INFINITE;
+        if (!m_candidates.empty())
+            timeout = CANDIDATE_CHECK_MS;
+        else if (anyPolling)
+            timeout = POLL_INTERVAL_MS;
+
+        DWORD result = WaitForMultipleObjects((DWORD)handles.size(), &handles[0], FALSE, timeout);
+        if (result == WAIT_OBJECT_0 || result == WAIT_FAILED)
+            break;
+
+        if (result > WAIT_OBJECT_0 && result < WAIT_OBJECT_0 + handles.size())
+        {
+            WatchedDirectory& directory = *owners[result - WAIT_OBJECT_0 - 1];
+
+            DWORD bytes = 0;
+            if (GetOverlappedResult(directory.handle, &directory.overlapped, &bytes, FALSE) && bytes > 0)
+                HandleNotifications(directory, bytes);
+            else
+                Scan(directory, false);  // Overflowed: the buffer lost events
+
+            if (!IssueRead(directory))
+            {
+                directory.polling = true;
+                directory.nextScan = 0;
+            }
+        }
+
+        ULONGLONG now = GetTickCount64();
+
+        for (size_t i = 0; i < m_directories.size(); i++)
+        {
+            WatchedDirectory& directory = *m_directories[i];
+            if (directory.polling && now >= directory.nextScan)
+            {
+                Scan(directory, false);
+                directory.nextScan = now + POLL_INTERVAL_MS;
+            }
+        }
+
+        CheckCandidates(now);
+    }
+}
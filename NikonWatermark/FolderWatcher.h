@@ -0,0 +1,95 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <thread>
+
+// Watches one or more folders (non-recursively) for new or rewritten images
+// and reports each one once it has been closed by the writer. Change
+// notifications come from ReadDirectoryChangesW; folders where that is not
+// available (some network shares) or that overflow the notification buffer
+// are rescanned instead. Files already present when watching starts are
+// treated as done.
+//
+// Delivered files are remembered by write time so a rescan does not
+// deliver them again. Entries go when the file leaves the folder, and past
+// MAX_DELIVERED the quarter delivered longest ago is dropped; rescans then
+// also skip any unknown file that was in the folder (by creation or write
+// time, whichever is later) before the last dropped one was delivered.
+// A copy gets a new creation time, so one with an old modified time still
+// counts as new.
+class FolderWatcher
+{
+public:
+    // arrivalTime is the file's last write time, or when the watcher first
+    // saw it if that is later: copies keep the source's modified time
+    typedef std::function<void(const std::wstring& path, const FILETIME& arrivalTime)> ReadyCallback;
+
+    FolderWatcher();
+    ~FolderWatcher();
+
+    // settleMs is how long a file's size and timestamp must stay unchanged
+    // before it is considered complete
+    bool Start(const std::vector<std::wstring>& directories, DWORD settleMs, const ReadyCallback& callback);
+    void Stop();
+
+    bool IsRunning() const { return m_thread.joinable(); }
+
+    static const size_t MAX_DELIVERED = 65536;
+
+private:
+    FolderWatcher(const FolderWatcher&);
+    FolderWatcher& operator=(const FolderWatcher&);
+
+    struct WatchedDirectory
+    {
+        std::wstring path;
+        HANDLE handle;
+        HANDLE event;
+        OVERLAPPED overlapped;
+        std::vector<DWORD> buffer;
+        bool polling;
+        ULONGLONG nextScan;
+    };
+
+    struct Candidate
+    {
+        ULONGLONG size;
+        FILETIME lastWriteTime;
+        FILETIME firstSeen;     // System time Observe added it
+        ULONGLONG stableSince;
+    };
+
+    struct DeliveredFile
+    {
+        ULONGLONG lastWriteTime;
+        ULONGLONG deliveredTime;    // System time, as a FILETIME value
+        UINT scan;                  // Last Scan that found the file
+    };
+
+    void Run();
+    bool IssueRead(WatchedDirectory& directory);
+    void HandleNotifications(WatchedDirectory& directory, DWORD bytes);
+    void Scan(WatchedDirectory& directory, bool baseline);
+    void Observe(const std::wstring& path);
+    void Forget(const std::wstring& path);
+    void Remember(const std::wstring& path, ULONGLONG lastWriteTime);
+    void PruneDelivered();
+    void CheckCandidates(ULONGLONG now);
+    void CloseDirectories();
+
+    static bool IsClosedByWriter(const std::wstring& path);
+
+    std::vector<std::unique_ptr<WatchedDirectory>> m_directories;
+    std::unordered_map<std::wstring, Candidate> m_candidates;
+    std::unordered_map<std::wstring, DeliveredFile> m_delivered;
+    ULONGLONG m_deliveredFloor;     // Delivery time of the newest entry PruneDelivered dropped
+    UINT m_scan;
+
+    DWORD m_settleMs;
+    ReadyCallback m_callback;
+    HANDLE m_stopEvent;
+    std::thread m_thread;
+};
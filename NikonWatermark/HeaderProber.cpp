@@ -0,0 +1,91 @@
+#include "stdafx.h"
+#include "HeaderProber.h"
+#include "ImageProcessor.h"
+
+HeaderProber::HeaderProber()
+    : m_files(NULL), m_encoderThreads(1), m_probed(0), m_cancelled(false), m_finished(true)
+{
+}
+
+HeaderProber::~HeaderProber()
+{
+    Stop();
+}
+
+void HeaderProber::Start(const FileTable& files, UINT encoderThreads, const ProgressCallback& callback)
+{
+    Stop();
+
+    m_files = &files;
+    m_encoderThreads = encoderThreads;
+    m_callback = callback;
+    m_estimates.resize(files.GetCount());
+    m_probed = 0;
+    m_cancelled = false;
+    m_finished = false;
+
+    m_thread = std::thread(&HeaderProber::Run, this);
+}
+
+void HeaderProber::Cancel()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cancelled = true;
+}
+
+void HeaderProber::Stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    Cancel();
+    m_thread.join();
+    m_files = NULL;
+    m_callback = nullptr;
+}
+
+size_t HeaderProber::GetProbedCount(bool& finished) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    finished = m_finished;
+    return m_probed;
+}
+
+void HeaderProber::Run()
+{
+    for (size_t i = 0; i < m_estimates.size(); i++)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_cancelled)
+                break;
+        }
+
+        // Header reads only; nothing is decoded here
+        Estimate& estimate = m_estimates[i];
+        estimate.probed = ImageHeaderProbe::Probe(m_files->GetFullPath(i), estimate.header);
+        estimate.frameBytes = 0;
+        estimate.transientBytes = 0;
+        if (estimate.probed)
+            ImageProcessor::EstimateWorkingSet(estimate.header, m_encoderThreads, estimate.frameBytes,
+                                               estimate.transientBytes);
+        else
+            estimate.header = ImageHeaderInfo();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_probed = i + 1;
+        }
+
+        if (m_callback)
+            m_callback();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_finished = true;
+    }
+
+    if (m_callback)
+        m_callback();
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include "stdafx.h"
+#include "FileTable.h"
+#include "ImageHeaderProbe.h"
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <thread>
+
+// Reads a batch's headers in file order on a thread of its own and turns
+// each into a working-set estimate, for BatchEngine and ShardCoordinator
+// alike. Admission only looks LOOKAHEAD jobs ahead, so workers start on the
+// first files while the rest are still being probed.
+class HeaderProber
+{
+public:
+    // Runs on the probing thread after every file, and once more when the
+    // thread is done
+    typedef std::function<void()> ProgressCallback;
+
+    struct Estimate
+    {
+        ImageHeaderInfo header;     // Format Unknown if the probe failed
+        bool probed;
+        UINT64 frameBytes;
+        UINT64 transientBytes;
+    };
+
+    HeaderProber();
+    ~HeaderProber();
+
+    // files must not change until Stop
+    void Start(const FileTable& files, UINT encoderThreads, const ProgressCallback& callback);
+
+    // Makes the thread stop after the file it is on; safe from any thread
+    void Cancel();
+
+    // Cancels and waits for the thread
+    void Stop();
+
+    // Estimates below the count are final and may be read without a lock.
+    // finished is set once nothing more will be probed.
+    size_t GetProbedCount(bool& finished) const;
+    const Estimate& GetEstimate(size_t index) const { return m_estimates[index]; }
+
+private:
+    HeaderProber(const HeaderProber&);
+    HeaderProber& operator=(const HeaderProber&);
+
+    void Run();
+
+    const FileTable* m_files;
+    UINT m_encoderThreads;
+    ProgressCallback m_callback;
+    std::vector<Estimate> m_estimates;   // Sized up front, so entries never move
+
+    mutable std::mutex m_mutex;
+    size_t m_probed;
+    bool m_cancelled;
+    bool m_finished;
+    std::thread m_thread;
+};
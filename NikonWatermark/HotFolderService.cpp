@@ -0,0 +1,198 @@
+#include "stdafx.h"
+#include "HotFolderService.h"
+#include <algorithm>
+
+HotFolderService::HotFolderService()
+    : m_stopping(false), m_processed(0), m_failed(0), m_nextLatency(0)
+{
+}
+
+HotFolderService::~HotFolderService()
+{
+    Stop();
+}
+
+bool HotFolderService::Start(const std::vector<std::wstring>& inputFolders, const std::wstring& outputFolder,
+                             const WatermarkConfig& config, const ResultCallback& callback)
+{
+    if (IsRunning())
+        return false;
+
+    m_outputFolder = outputFolder;
+    m_inputFolders = inputFolders;
+    m_outputFolders.clear();
+
+    // With several watched folders each one writes to a subfolder named
+    // after it, so same-named files dropped into two of them cannot
+    // overwrite each other
+    for (size_t i = 0; i < inputFolders.size(); i++)
+    {
+        if (inputFolders.size() == 1)
+        {
+            m_outputFolders.push_back(outputFolder);
+            break;
+        }
+
+        std::wstring name = inputFolders[i];
+        while (!name.empty() && (name.back() == L'\\' || name.back() == L':'))
+            name.pop_back();
+        size_t pos = name.find_last_of(L"\\");
+        if (pos != std::wstring::npos)
+            name.erase(0, pos + 1);
+
+        std::wstring folder = outputFolder + L"\\" + name;
+        UINT copy = 1;
+        while (std::any_of(m_outputFolders.begin(), m_outputFolders.end(),
+                   [&folder](const std::wstring& used) { return _wcsicmp(used.c_str(), folder.c_str()) == 0; }))
+            folder = outputFolder + L"\\" + name + L" (" + std::to_wstring(++copy) + L")";
+
+        m_outputFolders.push_back(folder);
+    }
+
+    m_config = config;
+    m_callback = callback;
+    m_queue.clear();
+    m_stopping = false;
+    m_processed = 0;
+    m_failed = 0;
+    m_overlayStats = OverlayCacheStats();
+    m_latencies.clear();
+    m_latencies.reserve(LATENCY_WINDOW);
+    m_nextLatency = 0;
+
+    m_worker = std::thread(&HotFolderService::Run, this);
+
+    if (!m_watcher.Start(inputFolders, SETTLE_MS,
+            [this](const std::wstring& path, const FILETIME& arrivalTime) { Enqueue(path, arrivalTime); }))
+    {
+        Stop();
+        return false;
+    }
+
+    return true;
+}
+
+void HotFolderService::Stop()
+{
+    // Stop producing first so nothing is queued behind the worker's back
+    m_watcher.Stop();
+
+    if (!IsRunning())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    m_worker.join();
+}
+
+void HotFolderService::Enqueue(const std::wstring& path, const FILETIME& arrivalTime)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Job job;
+        job.path = path;
+        job.arrivalTime = arrivalTime;
+        m_queue.push_back(job);
+    }
+    m_wake.notify_one();
+}
+
+void HotFolderService::Run()
+{
+    std::wstring outputPath;
+
+    for (;;)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wake.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+            if (m_stopping)
+                break;
+
+            job = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        // The watcher is not recursive, so the file name is unique within
+        // its folder
+        size_t pos = job.path.find_last_of(L"\\");
+        outputPath = GetOutputFolder(job.path);
+        outputPath += L"\\";
+        outputPath += (pos != std::wstring::npos) ? job.path.substr(pos + 1) : job.path;
+
+        HotFolderResult result;
+        result.inputPath = job.path;
+        result.success = m_imageProcessor.ProcessImage(job.path, outputPath, m_config);
+
+        // Both times are UTC FILETIMEs in 100ns units
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        LONGLONG elapsed = (LONGLONG)((((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime) -
+                                      (((ULONGLONG)job.arrivalTime.dwHighDateTime << 32) | job.arrivalTime.dwLowDateTime));
+        result.latencyMs = (elapsed > 0) ? elapsed / 10000.0 : 0.0;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (result.success)
+                m_processed++;
+            else
+                m_failed++;
+            
+            // The processor belongs to this thread, so publish a snapshot
+            m_overlayStats = m_imageProcessor.GetOverlayCacheStats();
+
+            if (m_latencies.size() < LATENCY_WINDOW)
+                m_latencies.push_back(result.latencyMs);
+            else
+                m_latencies[m_nextLatency] = result.latencyMs;
+            m_nextLatency = (m_nextLatency + 1) % LATENCY_WINDOW;
+        }
+
+        if (m_callback)
+            m_callback(result);
+    }
+}
+
+const std::wstring& HotFolderService::GetOutputFolder(const std::wstring& path) const
+{
+    // The watcher builds paths as folder + "\\" + name
+    for (size_t i = 0; i < m_inputFolders.size(); i++)
+    {
+        const std::wstring& folder = m_inputFolders[i];
+        if (path.length() > folder.length() && path[folder.length()] == L'\\' &&
+            path.compare(0, folder.length(), folder) == 0)
+            return m_outputFolders[i];
+    }
+
+    return m_outputFolder;
+}
+
+HotFolderStats HotFolderService::GetStats() const
+{
+    HotFolderStats stats;
+    std::vector<double> latencies;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        stats.queueDepth = m_queue.size();
+        stats.processed = m_processed;
+        stats.failed = m_failed;
+        stats.overlayCache = m_overlayStats;
+        latencies = m_latencies;
+    }
+
+    if (latencies.empty())
+        return stats;
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t last = latencies.size() - 1;
+    stats.p50Ms = latencies[last * 50 / 100];
+    stats.p95Ms = latencies[last * 95 / 100];
+    stats.p99Ms = latencies[last * 99 / 100];
+
+    return stats;
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include "stdafx.h"
+#include "FolderWatcher.h"
+#include "ImageProcessor.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
+struct HotFolderResult
+{
+    std::wstring inputPath;
+    bool success;
+    double latencyMs;  // From the file arriving (see FolderWatcher::ReadyCallback) to our output being saved
+};
+
+struct HotFolderStats
+{
+    size_t queueDepth = 0;
+    UINT64 processed = 0;
+    UINT64 failed = 0;
+    double p50Ms = 0.0;
+    double p95Ms = 0.0;
+    double p99Ms = 0.0;
+    OverlayCacheStats overlayCache;
+};
+
+// Long-running hot-folder mode: a FolderWatcher feeds finished files into a
+// queue that a dedicated worker drains with its own ImageProcessor.
+class HotFolderService
+{
+public:
+    typedef std::function<void(const HotFolderResult& result)> ResultCallback;
+
+    HotFolderService();
+    ~HotFolderService();
+
+    // The result callback runs on the worker thread
+    bool Start(const std::vector<std::wstring>& inputFolders, const std::wstring& outputFolder,
+               const WatermarkConfig& config, const ResultCallback& callback);
+    void Stop();
+
+    bool IsRunning() const { return m_worker.joinable(); }
+
+    // Percentiles cover the most recent LATENCY_WINDOW files
+    HotFolderStats GetStats() const;
+
+    static const DWORD SETTLE_MS = 500;
+    static const size_t LATENCY_WINDOW = 1024;
+
+private:
+    HotFolderService(const HotFolderService&);
+    HotFolderService& operator=(const HotFolderService&);
+
+    struct Job
+    {
+        std::wstring path;
+        FILETIME arrivalTime;
+    };
+
+    void Enqueue(const std::wstring& path, const FILETIME& arrivalTime);
+    void Run();
+    const std::wstring& GetOutputFolder(const std::wstring& path) const;
+
+    FolderWatcher m_watcher;
+    ImageProcessor m_imageProcessor;
+    std::wstring m_outputFolder;
+
+    // Output folder of each watched folder, in the same order
+    std::vector<std::wstring> m_inputFolders;
+    std::vector<std::wstring> m_outputFolders;
+    WatermarkConfig m_config;
+    ResultCallback m_callback;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<Job> m_queue;
+    bool m_stopping;
+    std::thread m_worker;
+
+    UINT64 m_processed;
+    UINT64 m_failed;
+    OverlayCacheStats m_overlayStats;
+    std::vector<double> m_latencies;
+    size_t m_nextLatency;
+};
@@ -0,0 +1,237 @@
+#include "stdafx.h"
+#include "ImageHeaderProbe.h"
+#include "TiffDirectory.h"
+#include <climits>
+
+// Gives up on JPEGs whose frame header is buried behind more segments
+// than any camera or editor writes
+static const int MAX_JPEG_SEGMENTS = 256;
+
+static bool ReadExact(HANDLE hFile, void* buffer, DWORD size)
+{
+    DWORD read = 0;
+    return ReadFile(hFile, buffer, size, &read, NULL) && read == size;
+}
+
+static bool Seek(HANDLE hFile, LONGLONG offset, DWORD method)
+{
+    LARGE_INTEGER distance;
+    distance.QuadPart = offset;
+    return SetFilePointerEx(hFile, distance, NULL, method) != FALSE;
+}
+
+static UINT ReadBigEndian16(const BYTE* p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static UINT ReadBigEndian32(const BYTE* p)
+{
+    return ((UINT)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static UINT ReadLittleEndian16(const BYTE* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static UINT ReadLittleEndian32(const BYTE* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT)p[3] << 24);
+}
+
+bool ImageHeaderProbe::Probe(const std::wstring& path, ImageHeaderInfo& info)
+{
+    info = ImageHeaderInfo();
+
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    BYTE signature[8];
+    bool success = false;
+
+    if (ReadExact(hFile, signature, sizeof(signature)))
+    {
+        static const BYTE PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+
+        if (signature[0] == 0xFF && signature[1] == 0xD8)
+            success = ProbeJpeg(hFile, info);
+        else if (memcmp(signature, PNG_SIGNATURE, sizeof(PNG_SIGNATURE)) == 0)
+            success = ProbePng(hFile, info);
+        else if (signature[0] == 'B' && signature[1] == 'M')
+            success = ProbeBmp(hFile, info);
+        else if ((signature[0] == 'I' && signature[1] == 'I') || (signature[0] == 'M' && signature[1] == 'M'))
+            success = ProbeTiff(hFile, info);
+    }
+
+    CloseHandle(hFile);
+
+    if (!success || info.width == 0 || info.height == 0)
+    {
+        info = ImageHeaderInfo();
+        return false;
+    }
+
+    return true;
+}
+
+bool ImageHeaderProbe::ProbeJpeg(HANDLE hFile, ImageHeaderInfo& info)
+{
+    if (!Seek(hFile, 2, FILE_BEGIN))
+        return false;
+
+    for (int segment = 0; segment < MAX_JPEG_SEGMENTS; segment++)
+    {
+        BYTE marker[2];
+        if (!ReadExact(hFile, marker, sizeof(marker)) || marker[0] != 0xFF)
+            return false;
+
+        // Any number of 0xFF fill bytes may precede a marker code
+        BYTE code = marker[1];
+        while (code == 0xFF)
+        {
+            if (!ReadExact(hFile, &code, 1))
+                return false;
+        }
+
+        // Markers without a length field
+        if (code == 0x01 || (code >= 0xD0 && code <= 0xD8))
+            continue;
+
+        // Reached the image data (or the end) without a frame header
+        if (code == 0xD9 || code == 0xDA)
+            return false;
+
+        BYTE lengthBytes[2];
+        if (!ReadExact(hFile, lengthBytes, sizeof(lengthBytes)))
+            return false;
+
+        UINT length = ReadBigEndian16(lengthBytes);
+        if (length < 2)
+            return false;
+
+        // SOF0-SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if (code >= 0xC0 && code <= 0xCF && code != 0xC4 && code != 0xC8 && code != 0xCC)
+        {
+            BYTE frame[6];
+            if (length < 2 + sizeof(frame) || !ReadExact(hFile, frame, sizeof(frame)))
+                return false;
+
+            info.format = ImageFormat::Jpeg;
+            info.bitsPerComponent = frame[0];
+            info.height = ReadBigEndian16(frame + 1);
+            info.width = ReadBigEndian16(frame + 3);
+            info.components = frame[5];
+            info.hasAlpha = false;
+            return info.components > 0;
+        }
+
+        if (!Seek(hFile, length - 2, FILE_CURRENT))
+            return false;
+    }
+
+    return false;
+}
+
+bool ImageHeaderProbe::ProbePng(HANDLE hFile, ImageHeaderInfo& info)
+{
+    // IHDR must be the first chunk: length, type, then 13 bytes of data
+    BYTE chunk[8 + 13];
+    if (!ReadExact(hFile, chunk, sizeof(chunk)) || memcmp(chunk + 4, "IHDR", 4) != 0)
+        return false;
+
+    const BYTE* header = chunk + 8;
+    info.format = ImageFormat::Png;
+    info.width = ReadBigEndian32(header);
+    info.height = ReadBigEndian32(header + 4);
+    info.bitsPerComponent = header[8];
+
+    switch (header[9])
+    {
+    case 0: info.components = 1; break;  // Greyscale
+    case 2: info.components = 3; break;  // RGB
+    case 3: info.components = 1; break;  // Palette
+    case 4: info.components = 2; info.hasAlpha = true; break;
+    case 6: info.components = 4; info.hasAlpha = true; break;
+    default: return false;
+    }
+
+    return true;
+}
+
+bool ImageHeaderProbe::ProbeBmp(HANDLE hFile, ImageHeaderInfo& info)
+{
+    // The info header follows the 14-byte file header
+    BYTE header[16];
+    if (!Seek(hFile, 14, FILE_BEGIN) || !ReadExact(hFile, header, sizeof(header)))
+        return false;
+
+    UINT headerSize = ReadLittleEndian32(header);
+    UINT bitCount;
+
+    if (headerSize == 12)
+    {
+        // OS/2 BITMAPCOREHEADER
+        info.width = ReadLittleEndian16(header + 4);
+        info.height = ReadLittleEndian16(header + 6);
+        bitCount = ReadLittleEndian16(header + 10);
+    }
+    else if (headerSize >= 40)
+    {
+        INT width = (INT)ReadLittleEndian32(header + 4);
+        INT height = (INT)ReadLittleEndian32(header + 8);  // Negative for top-down
+        if (width <= 0 || height == 0 || height == INT_MIN)
+            return false;
+
+        info.width = (UINT)width;
+        info.height = (UINT)(height < 0 ? -height : height);
+        bitCount = ReadLittleEndian16(header + 14);
+    }
+    else
+    {
+        return false;
+    }
+
+    info.format = ImageFormat::Bmp;
+    info.components = (bitCount <= 8) ? 1 : 3;
+    info.bitsPerComponent = (bitCount <= 8) ? bitCount : 8;
+    return bitCount > 0;
+}
+
+bool ImageHeaderProbe::ProbeTiff(HANDLE hFile, ImageHeaderInfo& info)
+{
+    // Only the first directory is read; tile and strip tables are not
+    TiffDirectory directory;
+    if (!directory.Read(hFile))
+        return false;
+
+    UINT photometric = directory.GetValue(TIFFTAG_PHOTOMETRIC, 2);
+    UINT colourSamples = (photometric == 2 || photometric == 6) ? 3 : (photometric == 5) ? 4 : 1;
+
+    info.format = ImageFormat::Tiff;
+    info.width = directory.GetValue(TIFFTAG_IMAGEWIDTH, 0);
+    info.height = directory.GetValue(TIFFTAG_IMAGELENGTH, 0);
+    info.components = directory.GetValue(TIFFTAG_SAMPLESPERPIXEL, 1);
+    info.bitsPerComponent = directory.GetValue(TIFFTAG_BITSPERSAMPLE, 1);
+
+    // ExtraSamples 1 and 2 are associated and unassociated alpha
+    UINT extra = directory.GetValue(TIFFTAG_EXTRASAMPLES, 0);
+    info.hasAlpha = info.components > colourSamples && (extra == 1 || extra == 2);
+
+    // Readers decode a whole tile or strip at a time, and many writers put
+    // the entire image in a single strip
+    UINT64 pixelBytes = (UINT64)info.components * ((info.bitsPerComponent + 7) / 8);
+    if (directory.Find(TIFFTAG_TILEWIDTH) != NULL)
+    {
+        info.blockBytes = (UINT64)directory.GetValue(TIFFTAG_TILEWIDTH, 0) *
+                          directory.GetValue(TIFFTAG_TILELENGTH, 0) * pixelBytes;
+    }
+    else
+    {
+        UINT rows = min(directory.GetValue(TIFFTAG_ROWSPERSTRIP, info.height), info.height);
+        info.blockBytes = (UINT64)info.width * rows * pixelBytes;
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+
+enum class ImageFormat
+{
+    Unknown,
+    Jpeg,
+    Png,
+    Bmp,
+    Tiff
+};
+
+struct ImageHeaderInfo
+{
+    ImageFormat format = ImageFormat::Unknown;
+    UINT width = 0;
+    UINT height = 0;
+    UINT components = 0;         // Samples per pixel, alpha included
+    UINT bitsPerComponent = 0;
+    bool hasAlpha = false;
+    UINT64 blockBytes = 0;       // TIFF only: decoded size of one tile or strip
+};
+
+// Reads frame dimensions straight from the JPEG SOF, PNG IHDR, BMP info
+// header or first TIFF directory without decoding any pixel data. Only a
+// few hundred bytes are read per file; JPEG segments in front of the SOF
+// are seeked over.
+class ImageHeaderProbe
+{
+public:
+    static bool Probe(const std::wstring& path, ImageHeaderInfo& info);
+
+private:
+    static bool ProbeJpeg(HANDLE hFile, ImageHeaderInfo& info);
+    static bool ProbePng(HANDLE hFile, ImageHeaderInfo& info);
+    static bool ProbeBmp(HANDLE hFile, ImageHeaderInfo& info);
+    static bool ProbeTiff(HANDLE hFile, ImageHeaderInfo& info);
+};
@@ -1,9 +1,21 @@
 #include "stdafx.h"
 #include "ImageProcessor.h"
-#include <sstream>
+#include <shlobj.h>
+#include <shlwapi.h>
+#include <cmath>
+#include <thread>
 
-ImageProcessor::ImageProcessor()
+// Frames at least this large are JPEG-encoded across all cores; below it
+// the thread start-up costs more than GDI+'s serial encoder takes
+static const UINT64 PARALLEL_ENCODE_MIN_PIXELS = 40000000;
+
+// Arena, composed watermark band and GDI+ codec state for one file
+static const UINT64 FIXED_WORKING_SET = 4 * 1024 * 1024;
+
+ImageProcessor::ImageProcessor() : m_arena(16 * 1024), m_fontSize(0), m_jpegClsid(CLSID_NULL), 
+    m_encoderThreads(GetEncoderThreadShare(1))
 {
+    m_jpegEncoder.SetThreadBudget(m_encoderThreads);
 }
 
 ImageProcessor::~ImageProcessor()
@@ -41,97 +53,175 @@ CLSID ImageProcessor::GetEncoderClsid(const WCHAR* format)
     return CLSID_NULL;
 }
 
-std::wstring ImageProcessor::BuildWatermarkText(const ExifData& exifData, const WatermarkConfig& config)
+const WCHAR* ImageProcessor::BuildWatermarkText(const ExifData& exifData, const WatermarkConfig& config)
 {
-    std::wostringstream oss;
-    bool first = true;
+    const std::wstring* parts[3];
+    size_t count = 0;
+    size_t length = 0;
     
     if (config.showAperture && !exifData.aperture.empty())
-    {
-        oss << exifData.aperture;
-        first = false;
-    }
+        parts[count++] = &exifData.aperture;
     
     if (config.showISO && !exifData.iso.empty())
+        parts[count++] = &exifData.iso;
+    
+    if (config.showShutterSpeed && !exifData.shutterSpeed.empty())
+        parts[count++] = &exifData.shutterSpeed;
+    
+    for (size_t i = 0; i < count; i++)
+        length += parts[i]->length() + 2;
+    
+    WCHAR* text = m_arena.AllocateArray<WCHAR>(length + 1);
+    WCHAR* p = text;
+    
+    for (size_t i = 0; i < count; i++)
     {
-        if (!first) oss << L"  ";
-        oss << exifData.iso;
-        first = false;
+        if (i > 0)
+        {
+            *p++ = L' ';
+            *p++ = L' ';
+        }
+        wmemcpy(p, parts[i]->c_str(), parts[i]->length());
+        p += parts[i]->length();
     }
+    *p = 0;
     
-    if (config.showShutterSpeed && !exifData.shutterSpeed.empty())
+    return text;
+}
+
+void ImageProcessor::PrepareTextResources(int fontSize)
+{
+    if (!m_textBrush)
     {
-        if (!first) oss << L"  ";
-        oss << exifData.shutterSpeed;
+        m_textFontFamily.reset(new Gdiplus::FontFamily(L"Segoe UI"));
+        m_logoFontFamily.reset(new Gdiplus::FontFamily(L"Arial"));
+        m_textBrush.reset(new Gdiplus::SolidBrush(Gdiplus::Color(255, 255, 255, 255)));
+        m_shadowBrush.reset(new Gdiplus::SolidBrush(Gdiplus::Color(180, 0, 0, 0)));
     }
     
-    return oss.str();
+    // Fonts only change when the frame height does
+    if (fontSize != m_fontSize)
+    {
+        m_textFont.reset(new Gdiplus::Font(m_textFontFamily.get(), (Gdiplus::REAL)fontSize, FontStyleRegular, UnitPixel));
+        m_logoFont.reset(new Gdiplus::Font(m_logoFontFamily.get(), (Gdiplus::REAL)fontSize, FontStyleBold, UnitPixel));
+        m_fontSize = fontSize;
+    }
 }
 
-void ImageProcessor::DrawLogo(Gdiplus::Graphics& graphics, const std::wstring& manufacturer, 
-                              int x, int y, int height)
+const WCHAR* ImageProcessor::GetLogoText(const std::wstring& manufacturer)
 {
     // Create a simple text-based logo for manufacturer
     // In a real implementation, you would load actual logo images
-    std::wstring logoText;
-    
     if (manufacturer.find(L"NIKON") != std::wstring::npos || 
         manufacturer.find(L"Nikon") != std::wstring::npos)
     {
-        logoText = L"NIKON";
+        return L"NIKON";
     }
     else if (manufacturer.find(L"Canon") != std::wstring::npos ||
              manufacturer.find(L"CANON") != std::wstring::npos)
     {
-        logoText = L"Canon";
+        return L"Canon";
     }
     else if (manufacturer.find(L"Sony") != std::wstring::npos ||
              manufacturer.find(L"SONY") != std::wstring::npos)
     {
-        logoText = L"SONY";
+        return L"SONY";
     }
-    else
+    
+    return manufacturer.c_str();
+}
+
+std::unique_ptr<WatermarkOverlay> ImageProcessor::ComposeOverlay(const WCHAR* text, const WCHAR* logoText, 
+                                                               int fontSize, int layoutWidth)
+{
+    PrepareTextResources(fontSize);
+    
+    if (!m_measureBitmap)
+        m_measureBitmap.reset(new Gdiplus::Bitmap(1, 1, PixelFormat32bppPARGB));
+    
+    // Measure with the same rendering settings the band is drawn with
+    Gdiplus::Graphics measure(m_measureBitmap.get());
+    measure.SetTextRenderingHint(Gdiplus::TextRenderingHintAntiAlias);
+    
+    Gdiplus::RectF layoutRect(0, 0, (Gdiplus::REAL)layoutWidth, (Gdiplus::REAL)(fontSize * 100));
+    Gdiplus::RectF boundingBox;
+    measure.MeasureString(text, -1, m_textFont.get(), layoutRect, &boundingBox);
+    
+    Gdiplus::PointF origin(0, 0);
+    Gdiplus::RectF textBox;
+    measure.MeasureString(text, -1, m_textFont.get(), origin, &textBox);
+    
+    // Logo at the band origin, text offset to the right of it
+    int textX = 0;
+    Gdiplus::RectF logoBox;
+    if (*logoText)
     {
-        logoText = manufacturer;
+        measure.MeasureString(logoText, -1, m_logoFont.get(), origin, &logoBox);
+        textX = (int)boundingBox.Height * 3;  // Offset for logo width
     }
     
-    if (!logoText.empty())
+    // The shadow sits 2px right of and below the text
+    std::unique_ptr<WatermarkOverlay> overlay(new WatermarkOverlay());
+    overlay->textHeight = (int)boundingBox.Height;
+    overlay->width = (int)ceil(max(logoBox.Width, textX + textBox.Width + 2));
+    overlay->height = (int)ceil(max(logoBox.Height, max(boundingBox.Height, textBox.Height) + 2));
+    overlay->stride = overlay->width * 4;
+    overlay->pixels.assign((size_t)overlay->stride * overlay->height, 0);
+    overlay->bitmap.reset(new Gdiplus::Bitmap(overlay->width, overlay->height, overlay->stride, 
+                                              PixelFormat32bppPARGB, &overlay->pixels[0]));
+    
+    Gdiplus::Graphics graphics(overlay->bitmap.get());
+    graphics.SetSmoothingMode(Gdiplus::SmoothingModeHighQuality);
+    graphics.SetTextRenderingHint(Gdiplus::TextRenderingHintAntiAlias);
+    
+    // Draw logo first
+    if (*logoText)
     {
-        Gdiplus::FontFamily fontFamily(L"Arial");
-        Gdiplus::Font font(&fontFamily, (Gdiplus::REAL)height, FontStyleBold, UnitPixel);
-        Gdiplus::SolidBrush brush(Gdiplus::Color(255, 255, 255, 255));
-        
-        graphics.DrawString(logoText.c_str(), -1, &font, 
-                          Gdiplus::PointF((Gdiplus::REAL)x, (Gdiplus::REAL)y), &brush);
+        graphics.DrawString(logoText, -1, m_logoFont.get(), origin, m_textBrush.get());
     }
+    
+    // Draw shadow
+    graphics.DrawString(text, -1, m_textFont.get(), 
+                       Gdiplus::PointF((Gdiplus::REAL)(textX + 2), 2.0f), 
+                       m_shadowBrush.get());
+    
+    // Draw text
+    graphics.DrawString(text, -1, m_textFont.get(), 
+                       Gdiplus::PointF((Gdiplus::REAL)textX, 0.0f), 
+                       m_textBrush.get());
+    
+    return overlay;
 }
 
-void ImageProcessor::DrawWatermark(Gdiplus::Graphics& graphics, const ExifData& exifData, 
-                                  const WatermarkConfig& config, int imageWidth, int imageHeight)
+const WatermarkOverlay* ImageProcessor::PrepareOverlay(const ExifData& exifData, const WatermarkConfig& config, 
+                                                       int imageWidth, int imageHeight, int& x, int& y)
 {
-    std::wstring watermarkText = BuildWatermarkText(exifData, config);
+    const WCHAR* watermarkText = BuildWatermarkText(exifData, config);
     
-    if (watermarkText.empty())
-        return;
+    if (*watermarkText == 0)
+        return NULL;
     
-    // Set up text rendering
-    Gdiplus::FontFamily fontFamily(L"Segoe UI");
     int fontSize = imageHeight / 40;  // Adjust font size based on image height
     if (fontSize < 12) fontSize = 12;
     
-    Gdiplus::Font font(&fontFamily, (Gdiplus::REAL)fontSize, FontStyleRegular, UnitPixel);
-    Gdiplus::SolidBrush textBrush(Gdiplus::Color(255, 255, 255, 255));
-    Gdiplus::SolidBrush shadowBrush(Gdiplus::Color(180, 0, 0, 0));
+    const WCHAR* logoText = exifData.manufacturer.empty() ? L"" : GetLogoText(exifData.manufacturer);
     
-    // Measure text
-    Gdiplus::RectF layoutRect(0, 0, (Gdiplus::REAL)imageWidth, (Gdiplus::REAL)imageHeight);
-    Gdiplus::RectF boundingBox;
-    graphics.MeasureString(watermarkText.c_str(), -1, &font, layoutRect, &boundingBox);
+    // Rounded up, so the band is never laid out narrower than the frame
+    // and wraps no earlier than it would at the frame's own width
+    int widthClass = (imageWidth + OverlayCache::WIDTH_CLASS_STEP - 1) / OverlayCache::WIDTH_CLASS_STEP;
+    
+    // Compose the band once per unique text and reuse it for every frame
+    // of the same size class
+    const WatermarkOverlay* overlay = m_overlayCache.Find(watermarkText, logoText, fontSize, widthClass);
+    if (overlay == NULL)
+    {
+        int layoutWidth = max(widthClass, 1) * OverlayCache::WIDTH_CLASS_STEP;
+        overlay = m_overlayCache.Insert(ComposeOverlay(watermarkText, logoText, fontSize, layoutWidth));
+    }
     
     // Calculate position
     int margin = 20;
-    int x = margin;
-    int y;
+    x = margin;
     
     if (config.position == WatermarkPosition::Top)
     {
@@ -139,63 +229,158 @@ void ImageProcessor::DrawWatermark(Gdiplus::Graphics& graphics, const ExifData&
     }
     else
     {
-        y = imageHeight - (int)boundingBox.Height - margin;
+        y = imageHeight - overlay->textHeight - margin;
     }
     
-    // Draw logo first
-    if (!exifData.manufacturer.empty())
-    {
-        int logoHeight = fontSize;
-        DrawLogo(graphics, exifData.manufacturer, x, y, logoHeight);
-        x += (int)boundingBox.Height * 3;  // Offset for logo width
-    }
+    return overlay;
+}
+
+void ImageProcessor::DrawWatermark(Gdiplus::Graphics& graphics, const ExifData& exifData, 
+                                  const WatermarkConfig& config, int imageWidth, int imageHeight)
+{
+    int x;
+    int y;
+    const WatermarkOverlay* overlay = PrepareOverlay(exifData, config, imageWidth, imageHeight, x, y);
+    if (overlay == NULL)
+        return;
     
-    // Draw shadow
-    graphics.DrawString(watermarkText.c_str(), -1, &font, 
-                       Gdiplus::PointF((Gdiplus::REAL)(x + 2), (Gdiplus::REAL)(y + 2)), 
-                       &shadowBrush);
+    // Blit at 1:1; the explicit size keeps GDI+ from applying DPI scaling
+    graphics.DrawImage(overlay->bitmap.get(), x, y, overlay->width, overlay->height);
+}
+
+bool ImageProcessor::ProcessTiled(const std::wstring& inputPath, const std::wstring& outputPath, 
+                                  const ImageHeaderInfo& header, const WatermarkConfig& config)
+{
+    // Metadata only; the pixels are never loaded as a whole
+    if (!m_exifReader.ReadExifData(inputPath, m_exifData))
+        return false;
     
-    // Draw text
-    graphics.DrawString(watermarkText.c_str(), -1, &font, 
-                       Gdiplus::PointF((Gdiplus::REAL)x, (Gdiplus::REAL)y), 
-                       &textBrush);
+    int x = 0;
+    int y = 0;
+    const WatermarkOverlay* overlay = PrepareOverlay(m_exifData, config, (int)header.width, (int)header.height, x, y);
+    
+    // Same format and bit depth out as in
+    return m_tiledProcessor.Process(inputPath, outputPath, header, overlay, x, y);
+}
+
+bool ImageProcessor::CreateOutputFolder(const std::wstring& outputPath)
+{
+    size_t pos = outputPath.find_last_of(L"\\");
+    if (pos == std::wstring::npos)
+        return true;
+    
+    if (m_outputFolder.length() == pos && outputPath.compare(0, pos, m_outputFolder) == 0)
+        return true;
+    
+    // Another worker may create the same folder at the same moment
+    std::wstring folder = outputPath.substr(0, pos);
+    int error = SHCreateDirectoryExW(NULL, folder.c_str(), NULL);
+    if (error != ERROR_SUCCESS && error != ERROR_ALREADY_EXISTS && error != ERROR_FILE_EXISTS)
+        return false;
+    
+    m_outputFolder = folder;
+    return true;
 }
 
 bool ImageProcessor::ProcessImage(const std::wstring& inputPath, const std::wstring& outputPath, 
                                   const WatermarkConfig& config)
 {
-    // Read EXIF data
-    ExifData exifData;
-    if (!m_exifReader.ReadExifData(inputPath, exifData))
+    ImageHeaderInfo header;
+    if (!ImageHeaderProbe::Probe(inputPath, header))
+        header = ImageHeaderInfo();
+    
+    return ProcessImage(inputPath, outputPath, header, config);
+}
+
+bool ImageProcessor::ProcessImage(const std::wstring& inputPath, const std::wstring& outputPath, 
+                                  const ImageHeaderInfo& header, const WatermarkConfig& config)
+{
+    // Everything allocated from the arena during the previous file is dead
+    m_arena.Reset();
+    
+    // Files imported from subfolders are written to the same subfolders
+    if (!CreateOutputFolder(outputPath))
         return false;
     
-    // Load the image
-    Gdiplus::Bitmap* pBitmap = new Gdiplus::Bitmap(inputPath.c_str());
-    if (pBitmap->GetLastStatus() != Gdiplus::Ok)
-    {
-        delete pBitmap;
+    // TIFF and PNG keep their format and bit depth and are only touched
+    // under the watermark band
+    if (TiledImageProcessor::Handles(header))
+        return ProcessTiled(inputPath, outputPath, header, config);
+    
+    // One open serves both the EXIF parser and the decoder
+    ATL::CComPtr<IStream> stream;
+    if (FAILED(SHCreateStreamOnFileEx(inputPath.c_str(), STGM_READ | STGM_SHARE_DENY_NONE, 
+                                      FILE_ATTRIBUTE_NORMAL, FALSE, NULL, &stream)))
         return false;
-    }
     
-    int width = pBitmap->GetWidth();
-    int height = pBitmap->GetHeight();
+    // Read EXIF data with the bounded parser rather than GDI+ property items
+    StreamExifSource exifSource(stream);
+    if (!m_exifReader.ReadExifData(exifSource, m_exifData))
+        return false;
     
-    // Create a new bitmap with the same size
-    Gdiplus::Bitmap* pOutputBitmap = new Gdiplus::Bitmap(width, height, PixelFormat24bppRGB);
+    LARGE_INTEGER start;
+    start.QuadPart = 0;
+    if (FAILED(stream->Seek(start, STREAM_SEEK_SET, NULL)))
+        return false;
     
-    // Create graphics object
-    Gdiplus::Graphics graphics(pOutputBitmap);
-    graphics.SetSmoothingMode(Gdiplus::SmoothingModeHighQuality);
-    graphics.SetTextRenderingHint(Gdiplus::TextRenderingHintAntiAlias);
+    // Load the image
+    Gdiplus::Bitmap source(stream);
+    if (source.GetLastStatus() != Gdiplus::Ok)
+        return false;
+    
+    int width = source.GetWidth();
+    int height = source.GetHeight();
     
-    // Draw the original image
-    graphics.DrawImage(pBitmap, 0, 0, width, height);
+    // Reuse the worker's frame buffer as the output bitmap
+    Gdiplus::Bitmap* pOutputBitmap = m_framePool.Acquire(width, height);
+    if (pOutputBitmap == NULL)
+        return false;
+    
+    {
+        // Create graphics object
+        Gdiplus::Graphics graphics(pOutputBitmap);
+        graphics.SetSmoothingMode(Gdiplus::SmoothingModeHighQuality);
+        graphics.SetTextRenderingHint(Gdiplus::TextRenderingHintAntiAlias);
+        
+        if (Gdiplus::IsAlphaPixelFormat(source.GetPixelFormat()))
+        {
+            // Transparent sources have to be composited onto the background
+            graphics.Clear(Gdiplus::Color(255, 0, 0, 0));
+            graphics.DrawImage(&source, 0, 0, width, height);
+        }
+        else
+        {
+            // Let the decoder convert straight into the pooled buffer
+            Gdiplus::BitmapData data;
+            data.Width = width;
+            data.Height = height;
+            data.Stride = m_framePool.GetStride();
+            data.PixelFormat = PixelFormat24bppRGB;
+            data.Scan0 = m_framePool.GetScan0();
+            data.Reserved = 0;
+            
+            Gdiplus::Rect rect(0, 0, width, height);
+            if (source.LockBits(&rect, Gdiplus::ImageLockModeRead | Gdiplus::ImageLockModeUserInputBuf, 
+                                PixelFormat24bppRGB, &data) != Gdiplus::Ok)
+                return false;
+            source.UnlockBits(&data);
+        }
+        
+        // Draw watermark
+        DrawWatermark(graphics, m_exifData, config, width, height);
+    }
     
-    // Draw watermark
-    DrawWatermark(graphics, exifData, config, width, height);
+    // Quality 100, same as the GDI+ path below, which is also the fallback
+    // when the parallel encoder fails (out of memory for its segments)
+    if (UseParallelEncoder(width, height, m_encoderThreads) && 
+        m_jpegEncoder.Encode(m_framePool.GetScan0(), width, height, m_framePool.GetStride(), 100, outputPath))
+    {
+        return true;
+    }
     
     // Save the image with high quality
-    CLSID jpegClsid = GetEncoderClsid(L"image/jpeg");
+    if (m_jpegClsid == CLSID_NULL)
+        m_jpegClsid = GetEncoderClsid(L"image/jpeg");
     
     // Set JPEG quality to maximum
     Gdiplus::EncoderParameters encoderParams;
@@ -206,10 +391,78 @@ bool ImageProcessor::ProcessImage(const std::wstring& inputPath, const std::wstr
     ULONG quality = 100;
     encoderParams.Parameter[0].Value = &quality;
     
-    Gdiplus::Status status = pOutputBitmap->Save(outputPath.c_str(), &jpegClsid, &encoderParams);
-    
-    delete pBitmap;
-    delete pOutputBitmap;
+    Gdiplus::Status status = pOutputBitmap->Save(outputPath.c_str(), &m_jpegClsid, &encoderParams);
     
     return status == Gdiplus::Ok;
 }
+
+void ImageProcessor::SetEncoderThreads(UINT threads)
+{
+    m_encoderThreads = max(threads, 1u);
+    m_jpegEncoder.SetThreadBudget(m_encoderThreads);
+}
+
+UINT ImageProcessor::GetEncoderThreadShare(size_t workers)
+{
+    UINT cores = std::thread::hardware_concurrency();
+    return max((UINT)(cores / max(workers, (size_t)1)), 1u);
+}
+
+bool ImageProcessor::UseParallelEncoder(UINT width, UINT height, UINT encoderThreads)
+{
+    // With a single thread the restart-interval encoder only costs memory
+    return (UINT64)width * height >= PARALLEL_ENCODE_MIN_PIXELS && encoderThreads > 1;
+}
+
+void ImageProcessor::EstimateWorkingSet(const ImageHeaderInfo& info, UINT encoderThreads, 
+                                        UINT64& frameBytes, UINT64& transientBytes)
+{
+    UINT64 pixels = (UINT64)info.width * info.height;
+    
+    // TIFF and PNG never hold the frame: a band of rows, or the tile or
+    // strip being rewritten
+    if (TiledImageProcessor::Handles(info))
+    {
+        frameBytes = 0;
+        transientBytes = TiledImageProcessor::EstimateWorkingSet(info) + FIXED_WORKING_SET;
+        return;
+    }
+    
+    // 24bpp output frame, DWORD-aligned rows as in FrameBufferPool
+    frameBytes = (((UINT64)info.width * 3 + 3) & ~3ull) * info.height;
+    
+    // GDI+ decodes the whole source into its own 32bpp bitmap, or 64bpp
+    // for 16-bit samples, before handing pixels to us
+    transientBytes = pixels * (info.bitsPerComponent > 8 ? 8 : 4);
+    
+    // Restart-interval segments are buffered until the file is written;
+    // quality 100 4:4:4 stays under 2 bytes per pixel
+    if (UseParallelEncoder(info.width, info.height, encoderThreads))
+        transientBytes += pixels * 2;
+    
+    transientBytes += FIXED_WORKING_SET;
+}
+
+UINT64 ImageProcessor::GetRetainedBytes() const
+{
+    return m_framePool.GetCapacity() + m_tiledProcessor.GetRetainedBytes();
+}
+
+void ImageProcessor::ReleaseBuffers()
+{
+    m_framePool.Release();
+    m_tiledProcessor.ReleaseBuffers();
+}
+
+OverlayCacheStats ImageProcessor::GetOverlayCacheStats() const
+{
+    return m_overlayCache.GetStats();
+}
+
+AllocationStats ImageProcessor::GetAllocationStats() const
+{
+    AllocationStats stats;
+    stats.allocations = m_arena.GetStats().allocations + m_framePool.GetStats().allocations;
+    stats.bytes = m_arena.GetStats().bytes + m_framePool.GetStats().bytes;
+    return stats;
+}
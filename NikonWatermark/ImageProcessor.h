@@ -1,6 +1,11 @@
 #pragma once
 #include "stdafx.h"
 #include "ExifReader.h"
+#include "ImageHeaderProbe.h"
+#include "MemoryPool.h"
+#include "OverlayCache.h"
+#include "ParallelJpegEncoder.h"
+#include "TiledImageProcessor.h"
 #include <string>
 
 enum class WatermarkPosition
@@ -17,6 +22,9 @@ struct WatermarkConfig
     WatermarkPosition position = WatermarkPosition::Bottom;
 };
 
+// One ImageProcessor is one worker: it owns the frame buffer, the per-file
+// arena and the GDI+ text resources, and reuses them for every file it is
+// given. Instances must not be shared between threads.
 class ImageProcessor
 {
 public:
@@ -25,14 +33,71 @@ public:
     
     bool ProcessImage(const std::wstring& inputPath, const std::wstring& outputPath, const WatermarkConfig& config);
     
+    // For callers that probed the header already to estimate the working
+    // set; a file that failed the probe is passed with format Unknown
+    bool ProcessImage(const std::wstring& inputPath, const std::wstring& outputPath, const ImageHeaderInfo& header, 
+                      const WatermarkConfig& config);
+    
+    // Heap allocations made by the pooled buffers since construction; other
+    // allocations (GDI+, strings) are not counted
+    AllocationStats GetAllocationStats() const;
+    
+    // Hit/miss counters of the composed watermark band cache
+    OverlayCacheStats GetOverlayCacheStats() const;
+    
+    // Cores one frame may be encoded on. Every core by default; a batch
+    // gives each of its workers GetEncoderThreadShare() of them, so
+    // parallel workers do not each start a thread per core.
+    void SetEncoderThreads(UINT threads);
+    static UINT GetEncoderThreadShare(size_t workers);
+    
+    // Peak memory ProcessImage needs for a frame encoded on encoderThreads:
+    // the pooled output buffer, which the worker keeps afterwards, and
+    // everything freed on return
+    static void EstimateWorkingSet(const ImageHeaderInfo& info, UINT encoderThreads, 
+                                   UINT64& frameBytes, UINT64& transientBytes);
+    
+    // Bytes held between files by the pooled frame and tile buffers
+    UINT64 GetRetainedBytes() const;
+    void ReleaseBuffers();
+    
 private:
     ExifReader m_exifReader;
+    ExifData m_exifData;
+    ScratchArena m_arena;
+    FrameBufferPool m_framePool;
+    OverlayCache m_overlayCache;
+    ParallelJpegEncoder m_jpegEncoder;
+    TiledImageProcessor m_tiledProcessor;
+    std::unique_ptr<Gdiplus::Bitmap> m_measureBitmap;
+    
+    int m_fontSize;
+    std::unique_ptr<Gdiplus::FontFamily> m_textFontFamily;
+    std::unique_ptr<Gdiplus::FontFamily> m_logoFontFamily;
+    std::unique_ptr<Gdiplus::Font> m_textFont;
+    std::unique_ptr<Gdiplus::Font> m_logoFont;
+    std::unique_ptr<Gdiplus::SolidBrush> m_textBrush;
+    std::unique_ptr<Gdiplus::SolidBrush> m_shadowBrush;
+    
+    CLSID m_jpegClsid;
+    UINT m_encoderThreads;
+    
+    // Folder the last output went to, so it is only created once
+    std::wstring m_outputFolder;
     
+    void PrepareTextResources(int fontSize);
     void DrawWatermark(Gdiplus::Graphics& graphics, const ExifData& exifData, 
                       const WatermarkConfig& config, int imageWidth, int imageHeight);
-    void DrawLogo(Gdiplus::Graphics& graphics, const std::wstring& manufacturer, 
-                 int x, int y, int height);
-    std::wstring BuildWatermarkText(const ExifData& exifData, const WatermarkConfig& config);
+    const WatermarkOverlay* PrepareOverlay(const ExifData& exifData, const WatermarkConfig& config, 
+                                           int imageWidth, int imageHeight, int& x, int& y);
+    bool ProcessTiled(const std::wstring& inputPath, const std::wstring& outputPath, 
+                      const ImageHeaderInfo& header, const WatermarkConfig& config);
+    std::unique_ptr<WatermarkOverlay> ComposeOverlay(const WCHAR* text, const WCHAR* logoText, 
+                                                     int fontSize, int layoutWidth);
+    static const WCHAR* GetLogoText(const std::wstring& manufacturer);
+    const WCHAR* BuildWatermarkText(const ExifData& exifData, const WatermarkConfig& config);
     
+    bool CreateOutputFolder(const std::wstring& outputPath);
     CLSID GetEncoderClsid(const WCHAR* format);
+    static bool UseParallelEncoder(UINT width, UINT height, UINT encoderThreads);
 };
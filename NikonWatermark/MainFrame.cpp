@@ -1,9 +1,15 @@
 #include "stdafx.h"
 #include "MainFrame.h"
+#include "DirectoryEnumerator.h"
 #include <shlobj.h>
+#include <shobjidl.h>
 #include <sstream>
+#include <thread>
 
-CMainFrame::CMainFrame() : m_hBrushDark(NULL), m_hBrushDarkControl(NULL)
+static const UINT_PTR HOTFOLDER_TIMER_ID = 1;
+
+CMainFrame::CMainFrame() : m_hBrushDark(NULL), m_hBrushDarkControl(NULL), m_exportCount(0), 
+    m_coordinator(m_workerLauncher), m_batchIsolated(false), m_batchFailed(0), m_importCancelled(false)
 {
 }
 
@@ -34,18 +40,14 @@ LRESULT CMainFrame::OnCreate(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/
     // Create Import Label
     m_importLabel.Create(m_hWnd, NULL, L"Import Images", WS_CHILD | WS_VISIBLE | SS_LEFT, 0, IDC_IMPORT_LIST);
     
-    // Create Import List Box
-    m_importList.Create(m_hWnd, NULL, NULL, 
-        WS_CHILD | WS_VISIBLE | WS_BORDER | WS_VSCROLL | LBS_NOTIFY, 
-        0, IDC_IMPORT_LIST);
+    // Create Import List
+    CreateFileList(m_importList, IDC_IMPORT_LIST);
     
     // Create Export Label
     m_exportLabel.Create(m_hWnd, NULL, L"Export Images", WS_CHILD | WS_VISIBLE | SS_LEFT, 0, IDC_EXPORT_LIST);
     
-    // Create Export List Box
-    m_exportList.Create(m_hWnd, NULL, NULL, 
-        WS_CHILD | WS_VISIBLE | WS_BORDER | WS_VSCROLL | LBS_NOTIFY, 
-        0, IDC_EXPORT_LIST);
+    // Create Export List
+    CreateFileList(m_exportList, IDC_EXPORT_LIST);
     
     // Create Settings Label
     m_settingsLabel.Create(m_hWnd, NULL, L"Settings", WS_CHILD | WS_VISIBLE | SS_LEFT, 0, 1010);
@@ -55,11 +57,21 @@ LRESULT CMainFrame::OnCreate(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/
         WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON, 
         0, IDC_IMPORT_BUTTON);
     
+    // Create Import Folder Button
+    m_importFolderButton.Create(m_hWnd, NULL, L"Import Folder", 
+        WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON, 
+        0, IDC_IMPORT_FOLDER_BUTTON);
+    
     // Create Process Button
     m_processButton.Create(m_hWnd, NULL, L"Process Images", 
         WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON, 
         0, IDC_PROCESS_BUTTON);
     
+    // Create Watch Folder Button
+    m_watchButton.Create(m_hWnd, NULL, L"Watch Folder", 
+        WS_CHILD | WS_VISIBLE | BS_PUSHBUTTON, 
+        0, IDC_WATCH_BUTTON);
+    
     // Create Position ComboBox
     m_positionCombo.Create(m_hWnd, NULL, NULL, 
         WS_CHILD | WS_VISIBLE | CBS_DROPDOWNLIST, 
@@ -84,6 +96,10 @@ LRESULT CMainFrame::OnCreate(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/
         0, IDC_EXIF_SHUTTER);
     m_shutterCheck.SetCheck(BST_CHECKED);
     
+    m_isolateCheck.Create(m_hWnd, NULL, L"Isolate in worker processes", 
+        WS_CHILD | WS_VISIBLE | BS_AUTOCHECKBOX, 
+        0, IDC_ISOLATE_CHECK);
+    
     UpdateLayout();
     
     return 0;
@@ -91,6 +107,29 @@ LRESULT CMainFrame::OnCreate(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/
 
 LRESULT CMainFrame::OnDestroy(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& bHandled)
 {
+    StopWatching();
+    
+    // In-process workers finish the file they are on; worker processes
+    // are killed at once. The rest of the batch is dropped.
+    if (m_batchThread.joinable())
+    {
+        if (m_batchIsolated)
+            m_coordinator.Cancel();
+        else
+            m_batchEngine.Cancel();
+        m_batchThread.join();
+    }
+    
+    // The walk stops at the next file it finds
+    if (m_importThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_importMutex);
+            m_importCancelled = true;
+        }
+        m_importThread.join();
+    }
+    
     if (m_hBrushDark)
     {
         DeleteObject(m_hBrushDark);
@@ -135,7 +174,10 @@ void CMainFrame::UpdateLayout()
     m_importList.MoveWindow(margin, yPos, controlWidth, listHeight);
     yPos += listHeight + margin;
     
-    m_importButton.MoveWindow(margin, yPos, controlWidth, buttonHeight);
+    int importButtonWidth = (controlWidth - margin) / 2;
+    m_importButton.MoveWindow(margin, yPos, importButtonWidth, buttonHeight);
+    m_importFolderButton.MoveWindow(margin * 2 + importButtonWidth, yPos, 
+        controlWidth - margin - importButtonWidth, buttonHeight);
     
     // Export section (right side)
     yPos = margin;
@@ -145,6 +187,10 @@ void CMainFrame::UpdateLayout()
     m_exportList.MoveWindow(margin * 2 + controlWidth, yPos, controlWidth, listHeight);
     yPos += listHeight + margin;
     
+    // Single column spans the whole list
+    m_importList.SetColumnWidth(0, LVSCW_AUTOSIZE_USEHEADER);
+    m_exportList.SetColumnWidth(0, LVSCW_AUTOSIZE_USEHEADER);
+    
     // Settings section (bottom)
     yPos = height - buttonHeight * 3 - margin * 3;
     m_settingsLabel.MoveWindow(margin, yPos, controlWidth, labelHeight);
@@ -156,9 +202,11 @@ void CMainFrame::UpdateLayout()
     yPos += 30;
     
     m_positionCombo.MoveWindow(margin, yPos, 200, 25);
+    m_isolateCheck.MoveWindow(margin + 220, yPos, 250, 25);
     yPos += 35;
     
     m_processButton.MoveWindow(margin, yPos, controlWidth, buttonHeight);
+    m_watchButton.MoveWindow(margin * 2 + controlWidth, yPos, controlWidth, buttonHeight);
 }
 
 LRESULT CMainFrame::OnCtlColorStatic(UINT /*uMsg*/, WPARAM wParam, LPARAM /*lParam*/, BOOL& /*bHandled*/)
@@ -185,119 +233,516 @@ LRESULT CMainFrame::OnCtlColorListBox(UINT /*uMsg*/, WPARAM wParam, LPARAM /*lPa
     return (LRESULT)m_hBrushDarkControl;
 }
 
+void CMainFrame::CreateFileList(WTL::CListViewCtrl& list, UINT id)
+{
+    // Owner-data list: the control only stores the item count and asks
+    // for text through LVN_GETDISPINFO when a row becomes visible
+    list.Create(m_hWnd, NULL, NULL, 
+        WS_CHILD | WS_VISIBLE | WS_BORDER | WS_VSCROLL | 
+        LVS_REPORT | LVS_OWNERDATA | LVS_NOCOLUMNHEADER | LVS_SINGLESEL | LVS_SHOWSELALWAYS, 
+        0, id);
+    list.SetExtendedListViewStyle(LVS_EX_DOUBLEBUFFER);
+    list.InsertColumn(0, L"File", LVCFMT_LEFT, 100);
+    
+    list.SetBkColor(RGB(45, 45, 45));
+    list.SetTextBkColor(RGB(45, 45, 45));
+    list.SetTextColor(RGB(220, 220, 220));
+}
+
+void CMainFrame::RefreshFileLists()
+{
+    m_importList.SetItemCountEx((int)m_fileTable.GetCount(), 0);
+    m_exportList.SetItemCountEx((int)m_exportCount, 0);
+}
+
+bool CMainFrame::BrowseForFolder(const WCHAR* title, std::wstring& folder)
+{
+    BROWSEINFO bi = { 0 };
+    bi.hwndOwner = m_hWnd;
+    bi.lpszTitle = title;
+    bi.ulFlags = BIF_RETURNONLYFSDIRS | BIF_NEWDIALOGSTYLE;
+    
+    LPITEMIDLIST pidl = SHBrowseForFolder(&bi);
+    if (pidl == NULL)
+        return false;
+    
+    WCHAR path[MAX_PATH];
+    BOOL result = SHGetPathFromIDList(pidl, path);
+    CoTaskMemFree(pidl);
+    
+    if (!result)
+        return false;
+    
+    folder = path;
+    return true;
+}
+
+WatermarkConfig CMainFrame::GetWatermarkConfig()
+{
+    WatermarkConfig config;
+    config.showAperture = (m_apertureCheck.GetCheck() == BST_CHECKED);
+    config.showISO = (m_isoCheck.GetCheck() == BST_CHECKED);
+    config.showShutterSpeed = (m_shutterCheck.GetCheck() == BST_CHECKED);
+    config.position = (m_positionCombo.GetCurSel() == 0) ? WatermarkPosition::Bottom : WatermarkPosition::Top;
+    return config;
+}
+
+LRESULT CMainFrame::OnGetDispInfo(int /*idCtrl*/, LPNMHDR pnmh, BOOL& bHandled)
+{
+    NMLVDISPINFO* pDispInfo = (NMLVDISPINFO*)pnmh;
+    LVITEM& item = pDispInfo->item;
+    
+    if (pnmh->hwndFrom != m_importList.m_hWnd && pnmh->hwndFrom != m_exportList.m_hWnd)
+    {
+        bHandled = FALSE;
+        return 0;
+    }
+    
+    if (!(item.mask & LVIF_TEXT) || item.iItem < 0 || (size_t)item.iItem >= m_fileTable.GetCount())
+        return 0;
+    
+    size_t index = item.iItem;
+    if (pnmh->hwndFrom == m_exportList.m_hWnd && index < m_exportOrder.size())
+        index = m_exportOrder[index];
+    
+    const WCHAR* filename = m_fileTable.GetFileName(index);
+    
+    if (pnmh->hwndFrom == m_exportList.m_hWnd && 
+        m_fileTable.GetStatus(index) == FileStatus::Failed)
+    {
+        _snwprintf_s(item.pszText, item.cchTextMax, _TRUNCATE, L"Failed: %s", filename);
+    }
+    else
+    {
+        wcsncpy_s(item.pszText, item.cchTextMax, filename, _TRUNCATE);
+    }
+    
+    return 0;
+}
+
 LRESULT CMainFrame::OnImportImages(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 {
-    WTL::CFileDialog dlg(TRUE, L"jpg", NULL, 
-        OFN_HIDEREADONLY | OFN_FILEMUSTEXIST | OFN_ALLOWMULTISELECT, 
-        L"Image Files (*.jpg;*.jpeg;*.png;*.bmp)\0*.jpg;*.jpeg;*.png;*.bmp\0All Files (*.*)\0*.*\0", 
-        m_hWnd);
+    // The shell dialog returns the selection as an item array, so there is
+    // no fixed-size filename buffer to overflow on large selections
+    ATL::CComPtr<IFileOpenDialog> dialog;
+    if (FAILED(dialog.CoCreateInstance(CLSID_FileOpenDialog)))
+        return 0;
+    
+    COMDLG_FILTERSPEC filters[] = 
+    {
+        { L"Image Files (*.jpg;*.jpeg;*.png;*.bmp;*.tif;*.tiff)", L"*.jpg;*.jpeg;*.png;*.bmp;*.tif;*.tiff" },
+        { L"All Files (*.*)", L"*.*" }
+    };
+    dialog->SetFileTypes(_countof(filters), filters);
+    dialog->SetDefaultExtension(L"jpg");
+    
+    DWORD options = 0;
+    dialog->GetOptions(&options);
+    dialog->SetOptions(options | FOS_ALLOWMULTISELECT | FOS_FILEMUSTEXIST | FOS_FORCEFILESYSTEM);
+    
+    if (dialog->Show(m_hWnd) != S_OK)
+        return 0;
     
-    // Allocate buffer for multiple files
-    const int BUFFER_SIZE = 32768;
-    WCHAR* buffer = new WCHAR[BUFFER_SIZE];
-    ZeroMemory(buffer, BUFFER_SIZE * sizeof(WCHAR));
-    dlg.m_ofn.lpstrFile = buffer;
-    dlg.m_ofn.nMaxFile = BUFFER_SIZE;
+    ATL::CComPtr<IShellItemArray> items;
+    if (FAILED(dialog->GetResults(&items)))
+        return 0;
+    
+    DWORD count = 0;
+    items->GetCount(&count);
     
-    if (dlg.DoModal() == IDOK)
+    m_fileTable.Clear();
+    m_fileTable.Reserve(count);
+    m_exportCount = 0;
+    m_exportOrder.clear();
+    
+    for (DWORD i = 0; i < count; i++)
     {
-        m_importedFiles.clear();
-        m_importList.ResetContent();
-        
-        WCHAR* p = buffer;
-        std::wstring directory = p;
-        p += wcslen(p) + 1;
+        ATL::CComPtr<IShellItem> item;
+        if (FAILED(items->GetItemAt(i, &item)))
+            continue;
         
-        if (*p == 0)
+        LPWSTR path = NULL;
+        if (SUCCEEDED(item->GetDisplayName(SIGDN_FILESYSPATH, &path)))
         {
-            // Single file selected
-            m_importedFiles.push_back(directory);
-            
-            // Get filename only for display
-            size_t pos = directory.find_last_of(L"\\");
-            std::wstring filename = (pos != std::wstring::npos) ? directory.substr(pos + 1) : directory;
-            m_importList.AddString(filename.c_str());
+            m_fileTable.AddPath(path);
+            CoTaskMemFree(path);
         }
-        else
-        {
-            // Multiple files selected
-            while (*p)
+    }
+    
+    RefreshFileLists();
+    return 0;
+}
+
+LRESULT CMainFrame::OnImportFolder(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
+{
+    std::wstring inputFolder;
+    if (!BrowseForFolder(L"Select Folder to Import (including subfolders)", inputFolder))
+        return 0;
+    
+    m_fileTable.Clear();
+    m_fileTable.SetRoot(inputFolder);
+    m_exportCount = 0;
+    m_exportOrder.clear();
+    RefreshFileLists();
+    
+    // Large trees take a while to walk, so the list fills in as files are
+    // found. Nothing else touches the file table until WM_IMPORT_DONE.
+    EnableBatchControls(FALSE);
+    m_importLabel.SetWindowText(L"Import Images (scanning)");
+    m_importCancelled = false;
+    
+    HWND hWnd = m_hWnd;
+    m_importThread = std::thread([this, hWnd, inputFolder]()
+    {
+        DirectoryEnumerator enumerator(true);
+        enumerator.Enumerate(inputFolder, 
+            [this](const std::wstring& directory, const WCHAR* fileName)
             {
-                std::wstring filename = p;
-                std::wstring fullPath = directory + L"\\" + filename;
-                m_importedFiles.push_back(fullPath);
-                m_importList.AddString(filename.c_str());
-                p += wcslen(p) + 1;
-            }
-        }
+                return QueueImportFile(directory, fileName);
+            });
+        ::PostMessage(hWnd, WM_IMPORT_DONE, 0, 0);
+    });
+    return 0;
+}
+
+bool CMainFrame::QueueImportFile(const std::wstring& directory, const WCHAR* fileName)
+{
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(m_importMutex);
+        if (m_importCancelled)
+            return false;
+        wasEmpty = m_importFiles.empty();
+        ImportFile file = { directory, fileName };
+        m_importFiles.push_back(file);
     }
     
-    delete[] buffer;
+    // A lost message only delays the files until WM_IMPORT_DONE drains them
+    if (wasEmpty)
+        PostMessage(WM_IMPORT_FILES);
+    return true;
+}
+
+void CMainFrame::DrainImportFiles()
+{
+    m_importDrained.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_importMutex);
+        m_importDrained.swap(m_importFiles);
+    }
+    
+    if (m_importDrained.empty())
+        return;
+    
+    for (size_t i = 0; i < m_importDrained.size(); i++)
+        m_fileTable.Add(m_importDrained[i].directory, m_importDrained[i].fileName.c_str());
+    
+    m_importList.SetItemCountEx((int)m_fileTable.GetCount(), LVSICF_NOSCROLL | LVSICF_NOINVALIDATEALL);
+    
+    WCHAR text[128];
+    swprintf_s(text, L"Import Images (scanning: %u found)", (UINT)m_fileTable.GetCount());
+    m_importLabel.SetWindowText(text);
+}
+
+LRESULT CMainFrame::OnImportFiles(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& /*bHandled*/)
+{
+    DrainImportFiles();
+    return 0;
+}
+
+LRESULT CMainFrame::OnImportDone(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& /*bHandled*/)
+{
+    m_importThread.join();
+    DrainImportFiles();
+    
+    EnableBatchControls(TRUE);
+    m_importLabel.SetWindowText(L"Import Images");
     return 0;
 }
 
 LRESULT CMainFrame::OnProcessImages(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
 {
-    if (m_importedFiles.empty())
+    if (m_fileTable.GetCount() == 0)
     {
         MessageBox(L"Please import images first!", L"Error", MB_OK | MB_ICONERROR);
         return 0;
     }
     
     // Select output folder
-    BROWSEINFO bi = { 0 };
-    bi.hwndOwner = m_hWnd;
-    bi.lpszTitle = L"Select Output Folder";
-    bi.ulFlags = BIF_RETURNONLYFSDIRS | BIF_NEWDIALOGSTYLE;
+    std::wstring outputFolder;
+    if (!BrowseForFolder(L"Select Output Folder", outputFolder))
+        return 0;
     
-    LPITEMIDLIST pidl = SHBrowseForFolder(&bi);
-    if (pidl == NULL)
+    // Get configuration
+    WatermarkConfig config = GetWatermarkConfig();
+    
+    // Process images
+    m_fileTable.ResetStatus();
+    m_fileTable.AssignOutputNames();
+    m_exportCount = 0;
+    m_exportOrder.clear();
+    RefreshFileLists();
+    
+    m_batchIsolated = (m_isolateCheck.GetCheck() == BST_CHECKED);
+    m_batchAllocations = m_batchEngine.GetAllocationStats();
+    m_batchCache = m_batchEngine.GetOverlayCacheStats();
+    m_batchFailed = 0;
+    m_exportOrder.reserve(m_fileTable.GetCount());
+    
+    EnableBatchControls(FALSE);
+    m_exportLabel.SetWindowText(L"Export Images (processing)");
+    
+    if (m_batchIsolated)
+    {
+        RunIsolated(outputFolder, config);
         return 0;
+    }
+    
+    // Nothing changes the file table until WM_BATCH_DONE, so the workers
+    // can read it while the window keeps painting
+    HWND hWnd = m_hWnd;
+    m_batchThread = std::thread([this, hWnd, outputFolder, config]()
+    {
+        m_batchEngine.Run(m_fileTable, outputFolder, config, 
+            [this](size_t index, bool success)
+            {
+                QueueBatchResult(index, success);
+            });
+        ::PostMessage(hWnd, WM_BATCH_DONE, 0, 0);
+    });
+    
+    return 0;
+}
+
+void CMainFrame::EnableBatchControls(BOOL enable)
+{
+    m_importButton.EnableWindow(enable);
+    m_importFolderButton.EnableWindow(enable);
+    m_processButton.EnableWindow(enable);
+    m_watchButton.EnableWindow(enable);
+    m_positionCombo.EnableWindow(enable);
+    m_apertureCheck.EnableWindow(enable);
+    m_isoCheck.EnableWindow(enable);
+    m_shutterCheck.EnableWindow(enable);
+    m_isolateCheck.EnableWindow(enable);
+}
+
+void CMainFrame::QueueBatchResult(size_t index, bool success)
+{
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(m_batchMutex);
+        wasEmpty = m_batchResults.empty();
+        BatchResult result = { index, success };
+        m_batchResults.push_back(result);
+    }
     
-    WCHAR outputFolder[MAX_PATH];
-    if (!SHGetPathFromIDList(pidl, outputFolder))
+    // A lost message only delays the results until WM_BATCH_DONE drains them
+    if (wasEmpty)
+        PostMessage(WM_BATCH_RESULTS);
+}
+
+void CMainFrame::DrainBatchResults()
+{
+    m_batchDrained.clear();
     {
-        CoTaskMemFree(pidl);
+        std::lock_guard<std::mutex> lock(m_batchMutex);
+        m_batchDrained.swap(m_batchResults);
+    }
+    
+    if (m_batchDrained.empty())
+        return;
+    
+    for (size_t i = 0; i < m_batchDrained.size(); i++)
+    {
+        const BatchResult& result = m_batchDrained[i];
+        m_fileTable.SetStatus(result.index, result.success ? FileStatus::Succeeded : FileStatus::Failed);
+        m_exportOrder.push_back(result.index);
+        if (!result.success)
+            m_batchFailed++;
+    }
+    
+    m_exportCount = m_exportOrder.size();
+    m_exportList.SetItemCountEx((int)m_exportCount, LVSICF_NOSCROLL | LVSICF_NOINVALIDATEALL);
+    
+    WCHAR text[128];
+    swprintf_s(text, L"Export Images (processing: %u of %u done, %u failed)", 
+        (UINT)m_exportCount, (UINT)m_fileTable.GetCount(), (UINT)m_batchFailed);
+    m_exportLabel.SetWindowText(text);
+}
+
+LRESULT CMainFrame::OnBatchResults(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& /*bHandled*/)
+{
+    DrainBatchResults();
+    return 0;
+}
+
+LRESULT CMainFrame::OnBatchDone(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM /*lParam*/, BOOL& /*bHandled*/)
+{
+    m_batchThread.join();
+    DrainBatchResults();
+    
+    EnableBatchControls(TRUE);
+    m_exportLabel.SetWindowText(L"Export Images");
+    
+    if (m_batchIsolated)
+    {
+        ShowIsolatedReport();
         return 0;
     }
-    CoTaskMemFree(pidl);
     
-    // Get configuration
-    WatermarkConfig config;
-    config.showAperture = (m_apertureCheck.GetCheck() == BST_CHECKED);
-    config.showISO = (m_isoCheck.GetCheck() == BST_CHECKED);
-    config.showShutterSpeed = (m_shutterCheck.GetCheck() == BST_CHECKED);
-    config.position = (m_positionCombo.GetCurSel() == 0) ? WatermarkPosition::Bottom : WatermarkPosition::Top;
+    // Pool growth only; once the pools fit the largest frame this stays at
+    // zero. bench/process_bench.cpp counts every heap allocation per file.
+    AllocationStats after = m_batchEngine.GetAllocationStats();
+    ATLTRACE(L"Processed %u files: %I64u pooled allocations, %I64u bytes\n", 
+        (UINT)m_exportCount, after.allocations - m_batchAllocations.allocations, after.bytes - m_batchAllocations.bytes);
     
-    // Process images
-    m_exportList.ResetContent();
+    BatchStats batch = m_batchEngine.GetStats();
+    ATLTRACE(L"Memory budget %I64u MB, peak admitted %I64u MB, %I64u reordered, %I64u unprobed, %I64u oversized\n", 
+        batch.budgetBytes >> 20, batch.peakBytes >> 20, batch.reordered, batch.unprobed, batch.oversized);
+    
+    OverlayCacheStats cacheAfter = m_batchEngine.GetOverlayCacheStats();
+    UINT64 hits = cacheAfter.hits - m_batchCache.hits;
+    UINT64 lookups = hits + cacheAfter.misses - m_batchCache.misses;
+    
+    WCHAR message[256];
+    swprintf_s(message, L"Image processing completed!\n\n%u succeeded, %u failed\n\nWatermark cache: %I64u of %I64u frames reused a composed band (%.0f%%)", 
+        (UINT)(m_exportCount - m_batchFailed), (UINT)m_batchFailed, hits, lookups, lookups ? hits * 100.0 / lookups : 0.0);
+    MessageBox(message, L"Success", MB_OK | MB_ICONINFORMATION);
+    return 0;
+}
+
+void CMainFrame::RunIsolated(const std::wstring& outputFolder, const WatermarkConfig& config)
+{
+    m_batchOutputFolder = outputFolder;
     
-    for (size_t i = 0; i < m_importedFiles.size(); i++)
+    // Same hand-off as the in-process batch: per-file results are posted as
+    // workers report them, and the report is only read after the join
+    HWND hWnd = m_hWnd;
+    m_batchThread = std::thread([this, hWnd, outputFolder, config]()
     {
-        std::wstring inputPath = m_importedFiles[i];
-        
-        // Get filename
-        size_t pos = inputPath.find_last_of(L"\\");
-        std::wstring filename = (pos != std::wstring::npos) ? inputPath.substr(pos + 1) : inputPath;
-        
-        // Create output path
-        std::wstring outputPath = outputFolder;
-        outputPath += L"\\";
-        outputPath += filename;
-        
-        // Process image
-        if (m_imageProcessor.ProcessImage(inputPath, outputPath, config))
-        {
-            m_exportList.AddString(filename.c_str());
-        }
-        else
+        m_coordinator.Run(m_fileTable, outputFolder, config, std::thread::hardware_concurrency(), m_batchReport, 
+            [this](size_t index, bool success)
+            {
+                QueueBatchResult(index, success);
+            });
+        ::PostMessage(hWnd, WM_BATCH_DONE, 0, 0);
+    });
+}
+
+void CMainFrame::ShowIsolatedReport()
+{
+    const BatchReport& report = m_batchReport;
+    std::wstring reportPath = m_batchOutputFolder + L"\\BatchReport.csv";
+    bool written = report.WriteCsv(reportPath, m_fileTable);
+    
+    WCHAR message[512];
+    swprintf_s(message, L"Image processing completed!\n\n%u succeeded, %u failed, %u retried after a worker was lost\n"
+        L"%.1f s elapsed, %.1f s of processing\n\n%s%s", 
+        (UINT)report.GetSucceeded(), (UINT)report.GetFailed(), (UINT)report.GetRetried(), 
+        report.GetWallMilliseconds() / 1000.0, report.GetTotalMilliseconds() / 1000.0,
+        written ? L"Report: " : L"The report could not be written to ", reportPath.c_str());
+    MessageBox(message, L"Success", MB_OK | MB_ICONINFORMATION);
+}
+
+LRESULT CMainFrame::OnWatchFolder(WORD /*wNotifyCode*/, WORD /*wID*/, HWND /*hWndCtl*/, BOOL& /*bHandled*/)
+{
+    if (m_hotFolder.IsRunning())
+    {
+        StopWatching();
+        return 0;
+    }
+    
+    std::wstring inputFolder;
+    if (!BrowseForFolder(L"Select Folder to Watch", inputFolder))
+        return 0;
+    
+    std::wstring outputFolder;
+    if (!BrowseForFolder(L"Select Output Folder", outputFolder))
+        return 0;
+    
+    if (_wcsicmp(inputFolder.c_str(), outputFolder.c_str()) == 0)
+    {
+        MessageBox(L"The output folder must be different from the watched folder!", L"Error", MB_OK | MB_ICONERROR);
+        return 0;
+    }
+    
+    m_fileTable.Clear();
+    m_exportCount = 0;
+    m_exportOrder.clear();
+    RefreshFileLists();
+    
+    HWND hWnd = m_hWnd;
+    std::vector<std::wstring> inputFolders(1, inputFolder);
+    
+    bool started = m_hotFolder.Start(inputFolders, outputFolder, GetWatermarkConfig(), 
+        [hWnd](const HotFolderResult& result)
         {
-            std::wstring error = L"Failed: " + filename;
-            m_exportList.AddString(error.c_str());
-        }
+            HotFolderResult* pResult = new HotFolderResult(result);
+            if (!::PostMessage(hWnd, WM_HOTFOLDER_RESULT, 0, (LPARAM)pResult))
+                delete pResult;
+        });
+    
+    if (!started)
+    {
+        MessageBox(L"Unable to watch the selected folder!", L"Error", MB_OK | MB_ICONERROR);
+        return 0;
     }
     
-    MessageBox(L"Image processing completed!", L"Success", MB_OK | MB_ICONINFORMATION);
+    m_watchButton.SetWindowText(L"Stop Watching");
+    m_importButton.EnableWindow(FALSE);
+    m_importFolderButton.EnableWindow(FALSE);
+    m_processButton.EnableWindow(FALSE);
+    SetTimer(HOTFOLDER_TIMER_ID, 1000);
+    m_exportLabel.SetWindowText(L"Export Images (watching)");
+    
+    return 0;
+}
+
+void CMainFrame::StopWatching()
+{
+    if (!m_hotFolder.IsRunning())
+        return;
+    
+    m_hotFolder.Stop();
+    
+    KillTimer(HOTFOLDER_TIMER_ID);
+    m_watchButton.SetWindowText(L"Watch Folder");
+    m_importButton.EnableWindow(TRUE);
+    m_importFolderButton.EnableWindow(TRUE);
+    m_processButton.EnableWindow(TRUE);
+    m_exportLabel.SetWindowText(L"Export Images");
+}
+
+LRESULT CMainFrame::OnTimer(UINT /*uMsg*/, WPARAM wParam, LPARAM /*lParam*/, BOOL& bHandled)
+{
+    if (wParam != HOTFOLDER_TIMER_ID)
+    {
+        bHandled = FALSE;
+        return 0;
+    }
+    
+    HotFolderStats stats = m_hotFolder.GetStats();
+    
+    WCHAR text[256];
+    UINT64 lookups = stats.overlayCache.hits + stats.overlayCache.misses;
+    swprintf_s(text, L"Export Images (watching: %u queued, %I64u done, %I64u failed, latency p50 %.0f / p95 %.0f / p99 %.0f ms, cache hits %.0f%%)", 
+        (UINT)stats.queueDepth, stats.processed, stats.failed, stats.p50Ms, stats.p95Ms, stats.p99Ms, 
+        lookups ? stats.overlayCache.hits * 100.0 / lookups : 0.0);
+    m_exportLabel.SetWindowText(text);
+    
+    return 0;
+}
+
+LRESULT CMainFrame::OnHotFolderResult(UINT /*uMsg*/, WPARAM /*wParam*/, LPARAM lParam, BOOL& /*bHandled*/)
+{
+    std::unique_ptr<HotFolderResult> result((HotFolderResult*)lParam);
+    
+    size_t index = m_fileTable.AddPath(result->inputPath);
+    m_fileTable.SetStatus(index, result->success ? FileStatus::Succeeded : FileStatus::Failed);
+    m_exportCount = m_fileTable.GetCount();
+    
+    RefreshFileLists();
     return 0;
 }
 
@@ -1,8 +1,28 @@
 #pragma once
 #include "stdafx.h"
 #include "resource.h"
-#include "ImageProcessor.h"
+#include "BatchEngine.h"
+#include "ShardCoordinator.h"
+#include "FileTable.h"
+#include "HotFolderService.h"
 #include <vector>
+#include <mutex>
+#include <thread>
+
+// Posted by the hot-folder worker; lParam is a HotFolderResult* owned by the receiver
+#define WM_HOTFOLDER_RESULT     (WM_APP + 1)
+
+// Posted by the batch thread when it queues results into an empty queue,
+// so a fast batch sends one message per drain rather than one per file
+#define WM_BATCH_RESULTS        (WM_APP + 2)
+
+// Posted by the batch thread once the batch is over
+#define WM_BATCH_DONE           (WM_APP + 3)
+
+// Posted by the folder import thread when it queues files into an empty
+// queue, and once the folder has been walked
+#define WM_IMPORT_FILES         (WM_APP + 4)
+#define WM_IMPORT_DONE          (WM_APP + 5)
 
 class CMainFrame : public ATL::CFrameWindowImpl<CMainFrame>,
                    public WTL::CUpdateUI<CMainFrame>,
@@ -27,8 +47,17 @@ public:
         MESSAGE_HANDLER(WM_CTLCOLORSTATIC, OnCtlColorStatic)
         MESSAGE_HANDLER(WM_CTLCOLORBTN, OnCtlColorBtn)
         MESSAGE_HANDLER(WM_CTLCOLORLISTBOX, OnCtlColorListBox)
+        MESSAGE_HANDLER(WM_TIMER, OnTimer)
+        MESSAGE_HANDLER(WM_HOTFOLDER_RESULT, OnHotFolderResult)
+        MESSAGE_HANDLER(WM_BATCH_RESULTS, OnBatchResults)
+        MESSAGE_HANDLER(WM_BATCH_DONE, OnBatchDone)
+        MESSAGE_HANDLER(WM_IMPORT_FILES, OnImportFiles)
+        MESSAGE_HANDLER(WM_IMPORT_DONE, OnImportDone)
+        NOTIFY_CODE_HANDLER(LVN_GETDISPINFO, OnGetDispInfo)
         COMMAND_ID_HANDLER(IDC_IMPORT_BUTTON, OnImportImages)
+        COMMAND_ID_HANDLER(IDC_IMPORT_FOLDER_BUTTON, OnImportFolder)
         COMMAND_ID_HANDLER(IDC_PROCESS_BUTTON, OnProcessImages)
+        COMMAND_ID_HANDLER(IDC_WATCH_BUTTON, OnWatchFolder)
         COMMAND_ID_HANDLER(IDCANCEL, OnExit)
         CHAIN_MSG_MAP(ATL::CFrameWindowImpl<CMainFrame>)
     END_MSG_MAP()
@@ -39,22 +68,58 @@ public:
     LRESULT OnCtlColorStatic(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
     LRESULT OnCtlColorBtn(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
     LRESULT OnCtlColorListBox(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
+    LRESULT OnTimer(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
+    LRESULT OnHotFolderResult(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
+    LRESULT OnBatchResults(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
+    LRESULT OnBatchDone(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
+    LRESULT OnImportFiles(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
+    LRESULT OnImportDone(UINT uMsg, WPARAM wParam, LPARAM lParam, BOOL& bHandled);
+    LRESULT OnGetDispInfo(int idCtrl, LPNMHDR pnmh, BOOL& bHandled);
     LRESULT OnImportImages(WORD wNotifyCode, WORD wID, HWND hWndCtl, BOOL& bHandled);
+    LRESULT OnImportFolder(WORD wNotifyCode, WORD wID, HWND hWndCtl, BOOL& bHandled);
     LRESULT OnProcessImages(WORD wNotifyCode, WORD wID, HWND hWndCtl, BOOL& bHandled);
+    LRESULT OnWatchFolder(WORD wNotifyCode, WORD wID, HWND hWndCtl, BOOL& bHandled);
     LRESULT OnExit(WORD wNotifyCode, WORD wID, HWND hWndCtl, BOOL& bHandled);
 
 private:
+    struct BatchResult
+    {
+        size_t index;
+        bool success;
+    };
+    
+    struct ImportFile
+    {
+        std::wstring directory;
+        std::wstring fileName;
+    };
+    
     void SetDarkTheme();
     void UpdateLayout();
+    void CreateFileList(WTL::CListViewCtrl& list, UINT id);
+    void RefreshFileLists();
+    bool BrowseForFolder(const WCHAR* title, std::wstring& folder);
+    WatermarkConfig GetWatermarkConfig();
+    void StopWatching();
+    void RunIsolated(const std::wstring& outputFolder, const WatermarkConfig& config);
+    void ShowIsolatedReport();
+    void EnableBatchControls(BOOL enable);
+    void QueueBatchResult(size_t index, bool success);
+    void DrainBatchResults();
+    bool QueueImportFile(const std::wstring& directory, const WCHAR* fileName);
+    void DrainImportFiles();
     
-    WTL::CListBox m_importList;
-    WTL::CListBox m_exportList;
+    WTL::CListViewCtrl m_importList;
+    WTL::CListViewCtrl m_exportList;
     WTL::CButton m_importButton;
+    WTL::CButton m_importFolderButton;
     WTL::CButton m_processButton;
+    WTL::CButton m_watchButton;
     WTL::CComboBox m_positionCombo;
     WTL::CButton m_apertureCheck;
     WTL::CButton m_isoCheck;
     WTL::CButton m_shutterCheck;
+    WTL::CButton m_isolateCheck;
     WTL::CStatic m_importLabel;
     WTL::CStatic m_exportLabel;
     WTL::CStatic m_settingsLabel;
@@ -62,6 +127,35 @@ private:
     HBRUSH m_hBrushDark;
     HBRUSH m_hBrushDarkControl;
     
-    std::vector<std::wstring> m_importedFiles;
-    ImageProcessor m_imageProcessor;
+    FileTable m_fileTable;
+    size_t m_exportCount;
+    BatchEngine m_batchEngine;
+    LocalProcessLauncher m_workerLauncher;
+    ShardCoordinator m_coordinator;
+    HotFolderService m_hotFolder;
+    
+    // Export list rows in completion order while a batch runs; rows past
+    // its end map to the file table index directly
+    std::vector<size_t> m_exportOrder;
+    
+    // The batch thread only reads the file table and appends to
+    // m_batchResults; everything else is updated on the UI thread
+    std::thread m_batchThread;
+    std::mutex m_batchMutex;
+    std::vector<BatchResult> m_batchResults;
+    std::vector<BatchResult> m_batchDrained;
+    bool m_batchIsolated;       // Run by m_coordinator, which fills m_batchReport
+    BatchReport m_batchReport;
+    std::wstring m_batchOutputFolder;
+    size_t m_batchFailed;
+    AllocationStats m_batchAllocations;
+    OverlayCacheStats m_batchCache;
+    
+    // The import thread only walks the folder and appends to m_importFiles;
+    // the file table grows on the UI thread as they are drained
+    std::thread m_importThread;
+    std::mutex m_importMutex;
+    std::vector<ImportFile> m_importFiles;
+    std::vector<ImportFile> m_importDrained;
+    bool m_importCancelled;
 };
@@ -0,0 +1,135 @@
+#include "stdafx.h"
+#include "MemoryPool.h"
+#include <malloc.h>
+
+ScratchArena::ScratchArena(size_t blockSize)
+    : m_blockSize(blockSize), m_current(0), m_offset(0)
+{
+}
+
+ScratchArena::~ScratchArena()
+{
+    for (size_t i = 0; i < m_blocks.size(); i++)
+        free(m_blocks[i].data);
+}
+
+void ScratchArena::AddBlock(size_t minimumSize)
+{
+    Block block;
+    block.size = (minimumSize > m_blockSize) ? minimumSize : m_blockSize;
+    block.data = (BYTE*)malloc(block.size);
+    if (block.data == NULL)
+        throw std::bad_alloc();
+
+    m_blocks.push_back(block);
+    m_stats.allocations++;
+    m_stats.bytes += block.size;
+}
+
+void* ScratchArena::Allocate(size_t size, size_t alignment)
+{
+    if (size == 0)
+        size = 1;
+
+    while (m_current < m_blocks.size())
+    {
+        Block& block = m_blocks[m_current];
+        size_t aligned = (m_offset + alignment - 1) & ~(alignment - 1);
+
+        if (aligned + size <= block.size)
+        {
+            m_offset = aligned + size;
+            return block.data + aligned;
+        }
+
+        m_current++;
+        m_offset = 0;
+    }
+
+    // malloc alignment covers every type we place in the arena
+    AddBlock(size);
+    m_current = m_blocks.size() - 1;
+    m_offset = size;
+    return m_blocks[m_current].data;
+}
+
+void ScratchArena::Reset()
+{
+    // A file that spilled into several blocks is likely to be followed by
+    // similar files, so fold them into one block big enough for all of it
+    if (m_blocks.size() > 1)
+    {
+        size_t total = 0;
+        for (size_t i = 0; i < m_blocks.size(); i++)
+        {
+            total += m_blocks[i].size;
+            free(m_blocks[i].data);
+        }
+        m_blocks.clear();
+        AddBlock(total);
+    }
+
+    m_current = 0;
+    m_offset = 0;
+}
+
+FrameBufferPool::FrameBufferPool()
+    : m_buffer(NULL), m_capacity(0), m_width(0), m_height(0), m_stride(0)
+{
+}
+
+FrameBufferPool::~FrameBufferPool()
+{
+    Release();
+}
+
+Gdiplus::Bitmap* FrameBufferPool::Acquire(UINT width, UINT height)
+{
+    if (m_bitmap && width == m_width && height == m_height)
+        return m_bitmap.get();
+
+    m_bitmap.reset();
+
+    // DWORD-aligned rows as GDI+ expects for 24bpp scan lines
+    INT stride = (INT)((width * 3 + 3) & ~3u);
+    size_t required = (size_t)stride * height;
+
+    if (required > m_capacity)
+    {
+        _aligned_free(m_buffer);
+        m_buffer = (BYTE*)_aligned_malloc(required, 64);
+        if (m_buffer == NULL)
+        {
+            m_capacity = 0;
+            return NULL;
+        }
+        m_capacity = required;
+        m_stats.allocations++;
+        m_stats.bytes += required;
+    }
+
+    m_bitmap.reset(new Gdiplus::Bitmap(width, height, stride, PixelFormat24bppRGB, m_buffer));
+    m_stats.allocations++;
+    m_stats.bytes += sizeof(Gdiplus::Bitmap);
+    if (m_bitmap->GetLastStatus() != Gdiplus::Ok)
+    {
+        m_bitmap.reset();
+        return NULL;
+    }
+
+    m_width = width;
+    m_height = height;
+    m_stride = stride;
+    return m_bitmap.get();
+}
+
+void FrameBufferPool::Release()
+{
+    m_bitmap.reset();
+    _aligned_free(m_buffer);
+    m_buffer = NULL;
+    m_capacity = 0;
+    m_width = 0;
+    m_height = 0;
+    m_stride = 0;
+}
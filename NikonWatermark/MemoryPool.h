@@ -0,0 +1,80 @@
+#pragma once
+#include "stdafx.h"
+#include <vector>
+
+// Heap traffic caused by a pool or arena. Once every file in a batch fits
+// the buffers already held, these counters stop moving.
+struct AllocationStats
+{
+    UINT64 allocations = 0;
+    UINT64 bytes = 0;
+};
+
+// Bump allocator for per-file temporaries (EXIF property items, watermark
+// text). Reset() releases everything at once and keeps the memory for the
+// next file.
+class ScratchArena
+{
+public:
+    explicit ScratchArena(size_t blockSize = 64 * 1024);
+    ~ScratchArena();
+
+    void* Allocate(size_t size, size_t alignment = sizeof(void*));
+
+    template<typename T>
+    T* AllocateArray(size_t count)
+    {
+        return static_cast<T*>(Allocate(count * sizeof(T), __alignof(T)));
+    }
+
+    void Reset();
+
+    const AllocationStats& GetStats() const { return m_stats; }
+
+private:
+    struct Block
+    {
+        BYTE* data;
+        size_t size;
+    };
+
+    void AddBlock(size_t minimumSize);
+
+    std::vector<Block> m_blocks;
+    size_t m_blockSize;
+    size_t m_current;
+    size_t m_offset;
+    AllocationStats m_stats;
+};
+
+// 24bpp frame buffer that grows to the largest frame seen and is shared by
+// every file a worker processes. The GDI+ bitmap wrapping it is only
+// rebuilt when the frame dimensions change.
+class FrameBufferPool
+{
+public:
+    FrameBufferPool();
+    ~FrameBufferPool();
+
+    Gdiplus::Bitmap* Acquire(UINT width, UINT height);
+
+    BYTE* GetScan0() const { return m_buffer; }
+    INT GetStride() const { return m_stride; }
+    size_t GetCapacity() const { return m_capacity; }
+
+    void Release();
+
+    const AllocationStats& GetStats() const { return m_stats; }
+
+private:
+    FrameBufferPool(const FrameBufferPool&);
+    FrameBufferPool& operator=(const FrameBufferPool&);
+
+    BYTE* m_buffer;
+    size_t m_capacity;
+    std::unique_ptr<Gdiplus::Bitmap> m_bitmap;
+    UINT m_width;
+    UINT m_height;
+    INT m_stride;
+    AllocationStats m_stats;
+};
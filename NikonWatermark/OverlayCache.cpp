@@ -0,0 +1,63 @@
+#include "stdafx.h"
+#include "OverlayCache.h"
+
+OverlayCache::OverlayCache(size_t capacity) : m_capacity(capacity > 0 ? capacity : 1)
+{
+}
+
+OverlayCache::~OverlayCache()
+{
+}
+
+void OverlayCache::BuildKey(const WCHAR* text, const WCHAR* logo, int fontSize, int widthClass)
+{
+    WCHAR numbers[32];
+    swprintf_s(numbers, L"%d|%d|", fontSize, widthClass);
+
+    m_key.assign(numbers);
+    m_key += logo;
+    m_key += L'|';
+    m_key += text;
+}
+
+const WatermarkOverlay* OverlayCache::Find(const WCHAR* text, const WCHAR* logo, int fontSize, int widthClass)
+{
+    BuildKey(text, logo, fontSize, widthClass);
+
+    auto it = m_index.find(m_key);
+    if (it == m_index.end())
+    {
+        m_stats.misses++;
+        return NULL;
+    }
+
+    m_stats.hits++;
+    m_entries.splice(m_entries.begin(), m_entries, it->second);
+    return it->second->overlay.get();
+}
+
+const WatermarkOverlay* OverlayCache::Insert(std::unique_ptr<WatermarkOverlay> overlay)
+{
+    if (m_entries.size() >= m_capacity)
+    {
+        m_index.erase(m_entries.back().key);
+        m_entries.pop_back();
+        m_stats.evictions++;
+    }
+
+    Entry entry;
+    entry.key = m_key;
+    entry.overlay = std::move(overlay);
+    m_entries.push_front(std::move(entry));
+    m_index[m_key] = m_entries.begin();
+
+    m_stats.entries = m_entries.size();
+    return m_entries.front().overlay.get();
+}
+
+void OverlayCache::Clear()
+{
+    m_index.clear();
+    m_entries.clear();
+    m_stats.entries = 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+#include <list>
+#include <unordered_map>
+
+// A fully composed watermark band (logo + shadow + text) in premultiplied
+// BGRA, ready to be blended onto any frame that needs the same text.
+struct WatermarkOverlay
+{
+    WatermarkOverlay() : width(0), height(0), stride(0), textHeight(0) {}
+
+    std::vector<BYTE> pixels;
+    std::unique_ptr<Gdiplus::Bitmap> bitmap;  // Wraps pixels; never resize them
+    int width;
+    int height;
+    int stride;
+    int textHeight;  // Measured text height, used for vertical placement
+};
+
+struct OverlayCacheStats
+{
+    UINT64 hits = 0;
+    UINT64 misses = 0;
+    UINT64 evictions = 0;
+    size_t entries = 0;
+};
+
+// Least-recently-used cache of composed watermark bands. A shoot usually
+// repeats a handful of aperture/ISO/shutter combinations, so most frames
+// reuse a band instead of measuring and drawing the text again.
+//
+// The band does not depend on the watermark position (that only moves it
+// vertically), so top and bottom placements share entries.
+class OverlayCache
+{
+public:
+    explicit OverlayCache(size_t capacity = 64);
+    ~OverlayCache();
+
+    // Frames are grouped into width classes so the band layout (which can
+    // wrap against the frame width) stays identical within a class
+    static const int WIDTH_CLASS_STEP = 512;
+
+    const WatermarkOverlay* Find(const WCHAR* text, const WCHAR* logo, int fontSize, int widthClass);
+
+    // Stores an overlay under the key of the preceding Find() call
+    const WatermarkOverlay* Insert(std::unique_ptr<WatermarkOverlay> overlay);
+
+    void Clear();
+
+    const OverlayCacheStats& GetStats() const { return m_stats; }
+
+private:
+    struct Entry
+    {
+        std::wstring key;
+        std::unique_ptr<WatermarkOverlay> overlay;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    void BuildKey(const WCHAR* text, const WCHAR* logo, int fontSize, int widthClass);
+
+    size_t m_capacity;
+    EntryList m_entries;  // Most recently used first
+    std::unordered_map<std::wstring, EntryList::iterator> m_index;
+    std::wstring m_key;   // Reused so lookups do not allocate
+    OverlayCacheStats m_stats;
+};
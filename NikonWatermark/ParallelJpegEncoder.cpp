@@ -0,0 +1,554 @@
+#include "stdafx.h"
+#include "ParallelJpegEncoder.h"
+#include <new>
+#include <system_error>
+#include <thread>
+
+namespace
+{
+    // Natural (row-major) index of each coefficient in zig-zag order
+    const BYTE ZIGZAG[64] =
+    {
+         0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+        12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+    };
+
+    // ITU-T T.81 Annex K quantisation tables, natural order
+    const BYTE BASE_QUANT[2][64] =
+    {
+        {
+            16, 11, 10, 16,  24,  40,  51,  61,  12, 12, 14, 19,  26,  58,  60,  55,
+            14, 13, 16, 24,  40,  57,  69,  56,  14, 17, 22, 29,  51,  87,  80,  62,
+            18, 22, 37, 56,  68, 109, 103,  77,  24, 35, 55, 64,  81, 104, 113,  92,
+            49, 64, 78, 87, 103, 121, 120, 101,  72, 92, 95, 98, 112, 100, 103,  99
+        },
+        {
+            17, 18, 24, 47, 99, 99, 99, 99,  18, 21, 26, 66, 99, 99, 99, 99,
+            24, 26, 56, 99, 99, 99, 99, 99,  47, 66, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+            99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99
+        }
+    };
+
+    // ITU-T T.81 Annex K Huffman tables: code counts per length, then symbols
+    const BYTE DC_LUMA_BITS[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+    const BYTE DC_CHROMA_BITS[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+    const BYTE DC_VALUES[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+    const BYTE AC_LUMA_BITS[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+    const BYTE AC_LUMA_VALUES[162] =
+    {
+        0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+        0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+        0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+        0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+        0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+        0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+        0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+        0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+        0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+        0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa
+    };
+
+    const BYTE AC_CHROMA_BITS[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+    const BYTE AC_CHROMA_VALUES[162] =
+    {
+        0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+        0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+        0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+        0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+        0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+        0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+        0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+        0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+        0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+        0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+        0xf9, 0xfa
+    };
+
+    struct HuffmanTable
+    {
+        USHORT code[256];
+        BYTE length[256];
+    };
+
+    void BuildHuffmanTable(const BYTE bits[16], const BYTE* values, HuffmanTable& table)
+    {
+        ZeroMemory(&table, sizeof(table));
+
+        USHORT code = 0;
+        size_t k = 0;
+        for (int length = 1; length <= 16; length++)
+        {
+            for (int i = 0; i < bits[length - 1]; i++)
+            {
+                table.code[values[k]] = code++;
+                table.length[values[k]] = (BYTE)length;
+                k++;
+            }
+            code <<= 1;
+        }
+    }
+
+    struct HuffmanTables
+    {
+        HuffmanTable dc[2];
+        HuffmanTable ac[2];
+
+        HuffmanTables()
+        {
+            BuildHuffmanTable(DC_LUMA_BITS, DC_VALUES, dc[0]);
+            BuildHuffmanTable(DC_CHROMA_BITS, DC_VALUES, dc[1]);
+            BuildHuffmanTable(AC_LUMA_BITS, AC_LUMA_VALUES, ac[0]);
+            BuildHuffmanTable(AC_CHROMA_BITS, AC_CHROMA_VALUES, ac[1]);
+        }
+    };
+
+    const HuffmanTables& GetHuffmanTables()
+    {
+        static const HuffmanTables tables;
+        return tables;
+    }
+
+    // Arai-Agui-Nakajima scale factors; the forward DCT below leaves its
+    // output multiplied by 8 * AAN_SCALE[u] * AAN_SCALE[v]
+    const double AAN_SCALE[8] =
+    {
+        1.0, 1.387039845, 1.306562965, 1.175875602, 1.0, 0.785694958, 0.541196100, 0.275899379
+    };
+
+    void ForwardDct1D(float* d, int step)
+    {
+        float tmp0 = d[0] + d[7 * step];
+        float tmp7 = d[0] - d[7 * step];
+        float tmp1 = d[1 * step] + d[6 * step];
+        float tmp6 = d[1 * step] - d[6 * step];
+        float tmp2 = d[2 * step] + d[5 * step];
+        float tmp5 = d[2 * step] - d[5 * step];
+        float tmp3 = d[3 * step] + d[4 * step];
+        float tmp4 = d[3 * step] - d[4 * step];
+
+        // Even part
+        float tmp10 = tmp0 + tmp3;
+        float tmp13 = tmp0 - tmp3;
+        float tmp11 = tmp1 + tmp2;
+        float tmp12 = tmp1 - tmp2;
+
+        d[0] = tmp10 + tmp11;
+        d[4 * step] = tmp10 - tmp11;
+
+        float z1 = (tmp12 + tmp13) * 0.707106781f;
+        d[2 * step] = tmp13 + z1;
+        d[6 * step] = tmp13 - z1;
+
+        // Odd part
+        tmp10 = tmp4 + tmp5;
+        tmp11 = tmp5 + tmp6;
+        tmp12 = tmp6 + tmp7;
+
+        float z5 = (tmp10 - tmp12) * 0.382683433f;
+        float z2 = 0.541196100f * tmp10 + z5;
+        float z4 = 1.306562965f * tmp12 + z5;
+        float z3 = tmp11 * 0.707106781f;
+
+        float z11 = tmp7 + z3;
+        float z13 = tmp7 - z3;
+
+        d[5 * step] = z13 + z2;
+        d[3 * step] = z13 - z2;
+        d[1 * step] = z11 + z4;
+        d[7 * step] = z11 - z4;
+    }
+
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<BYTE>& out) : m_out(out), m_buffer(0), m_count(0) {}
+
+        void Write(UINT code, int length)
+        {
+            m_buffer = (m_buffer << length) | (code & ((1u << length) - 1));
+            m_count += length;
+
+            while (m_count >= 8)
+            {
+                BYTE byte = (BYTE)(m_buffer >> (m_count - 8));
+                m_out.push_back(byte);
+                if (byte == 0xFF)
+                    m_out.push_back(0);  // Byte stuffing
+                m_count -= 8;
+            }
+        }
+
+        // Pads the last byte with 1-bits, as required before a marker
+        void Flush()
+        {
+            if (m_count > 0)
+                Write(0x7F, 8 - m_count);
+            m_buffer = 0;
+        }
+
+    private:
+        std::vector<BYTE>& m_out;
+        UINT m_buffer;
+        int m_count;
+    };
+
+    int Category(int value)
+    {
+        if (value < 0)
+            value = -value;
+
+        int bits = 0;
+        while (value)
+        {
+            bits++;
+            value >>= 1;
+        }
+        return bits;
+    }
+
+    void EncodeBlock(BitWriter& writer, float* block, const float* divisors, int& previousDc,
+                     const HuffmanTable& dc, const HuffmanTable& ac)
+    {
+        for (int i = 0; i < 8; i++)
+            ForwardDct1D(block + i * 8, 1);
+        for (int i = 0; i < 8; i++)
+            ForwardDct1D(block + i, 8);
+
+        int coefficients[64];
+        for (int i = 0; i < 64; i++)
+        {
+            int natural = ZIGZAG[i];
+            float value = block[natural] * divisors[natural];
+            coefficients[i] = (int)(value < 0 ? value - 0.5f : value + 0.5f);
+        }
+
+        // DC is coded as the difference from the previous block
+        int diff = coefficients[0] - previousDc;
+        previousDc = coefficients[0];
+
+        int size = Category(diff);
+        writer.Write(dc.code[size], dc.length[size]);
+        if (size)
+            writer.Write(diff < 0 ? diff - 1 : diff, size);
+
+        int run = 0;
+        for (int i = 1; i < 64; i++)
+        {
+            int value = coefficients[i];
+            if (value == 0)
+            {
+                run++;
+                continue;
+            }
+
+            while (run >= 16)
+            {
+                writer.Write(ac.code[0xF0], ac.length[0xF0]);  // ZRL
+                run -= 16;
+            }
+
+            size = Category(value);
+            int symbol = (run << 4) | size;
+            writer.Write(ac.code[symbol], ac.length[symbol]);
+            writer.Write(value < 0 ? value - 1 : value, size);
+            run = 0;
+        }
+
+        if (run > 0)
+            writer.Write(ac.code[0x00], ac.length[0x00]);  // EOB
+    }
+
+    void PutMarker(std::vector<BYTE>& out, BYTE marker, USHORT length)
+    {
+        out.push_back(0xFF);
+        out.push_back(marker);
+        out.push_back((BYTE)(length >> 8));
+        out.push_back((BYTE)length);
+    }
+
+    void PutHuffmanTable(std::vector<BYTE>& out, BYTE tableClassAndId, const BYTE bits[16], const BYTE* values)
+    {
+        size_t count = 0;
+        for (int i = 0; i < 16; i++)
+            count += bits[i];
+
+        out.push_back(tableClassAndId);
+        out.insert(out.end(), bits, bits + 16);
+        out.insert(out.end(), values, values + count);
+    }
+}
+
+ParallelJpegEncoder::ParallelJpegEncoder() : m_quality(-1), m_threadBudget(0)
+{
+}
+
+ParallelJpegEncoder::~ParallelJpegEncoder()
+{
+}
+
+void ParallelJpegEncoder::SetQuality(int quality)
+{
+    if (quality == m_quality)
+        return;
+
+    // IJG quality scaling
+    int q = quality < 1 ? 1 : (quality > 100 ? 100 : quality);
+    int scale = (q < 50) ? 5000 / q : 200 - q * 2;
+
+    for (int table = 0; table < 2; table++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            int value = (BASE_QUANT[table][i] * scale + 50) / 100;
+            if (value < 1) value = 1;
+            if (value > 255) value = 255;
+            m_quant[table][i] = (BYTE)value;
+
+            int row = i / 8;
+            int col = i % 8;
+            m_divisors[table][i] = (float)(1.0 / (value * AAN_SCALE[row] * AAN_SCALE[col] * 8.0));
+        }
+    }
+
+    m_quality = quality;
+}
+
+void ParallelJpegEncoder::WriteHeaders(std::vector<BYTE>& out, UINT width, UINT height) const
+{
+    static const BYTE JFIF[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+
+    out.clear();
+    out.push_back(0xFF);
+    out.push_back(0xD8);  // SOI
+
+    PutMarker(out, 0xE0, 2 + sizeof(JFIF));
+    out.insert(out.end(), JFIF, JFIF + sizeof(JFIF));
+
+    PutMarker(out, 0xDB, 2 + 2 * 65);
+    for (int table = 0; table < 2; table++)
+    {
+        out.push_back((BYTE)table);
+        for (int i = 0; i < 64; i++)
+            out.push_back(m_quant[table][ZIGZAG[i]]);
+    }
+
+    // Baseline frame, three components, no subsampling
+    PutMarker(out, 0xC0, 17);
+    out.push_back(8);
+    out.push_back((BYTE)(height >> 8));
+    out.push_back((BYTE)height);
+    out.push_back((BYTE)(width >> 8));
+    out.push_back((BYTE)width);
+    out.push_back(3);
+    for (BYTE component = 1; component <= 3; component++)
+    {
+        out.push_back(component);
+        out.push_back(0x11);
+        out.push_back(component == 1 ? 0 : 1);
+    }
+
+    PutMarker(out, 0xC4, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+    PutHuffmanTable(out, 0x00, DC_LUMA_BITS, DC_VALUES);
+    PutHuffmanTable(out, 0x10, AC_LUMA_BITS, AC_LUMA_VALUES);
+    PutHuffmanTable(out, 0x01, DC_CHROMA_BITS, DC_VALUES);
+    PutHuffmanTable(out, 0x11, AC_CHROMA_BITS, AC_CHROMA_VALUES);
+
+    // One restart interval per MCU row
+    UINT mcusPerRow = (width + 7) / 8;
+    PutMarker(out, 0xDD, 4);
+    out.push_back((BYTE)(mcusPerRow >> 8));
+    out.push_back((BYTE)mcusPerRow);
+
+    PutMarker(out, 0xDA, 12);
+    out.push_back(3);
+    for (BYTE component = 1; component <= 3; component++)
+    {
+        out.push_back(component);
+        out.push_back(component == 1 ? 0x00 : 0x11);
+    }
+    out.push_back(0);
+    out.push_back(63);
+    out.push_back(0);
+}
+
+void ParallelJpegEncoder::EncodeSegment(const BYTE* pixels, UINT width, UINT height, INT stride,
+                                        Segment& segment) const
+{
+    const HuffmanTables& huffman = GetHuffmanTables();
+    UINT totalRows = (height + 7) / 8;
+    UINT mcusPerRow = (width + 7) / 8;
+
+    segment.data.clear();
+    BitWriter writer(segment.data);
+
+    float y[64];
+    float cb[64];
+    float cr[64];
+
+    for (UINT row = segment.firstRow; row < segment.firstRow + segment.rowCount; row++)
+    {
+        int dcY = 0;
+        int dcCb = 0;
+        int dcCr = 0;
+
+        for (UINT mcu = 0; mcu < mcusPerRow; mcu++)
+        {
+            // Colour conversion for this block; edge blocks repeat the last
+            // row/column of the image
+            for (int by = 0; by < 8; by++)
+            {
+                UINT py = row * 8 + by;
+                if (py >= height) py = height - 1;
+                const BYTE* line = pixels + (size_t)py * stride;
+
+                for (int bx = 0; bx < 8; bx++)
+                {
+                    UINT px = mcu * 8 + bx;
+                    if (px >= width) px = width - 1;
+                    const BYTE* p = line + px * 3;
+
+                    float b = p[0];
+                    float g = p[1];
+                    float r = p[2];
+                    int i = by * 8 + bx;
+
+                    y[i] = 0.299f * r + 0.587f * g + 0.114f * b - 128.0f;
+                    cb[i] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+                    cr[i] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+                }
+            }
+
+            EncodeBlock(writer, y, m_divisors[0], dcY, huffman.dc[0], huffman.ac[0]);
+            EncodeBlock(writer, cb, m_divisors[1], dcCb, huffman.dc[1], huffman.ac[1]);
+            EncodeBlock(writer, cr, m_divisors[1], dcCr, huffman.dc[1], huffman.ac[1]);
+        }
+
+        writer.Flush();
+
+        // Restart marker between intervals; the decoder resets DC prediction
+        if (row + 1 < totalRows)
+        {
+            segment.data.push_back(0xFF);
+            segment.data.push_back((BYTE)(0xD0 + (row & 7)));
+        }
+    }
+}
+
+// Body of every segment thread. An exception escaping a std::thread calls
+// std::terminate, so it is recorded on the segment instead.
+void ParallelJpegEncoder::RunSegment(const BYTE* pixels, UINT width, UINT height, INT stride,
+                                     Segment& segment) const
+{
+    segment.failed = false;
+    try
+    {
+        EncodeSegment(pixels, width, height, stride, segment);
+    }
+    catch (...)
+    {
+        segment.failed = true;
+        std::vector<BYTE>().swap(segment.data);
+    }
+}
+
+bool ParallelJpegEncoder::Encode(const BYTE* pixels, UINT width, UINT height, INT stride, int quality,
+                                 const std::wstring& outputPath)
+{
+    // Baseline JPEG dimensions and the DRI field are 16-bit
+    if (pixels == NULL || width == 0 || height == 0 || width > 65535 || height > 65535)
+        return false;
+
+    SetQuality(quality);
+
+    // The segment threads are always joined before anything here can throw
+    try
+    {
+        return EncodeFrame(pixels, width, height, stride, outputPath);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+}
+
+bool ParallelJpegEncoder::EncodeFrame(const BYTE* pixels, UINT width, UINT height, INT stride,
+                                      const std::wstring& outputPath)
+{
+    UINT totalRows = (height + 7) / 8;
+    UINT threads = m_threadBudget != 0 ? m_threadBudget : std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+    if (threads > totalRows) threads = totalRows;
+
+    m_segments.resize(threads);
+    UINT rowsPerSegment = totalRows / threads;
+    UINT extraRows = totalRows % threads;
+    UINT nextRow = 0;
+
+    for (UINT i = 0; i < threads; i++)
+    {
+        m_segments[i].firstRow = nextRow;
+        m_segments[i].rowCount = rowsPerSegment + (i < extraRows ? 1 : 0);
+        nextRow += m_segments[i].rowCount;
+    }
+
+    // The calling thread takes the first segment itself, and any segment
+    // whose thread could not be started. Threads are only added to reserved
+    // space, so nothing can throw while one is running unjoined.
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (UINT i = 1; i < threads; i++)
+    {
+        try
+        {
+            workers.emplace_back(&ParallelJpegEncoder::RunSegment, this,
+                                 pixels, width, height, stride, std::ref(m_segments[i]));
+        }
+        catch (const std::system_error&)
+        {
+            RunSegment(pixels, width, height, stride, m_segments[i]);
+        }
+    }
+    RunSegment(pixels, width, height, stride, m_segments[0]);
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    for (UINT i = 0; i < threads; i++)
+    {
+        if (m_segments[i].failed)
+            return false;
+    }
+
+    WriteHeaders(m_header, width, height);
+
+    HANDLE hFile = CreateFileW(outputPath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    static const BYTE EOI[] = { 0xFF, 0xD9 };
+    bool success = true;
+    DWORD written = 0;
+
+    success = WriteFile(hFile, &m_header[0], (DWORD)m_header.size(), &written, NULL) != FALSE;
+    for (UINT i = 0; success && i < threads; i++)
+    {
+        const std::vector<BYTE>& data = m_segments[i].data;
+        if (!data.empty())
+            success = WriteFile(hFile, &data[0], (DWORD)data.size(), &written, NULL) != FALSE;
+    }
+    if (success)
+        success = WriteFile(hFile, EOI, sizeof(EOI), &written, NULL) != FALSE;
+
+    CloseHandle(hFile);
+
+    if (!success)
+        DeleteFileW(outputPath.c_str());
+
+    return success;
+}
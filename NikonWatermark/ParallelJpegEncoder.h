@@ -0,0 +1,53 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+#include <vector>
+
+// Baseline JPEG encoder for very large frames. Every MCU row is its own
+// restart interval, so contiguous runs of rows can be colour-converted,
+// transformed and entropy-coded on separate cores and the resulting
+// segments simply concatenated. Output is 4:4:4 YCbCr with the standard
+// Huffman tables, which any JPEG decoder accepts.
+//
+// Holds its segment buffers between calls; one instance per worker.
+class ParallelJpegEncoder
+{
+public:
+    ParallelJpegEncoder();
+    ~ParallelJpegEncoder();
+
+    // pixels use the GDI+ PixelFormat24bppRGB layout (B, G, R per pixel).
+    // Never throws: running out of memory for the segments, on any thread,
+    // makes it return false so the caller can use GDI+ instead.
+    bool Encode(const BYTE* pixels, UINT width, UINT height, INT stride, int quality,
+                const std::wstring& outputPath);
+
+    // Threads one frame may use, the calling thread included; 0 (the
+    // default) means one per core
+    void SetThreadBudget(UINT threads) { m_threadBudget = threads; }
+
+private:
+    ParallelJpegEncoder(const ParallelJpegEncoder&);
+    ParallelJpegEncoder& operator=(const ParallelJpegEncoder&);
+
+    struct Segment
+    {
+        UINT firstRow;   // In MCU rows
+        UINT rowCount;
+        std::vector<BYTE> data;
+        bool failed;     // EncodeSegment threw; data is empty
+    };
+
+    void SetQuality(int quality);
+    void WriteHeaders(std::vector<BYTE>& out, UINT width, UINT height) const;
+    bool EncodeFrame(const BYTE* pixels, UINT width, UINT height, INT stride, const std::wstring& outputPath);
+    void EncodeSegment(const BYTE* pixels, UINT width, UINT height, INT stride, Segment& segment) const;
+    void RunSegment(const BYTE* pixels, UINT width, UINT height, INT stride, Segment& segment) const;
+
+    int m_quality;
+    UINT m_threadBudget;
+    BYTE m_quant[2][64];      // Natural order
+    float m_divisors[2][64];  // Natural order, AAN scale folded in
+    std::vector<Segment> m_segments;
+    std::vector<BYTE> m_header;
+};
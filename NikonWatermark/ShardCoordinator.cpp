@@ -0,0 +1,446 @@
+#include "stdafx.h"
+#include "ShardCoordinator.h"
+#include "BatchEngine.h"
+#include "WorkerProcess.h"
+
+ShardCoordinator::ShardCoordinator(IWorkerLauncher& launcher)
+    : m_launcher(launcher), m_budget(BatchEngine::GetDefaultMemoryBudget()), m_files(NULL), m_report(NULL),
+      m_nextProbed(0), m_nextShardId(1), m_nextWorkerId(1), m_usedBytes(0), m_remaining(0)
+{
+    m_hCancel = CreateEventW(NULL, TRUE, FALSE, NULL);
+    m_hProbed = CreateEventW(NULL, FALSE, FALSE, NULL);
+}
+
+ShardCoordinator::~ShardCoordinator()
+{
+    m_prober.Stop();
+    if (m_hCancel != NULL)
+        CloseHandle(m_hCancel);
+    if (m_hProbed != NULL)
+        CloseHandle(m_hProbed);
+}
+
+void ShardCoordinator::Cancel()
+{
+    SetEvent(m_hCancel);
+}
+
+void ShardCoordinator::QueueShard(std::vector<size_t>& files, bool front)
+{
+    if (files.empty())
+        return;
+
+    Shard shard;
+    shard.id = m_nextShardId++;
+    shard.bypassed = 0;
+    shard.peakBytes = 0;
+
+    // A worker handles its shard one file at a time
+    for (size_t i = 0; i < files.size(); i++)
+        shard.peakBytes = max(shard.peakBytes, GetEstimatedBytes(files[i]));
+
+    shard.files.swap(files);
+
+    if (front)
+        m_queue.push_front(shard);
+    else
+        m_queue.push_back(shard);
+}
+
+UINT64 ShardCoordinator::GetEstimatedBytes(size_t index) const
+{
+    // Without a header the file claims the whole budget and runs alone
+    const HeaderProber::Estimate& estimate = m_prober.GetEstimate(index);
+    return estimate.probed ? estimate.frameBytes + estimate.transientBytes : m_budget;
+}
+
+// Turns files the prober has finished into shards, holding back a partial
+// shard until probing ends; returns false once every file is in a shard
+bool ShardCoordinator::QueueProbed()
+{
+    bool finished = false;
+    size_t probed = m_prober.GetProbedCount(finished);
+
+    std::vector<size_t> shardFiles;
+    while (m_nextProbed < probed && (probed - m_nextProbed >= SHARD_SIZE || finished))
+    {
+        size_t end = min(probed, m_nextProbed + SHARD_SIZE);
+        for (; m_nextProbed < end; m_nextProbed++)
+            shardFiles.push_back(m_nextProbed);
+        QueueShard(shardFiles, false);
+    }
+
+    return !finished;
+}
+
+bool ShardCoordinator::AssignShard(Slot& slot)
+{
+    size_t limit = min(m_queue.size(), BatchEngine::LOOKAHEAD);
+    size_t pick = limit;
+
+    for (size_t i = 0; i < limit; i++)
+    {
+        if (m_usedBytes + m_queue[i].peakBytes <= m_budget)
+        {
+            pick = i;
+            break;
+        }
+
+        if (m_queue[i].bypassed >= BatchEngine::MAX_BYPASS)
+            break;
+    }
+
+    if (pick == limit)
+    {
+        // Too large for the budget at all; it gets the machine to itself
+        if (m_usedBytes > 0)
+            return false;
+        pick = 0;
+    }
+
+    WorkerMessage message;
+    message.type = L"SHARD";
+    message.fields.push_back(std::to_wstring(m_queue[pick].id));
+    for (size_t i = 0; i < m_queue[pick].files.size(); i++)
+    {
+        size_t index = m_queue[pick].files[i];
+        message.fields.push_back(std::to_wstring((UINT64)index));
+        message.fields.push_back(m_files->GetFullPath(index));
+        message.fields.push_back(m_files->GetOutputName(index));
+        message.fields.push_back(WorkerProcess::FormatHeader(m_prober.GetEstimate(index).header));
+    }
+
+    // A failed send means the worker is gone; the next poll reports it
+    if (!slot.channel->Send(message))
+        return false;
+
+    for (size_t i = 0; i < pick; i++)
+        m_queue[i].bypassed++;
+
+    slot.shard = m_queue[pick];
+    m_queue.erase(m_queue.begin() + pick);
+
+    slot.busy = true;
+    slot.reported = 0;
+    slot.leaseExpires = GetTickCount64() + LEASE_MS;
+    slot.chargedBytes = slot.shard.peakBytes;
+    m_usedBytes += slot.chargedBytes;
+    return true;
+}
+
+bool ShardCoordinator::HandleResult(Slot& slot, const WorkerMessage& message)
+{
+    if (message.type != L"RESULT" || message.fields.size() != 4 || !slot.busy)
+        return false;
+
+    // Workers report strictly in shard order
+    if (_wcstoui64(message.fields[0].c_str(), NULL, 10) != slot.shard.id ||
+        slot.reported >= slot.shard.files.size())
+        return false;
+
+    size_t index = slot.shard.files[slot.reported];
+    if (_wcstoui64(message.fields[1].c_str(), NULL, 10) != index)
+        return false;
+
+    BatchReportEntry& entry = m_report->GetEntry(index);
+    entry.done = true;
+    entry.success = (message.fields[2] == L"1");
+    entry.attempts++;
+    entry.worker = slot.workerId;
+    entry.milliseconds = _wtof(message.fields[3].c_str());
+    entry.note.clear();
+    CompleteFile(index);
+
+    slot.reported++;
+    slot.leaseExpires = GetTickCount64() + LEASE_MS;
+
+    if (slot.reported == slot.shard.files.size())
+    {
+        slot.busy = false;
+        m_usedBytes -= slot.chargedBytes;
+        slot.chargedBytes = 0;
+    }
+
+    return true;
+}
+
+void ShardCoordinator::ReleaseWorker(Slot& slot, const WCHAR* reason)
+{
+    if (slot.busy)
+    {
+        // Results arrive in order, so the first unreported file is the one
+        // the worker was on when it died
+        std::vector<size_t> rest(slot.shard.files.begin() + slot.reported, slot.shard.files.end());
+        size_t suspect = rest.front();
+        rest.erase(rest.begin());
+        QueueShard(rest, true);
+
+        BatchReportEntry& entry = m_report->GetEntry(suspect);
+        entry.attempts++;
+        entry.note = reason;
+
+        if (entry.attempts >= MAX_ATTEMPTS)
+        {
+            entry.done = true;
+            entry.success = false;
+            CompleteFile(suspect);
+        }
+        else
+        {
+            // Retried on its own, ahead of the rest of its shard
+            std::vector<size_t> alone(1, suspect);
+            QueueShard(alone, true);
+        }
+
+        m_usedBytes -= slot.chargedBytes;
+    }
+
+    m_report->AddLostWorker();
+    slot.channel.reset();
+    slot.busy = false;
+    slot.chargedBytes = 0;
+}
+
+// Kills a worker at once when the batch is cancelled, even mid-file;
+// whatever is left of its shard fails without being retried
+void ShardCoordinator::StopWorker(Slot& slot)
+{
+    slot.channel->Terminate();
+
+    if (slot.busy)
+    {
+        // The file it was on may be half written
+        std::wstring partial = m_outputFolder + L"\\" + m_files->GetOutputName(slot.shard.files[slot.reported]);
+        DeleteFileW(partial.c_str());
+
+        for (size_t i = slot.reported; i < slot.shard.files.size(); i++)
+            FailFile(slot.shard.files[i], L"Batch was cancelled");
+        m_usedBytes -= slot.chargedBytes;
+    }
+
+    slot.channel.reset();
+    slot.busy = false;
+    slot.chargedBytes = 0;
+}
+
+// Fails every file not handed to a worker yet, including those the prober
+// has not reached
+void ShardCoordinator::FailQueued(const WCHAR* reason)
+{
+    for (size_t i = 0; i < m_queue.size(); i++)
+    {
+        for (size_t j = 0; j < m_queue[i].files.size(); j++)
+            FailFile(m_queue[i].files[j], reason);
+    }
+    m_queue.clear();
+
+    m_prober.Stop();
+    for (; m_nextProbed < m_files->GetCount(); m_nextProbed++)
+        FailFile(m_nextProbed, reason);
+}
+
+void ShardCoordinator::FailFile(size_t index, const WCHAR* reason)
+{
+    BatchReportEntry& entry = m_report->GetEntry(index);
+    entry.done = true;
+    entry.success = false;
+    entry.note = reason;
+    CompleteFile(index);
+}
+
+void ShardCoordinator::CompleteFile(size_t index)
+{
+    m_remaining--;
+    if (m_callback)
+        m_callback(index, m_report->GetEntry(index).success);
+}
+
+// Sleeps until a worker has output or exits, the earliest lease runs out,
+// another header is probed or the batch is cancelled
+void ShardCoordinator::WaitForWorkers(const std::vector<Slot>& slots, bool cancelled, bool probing)
+{
+    std::vector<HANDLE> handles;
+    if (!cancelled)
+        handles.push_back(m_hCancel);
+    if (probing)
+        handles.push_back(m_hProbed);
+
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG timeout = WAIT_MS;
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        if (!slots[i].channel)
+            continue;
+
+        slots[i].channel->GetWaitHandles(handles);
+        if (slots[i].busy)
+            timeout = min(timeout, slots[i].leaseExpires >= now ? slots[i].leaseExpires - now + 1 : 0);
+    }
+
+    // MAX_WORKERS keeps local workers within the limit; handles past it are
+    // only noticed when the wait times out
+    DWORD count = (DWORD)min(handles.size(), (size_t)MAXIMUM_WAIT_OBJECTS);
+    if (count == 0)
+        Sleep((DWORD)timeout);
+    else
+        WaitForMultipleObjects(count, &handles[0], FALSE, (DWORD)timeout);
+}
+
+void ShardCoordinator::Run(const FileTable& files, const std::wstring& outputFolder, const WatermarkConfig& config,
+                           size_t workerCount, BatchReport& report, const ResultCallback& callback)
+{
+    report.Reset(files.GetCount());
+    if (files.GetCount() == 0)
+    {
+        ResetEvent(m_hCancel);
+        return;
+    }
+
+    m_files = &files;
+    m_outputFolder = outputFolder;
+    m_report = &report;
+    m_callback = callback;
+
+    workerCount = max(workerCount, (size_t)1);
+    workerCount = min(workerCount, MAX_WORKERS);
+    workerCount = min(workerCount, (files.GetCount() + SHARD_SIZE - 1) / SHARD_SIZE);
+
+    // Each worker process encodes on its share of the cores
+    UINT encoderThreads = ImageProcessor::GetEncoderThreadShare(workerCount);
+
+    // Workers start on the first shards while later headers are still
+    // being read
+    m_queue.clear();
+    m_nextProbed = 0;
+    ResetEvent(m_hProbed);
+    m_prober.Start(files, encoderThreads, [this]()
+    {
+        SetEvent(m_hProbed);
+    });
+
+    std::vector<Slot> slots(workerCount);
+    for (size_t i = 0; i < slots.size(); i++)
+    {
+        slots[i].workerId = 0;
+        slots[i].busy = false;
+        slots[i].reported = 0;
+        slots[i].leaseExpires = 0;
+        slots[i].chargedBytes = 0;
+    }
+
+    WorkerMessage configMessage;
+    WorkerProcess::MakeConfigMessage(outputFolder, config, encoderThreads, configMessage);
+
+    m_remaining = files.GetCount();
+    m_usedBytes = 0;
+    UINT launchFailures = 0;
+    ULONGLONG start = GetTickCount64();
+    WorkerMessage message;
+
+    while (m_remaining > 0)
+    {
+        bool cancelled = WaitForSingleObject(m_hCancel, 0) == WAIT_OBJECT_0;
+        if (cancelled)
+            FailQueued(L"Batch was cancelled");
+
+        bool probing = QueueProbed();
+
+        // Replace workers that exited, as long as there is work for them
+        bool anyAlive = false;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            Slot& slot = slots[i];
+            if (!slot.channel && !m_queue.empty())
+            {
+                slot.channel = m_launcher.Launch();
+                if (slot.channel && slot.channel->Send(configMessage))
+                {
+                    slot.workerId = m_nextWorkerId++;
+                    launchFailures = 0;
+                }
+                else
+                {
+                    slot.channel.reset();
+                    launchFailures++;
+                }
+            }
+
+            if (slot.channel)
+                anyAlive = true;
+        }
+
+        if (!anyAlive)
+        {
+            // Nothing to start a worker for until the first shard is probed
+            if (m_queue.empty() && probing)
+            {
+                WaitForWorkers(slots, cancelled, probing);
+                continue;
+            }
+
+            if (m_queue.empty() || launchFailures >= MAX_LAUNCH_FAILURES)
+            {
+                FailQueued(L"Worker process could not be started");
+                break;
+            }
+            WaitForSingleObject(m_hCancel, RELAUNCH_MS);
+            continue;
+        }
+
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            if (slots[i].channel && !slots[i].busy && !m_queue.empty())
+                AssignShard(slots[i]);
+        }
+
+        bool progress = false;
+        for (size_t i = 0; i < slots.size(); i++)
+        {
+            Slot& slot = slots[i];
+            if (!slot.channel)
+                continue;
+
+            const WCHAR* reason = L"Worker process exited while processing this file";
+            ChannelState state;
+            while ((state = slot.channel->Poll(message)) == ChannelState::Message)
+            {
+                progress = true;
+                if (!HandleResult(slot, message))
+                {
+                    slot.channel->Terminate();
+                    state = ChannelState::Closed;
+                    reason = L"Worker process sent an invalid result";
+                    break;
+                }
+            }
+
+            if (state == ChannelState::Closed)
+            {
+                ReleaseWorker(slot, reason);
+            }
+            else if (cancelled)
+            {
+                StopWorker(slot);
+            }
+            else if (slot.busy && GetTickCount64() > slot.leaseExpires)
+            {
+                slot.channel->Terminate();
+                ReleaseWorker(slot, L"Worker process timed out on this file");
+            }
+        }
+
+        if (!progress)
+            WaitForWorkers(slots, cancelled, probing);
+    }
+
+    report.SetWallMilliseconds((double)(GetTickCount64() - start));
+
+    // Closing the channels lets the workers exit
+    slots.clear();
+    m_queue.clear();
+    m_prober.Stop();
+    m_files = NULL;
+    m_report = NULL;
+    m_callback = nullptr;
+    ResetEvent(m_hCancel);
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include "stdafx.h"
+#include "WorkerChannel.h"
+#include "BatchReport.h"
+#include "FileTable.h"
+#include "ImageProcessor.h"
+#include "HeaderProber.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <memory>
+
+// Splits a batch into shards of consecutive files and hands them to worker
+// processes, so GDI+ runs without cross-thread contention and a file that
+// crashes or hangs its worker only costs that worker. Each busy worker
+// holds a lease that every reported file renews; when a worker dies or its
+// lease runs out, the file it was on is retried alone (MAX_ATTEMPTS runs in
+// total) and the rest of its shard goes back on the queue. Shards are
+// admitted against the same memory budget as BatchEngine, as soon as
+// HeaderProber has read their headers. Between events the coordinator
+// sleeps in WaitForMultipleObjects on its workers' handles.
+class ShardCoordinator
+{
+public:
+    typedef std::function<void(size_t index, bool success)> ResultCallback;
+
+    explicit ShardCoordinator(IWorkerLauncher& launcher);
+    ~ShardCoordinator();
+
+    void SetMemoryBudget(UINT64 bytes) { m_budget = bytes; }
+
+    // Blocks until every file has a result in the report. The callback runs
+    // on the calling thread once per file, when its result is final.
+    void Run(const FileTable& files, const std::wstring& outputFolder, const WatermarkConfig& config,
+             size_t workerCount, BatchReport& report, const ResultCallback& callback);
+
+    // Makes a running (or about to start) Run return early: queued files
+    // fail as cancelled, and busy workers are killed at once, their
+    // unreported files failed and the half-written output deleted. Safe to
+    // call from any thread.
+    void Cancel();
+
+    static const size_t SHARD_SIZE = 16;
+    static const size_t MAX_WORKERS = 31;      // Two wait handles each, plus the cancel and probe events
+    static const UINT MAX_ATTEMPTS = 2;
+    static const DWORD LEASE_MS = 120000;
+    static const DWORD WAIT_MS = 1000;         // Longest wait for channels without handles
+    static const DWORD RELAUNCH_MS = 100;
+    static const UINT MAX_LAUNCH_FAILURES = 3;
+
+private:
+    ShardCoordinator(const ShardCoordinator&);
+    ShardCoordinator& operator=(const ShardCoordinator&);
+
+    struct Shard
+    {
+        UINT id;
+        std::vector<size_t> files;
+        UINT64 peakBytes;
+        UINT bypassed;
+    };
+
+    struct Slot
+    {
+        std::unique_ptr<IWorkerChannel> channel;
+        UINT workerId;
+        bool busy;
+        Shard shard;
+        size_t reported;            // Files of the shard with a result so far
+        ULONGLONG leaseExpires;
+        UINT64 chargedBytes;
+    };
+
+    void QueueShard(std::vector<size_t>& files, bool front);
+    bool QueueProbed();
+    UINT64 GetEstimatedBytes(size_t index) const;
+    bool AssignShard(Slot& slot);
+    bool HandleResult(Slot& slot, const WorkerMessage& message);
+    void ReleaseWorker(Slot& slot, const WCHAR* reason);
+    void StopWorker(Slot& slot);
+    void FailQueued(const WCHAR* reason);
+    void FailFile(size_t index, const WCHAR* reason);
+    void CompleteFile(size_t index);
+    void WaitForWorkers(const std::vector<Slot>& slots, bool cancelled, bool probing);
+
+    IWorkerLauncher& m_launcher;
+    UINT64 m_budget;
+    HANDLE m_hCancel;
+    HANDLE m_hProbed;                  // Set by the prober after every file
+
+    const FileTable* m_files;
+    std::wstring m_outputFolder;
+    BatchReport* m_report;
+    ResultCallback m_callback;
+    HeaderProber m_prober;
+    size_t m_nextProbed;               // First file not yet in a shard
+    std::deque<Shard> m_queue;
+    UINT m_nextShardId;
+    UINT m_nextWorkerId;
+    UINT64 m_usedBytes;
+    size_t m_remaining;
+};
@@ -0,0 +1,337 @@
+#include "stdafx.h"
+#include "TiffCodec.h"
+#include <algorithm>
+
+static const UINT LZW_CLEAR = 256;
+static const UINT LZW_EOI = 257;
+static const UINT LZW_FIRST_CODE = 258;
+static const UINT LZW_MAX_CODES = 4096;
+static const UINT LZW_MIN_BITS = 9;
+static const UINT LZW_MAX_BITS = 12;
+
+// Open-addressed (prefix, byte) -> code table for the encoder
+static const UINT LZW_HASH_SIZE = 9001;
+
+bool TiffCodec::LzwDecode(const BYTE* input, size_t inputSize, BYTE* output, size_t outputSize)
+{
+    // Old-style (LSB-first) LZW from pre-6.0 writers starts with 00 01
+    if (inputSize >= 2 && input[0] == 0 && (input[1] & 1))
+        return false;
+
+    std::vector<USHORT> prefix(LZW_MAX_CODES);
+    std::vector<BYTE> suffix(LZW_MAX_CODES);
+    std::vector<BYTE> first(LZW_MAX_CODES);
+    std::vector<USHORT> length(LZW_MAX_CODES);
+
+    for (UINT i = 0; i < 256; i++)
+    {
+        suffix[i] = (BYTE)i;
+        first[i] = (BYTE)i;
+        length[i] = 1;
+    }
+
+    size_t in = 0;
+    size_t out = 0;
+    UINT bitBuffer = 0;
+    UINT bitCount = 0;
+    UINT codeBits = LZW_MIN_BITS;
+    UINT nextCode = LZW_FIRST_CODE;
+    int previous = -1;
+
+    while (out < outputSize)
+    {
+        while (bitCount < codeBits && in < inputSize)
+        {
+            bitBuffer = (bitBuffer << 8) | input[in++];
+            bitCount += 8;
+        }
+        if (bitCount < codeBits)
+            break;
+
+        UINT code = (bitBuffer >> (bitCount - codeBits)) & ((1u << codeBits) - 1);
+        bitCount -= codeBits;
+
+        if (code == LZW_CLEAR)
+        {
+            codeBits = LZW_MIN_BITS;
+            nextCode = LZW_FIRST_CODE;
+            previous = -1;
+            continue;
+        }
+
+        if (code == LZW_EOI)
+            break;
+
+        UINT emit;
+        BYTE firstByte;
+        bool repeatFirst = false;
+
+        if (previous < 0)
+        {
+            if (code > 255)
+                return false;
+            emit = code;
+            firstByte = (BYTE)code;
+        }
+        else if (code < nextCode)
+        {
+            emit = code;
+            firstByte = first[code];
+        }
+        else if (code == nextCode && nextCode < LZW_MAX_CODES)
+        {
+            // KwKwK: the code being defined is the previous string plus its own first byte
+            emit = previous;
+            firstByte = first[previous];
+            repeatFirst = true;
+        }
+        else
+        {
+            return false;
+        }
+
+        // Strings are written back to front by walking the prefix chain
+        size_t stringLength = length[emit];
+        UINT walk = emit;
+        for (size_t i = stringLength; i > 0; i--)
+        {
+            if (out + i - 1 < outputSize)
+                output[out + i - 1] = suffix[walk];
+            walk = prefix[walk];
+        }
+        out = (out + stringLength < outputSize) ? out + stringLength : outputSize;
+
+        if (repeatFirst && out < outputSize)
+            output[out++] = firstByte;
+
+        if (previous >= 0 && nextCode < LZW_MAX_CODES)
+        {
+            prefix[nextCode] = (USHORT)previous;
+            suffix[nextCode] = firstByte;
+            first[nextCode] = first[previous];
+            length[nextCode] = (USHORT)(length[previous] + 1);
+            nextCode++;
+
+            if (nextCode >= (1u << codeBits) - 1 && codeBits < LZW_MAX_BITS)
+                codeBits++;
+        }
+
+        previous = code;
+    }
+
+    return out == outputSize;
+}
+
+static void PutCode(std::vector<BYTE>& output, UINT& bitBuffer, UINT& bitCount, UINT code, UINT codeBits)
+{
+    bitBuffer = (bitBuffer << codeBits) | code;
+    bitCount += codeBits;
+    while (bitCount >= 8)
+    {
+        output.push_back((BYTE)(bitBuffer >> (bitCount - 8)));
+        bitCount -= 8;
+    }
+}
+
+void TiffCodec::LzwEncode(const BYTE* input, size_t inputSize, std::vector<BYTE>& output)
+{
+    output.clear();
+
+    std::vector<int> keys(LZW_HASH_SIZE, -1);
+    std::vector<USHORT> codes(LZW_HASH_SIZE);
+
+    UINT bitBuffer = 0;
+    UINT bitCount = 0;
+    UINT codeBits = LZW_MIN_BITS;
+    UINT nextCode = LZW_FIRST_CODE;
+
+    PutCode(output, bitBuffer, bitCount, LZW_CLEAR, codeBits);
+
+    if (inputSize > 0)
+    {
+        UINT current = input[0];
+
+        for (size_t i = 1; i < inputSize; i++)
+        {
+            int key = (int)((current << 8) | input[i]);
+            UINT slot = (UINT)key % LZW_HASH_SIZE;
+            while (keys[slot] != -1 && keys[slot] != key)
+                slot = (slot + 1) % LZW_HASH_SIZE;
+
+            if (keys[slot] == key)
+            {
+                current = codes[slot];
+                continue;
+            }
+
+            PutCode(output, bitBuffer, bitCount, current, codeBits);
+
+            keys[slot] = key;
+            codes[slot] = (USHORT)nextCode;
+            nextCode++;
+
+            // Same widening and reset points as libtiff's encoder
+            if (nextCode == LZW_MAX_CODES - 2)
+            {
+                PutCode(output, bitBuffer, bitCount, LZW_CLEAR, codeBits);
+                std::fill(keys.begin(), keys.end(), -1);
+                codeBits = LZW_MIN_BITS;
+                nextCode = LZW_FIRST_CODE;
+            }
+            else if (nextCode > (1u << codeBits) - 1)
+            {
+                codeBits++;
+            }
+
+            current = input[i];
+        }
+
+        PutCode(output, bitBuffer, bitCount, current, codeBits);
+        nextCode++;
+        if (nextCode == LZW_MAX_CODES - 2)
+        {
+            PutCode(output, bitBuffer, bitCount, LZW_CLEAR, codeBits);
+            codeBits = LZW_MIN_BITS;
+        }
+        else if (nextCode > (1u << codeBits) - 1)
+        {
+            codeBits++;
+        }
+    }
+
+    PutCode(output, bitBuffer, bitCount, LZW_EOI, codeBits);
+    if (bitCount > 0)
+        output.push_back((BYTE)(bitBuffer << (8 - bitCount)));
+}
+
+bool TiffCodec::PackBitsDecode(const BYTE* input, size_t inputSize, BYTE* output, size_t outputSize)
+{
+    size_t in = 0;
+    size_t out = 0;
+
+    while (in < inputSize && out < outputSize)
+    {
+        int n = (signed char)input[in++];
+
+        if (n >= 0)
+        {
+            size_t count = (size_t)n + 1;
+            if (in + count > inputSize || out + count > outputSize)
+                return false;
+            memcpy(output + out, input + in, count);
+            in += count;
+            out += count;
+        }
+        else if (n != -128)
+        {
+            size_t count = (size_t)(1 - n);
+            if (in >= inputSize || out + count > outputSize)
+                return false;
+            memset(output + out, input[in++], count);
+            out += count;
+        }
+    }
+
+    return out == outputSize;
+}
+
+void TiffCodec::PackBitsEncode(const BYTE* input, size_t inputSize, size_t rowBytes, std::vector<BYTE>& output)
+{
+    output.clear();
+    if (rowBytes == 0)
+        return;
+
+    for (size_t rowStart = 0; rowStart < inputSize; rowStart += rowBytes)
+    {
+        size_t rowEnd = rowStart + rowBytes < inputSize ? rowStart + rowBytes : inputSize;
+        size_t i = rowStart;
+
+        while (i < rowEnd)
+        {
+            size_t run = 1;
+            while (i + run < rowEnd && run < 128 && input[i + run] == input[i])
+                run++;
+
+            if (run >= 2)
+            {
+                output.push_back((BYTE)(1 - (int)run));
+                output.push_back(input[i]);
+                i += run;
+                continue;
+            }
+
+            // Literal until the next run of three or the 128-byte limit
+            size_t literal = i;
+            while (literal < rowEnd && literal - i < 128)
+            {
+                if (literal + 2 < rowEnd && input[literal] == input[literal + 1] && input[literal] == input[literal + 2])
+                    break;
+                literal++;
+            }
+            if (literal == i)
+                literal = i + 1;
+
+            output.push_back((BYTE)(literal - i - 1));
+            output.insert(output.end(), input + i, input + literal);
+            i = literal;
+        }
+    }
+}
+
+static UINT LoadSample16(const BYTE* p, bool bigEndian)
+{
+    return bigEndian ? ((p[0] << 8) | p[1]) : (p[0] | (p[1] << 8));
+}
+
+static void StoreSample16(BYTE* p, UINT value, bool bigEndian)
+{
+    p[bigEndian ? 0 : 1] = (BYTE)(value >> 8);
+    p[bigEndian ? 1 : 0] = (BYTE)value;
+}
+
+void TiffCodec::UndoHorizontalPredictor(BYTE* data, UINT rows, UINT rowPixels, UINT samples,
+                                        UINT bytesPerSample, bool bigEndian)
+{
+    size_t rowBytes = (size_t)rowPixels * samples * bytesPerSample;
+
+    for (UINT y = 0; y < rows; y++)
+    {
+        BYTE* row = data + y * rowBytes;
+
+        if (bytesPerSample == 1)
+        {
+            for (size_t i = samples; i < rowBytes; i++)
+                row[i] = (BYTE)(row[i] + row[i - samples]);
+        }
+        else
+        {
+            size_t step = (size_t)samples * 2;
+            for (size_t i = step; i < rowBytes; i += 2)
+                StoreSample16(row + i, LoadSample16(row + i, bigEndian) + LoadSample16(row + i - step, bigEndian), bigEndian);
+        }
+    }
+}
+
+void TiffCodec::ApplyHorizontalPredictor(BYTE* data, UINT rows, UINT rowPixels, UINT samples,
+                                         UINT bytesPerSample, bool bigEndian)
+{
+    size_t rowBytes = (size_t)rowPixels * samples * bytesPerSample;
+
+    // Right to left so every difference uses the original left neighbour
+    for (UINT y = 0; y < rows; y++)
+    {
+        BYTE* row = data + y * rowBytes;
+
+        if (bytesPerSample == 1)
+        {
+            for (size_t i = rowBytes; i-- > samples; )
+                row[i] = (BYTE)(row[i] - row[i - samples]);
+        }
+        else
+        {
+            size_t step = (size_t)samples * 2;
+            for (size_t i = rowBytes; i >= step + 2; i -= 2)
+                StoreSample16(row + i - 2, LoadSample16(row + i - 2, bigEndian) - LoadSample16(row + i - 2 - step, bigEndian), bigEndian);
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include "stdafx.h"
+#include <vector>
+
+// The TIFF compression schemes the tile patcher can rewrite: LZW (with the
+// TIFF "early change" code widths), PackBits, and the horizontal
+// differencing predictor used with them. Output is bit-compatible with
+// libtiff, so patched tiles decode in any reader.
+class TiffCodec
+{
+public:
+    // Both decoders succeed only if exactly outputSize bytes are produced
+    static bool LzwDecode(const BYTE* input, size_t inputSize, BYTE* output, size_t outputSize);
+    static void LzwEncode(const BYTE* input, size_t inputSize, std::vector<BYTE>& output);
+
+    static bool PackBitsDecode(const BYTE* input, size_t inputSize, BYTE* output, size_t outputSize);
+
+    // PackBits runs never cross rows
+    static void PackBitsEncode(const BYTE* input, size_t inputSize, size_t rowBytes, std::vector<BYTE>& output);
+
+    // Predictor 2 over rows of rowPixels pixels; 16-bit samples are in file byte order
+    static void UndoHorizontalPredictor(BYTE* data, UINT rows, UINT rowPixels, UINT samples,
+                                        UINT bytesPerSample, bool bigEndian);
+    static void ApplyHorizontalPredictor(BYTE* data, UINT rows, UINT rowPixels, UINT samples,
+                                         UINT bytesPerSample, bool bigEndian);
+};
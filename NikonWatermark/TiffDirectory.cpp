@@ -0,0 +1,201 @@
+#include "stdafx.h"
+#include "TiffDirectory.h"
+
+TiffDirectory::TiffDirectory() : m_hFile(INVALID_HANDLE_VALUE), m_bigEndian(false), m_fileSize(0)
+{
+}
+
+bool TiffDirectory::ReadAt(HANDLE hFile, ULONGLONG position, void* buffer, DWORD size)
+{
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.Offset = (DWORD)position;
+    overlapped.OffsetHigh = (DWORD)(position >> 32);
+
+    DWORD read = 0;
+    return ReadFile(hFile, buffer, size, &read, &overlapped) && read == size;
+}
+
+bool TiffDirectory::WriteAt(HANDLE hFile, ULONGLONG position, const void* buffer, DWORD size)
+{
+    OVERLAPPED overlapped;
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.Offset = (DWORD)position;
+    overlapped.OffsetHigh = (DWORD)(position >> 32);
+
+    DWORD written = 0;
+    return WriteFile(hFile, buffer, size, &written, &overlapped) && written == size;
+}
+
+UINT TiffDirectory::GetTypeSize(USHORT type)
+{
+    switch (type)
+    {
+    case 1: case 2: case 6: case 7:
+        return 1;   // BYTE, ASCII, SBYTE, UNDEFINED
+    case 3: case 8:
+        return 2;   // SHORT, SSHORT
+    case 4: case 9: case 11: case 13:
+        return 4;   // LONG, SLONG, FLOAT, IFD
+    case 5: case 10: case 12:
+        return 8;   // RATIONAL, SRATIONAL, DOUBLE
+    default:
+        return 0;
+    }
+}
+
+UINT TiffDirectory::Read16(const BYTE* p) const
+{
+    return m_bigEndian ? ((p[0] << 8) | p[1]) : (p[0] | (p[1] << 8));
+}
+
+UINT TiffDirectory::Read32(const BYTE* p) const
+{
+    return m_bigEndian ? (((UINT)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3])
+                       : (p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT)p[3] << 24));
+}
+
+bool TiffDirectory::Read(HANDLE hFile)
+{
+    m_hFile = hFile;
+    m_entries.clear();
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(hFile, &fileSize))
+        return false;
+    m_fileSize = (ULONGLONG)fileSize.QuadPart;
+
+    BYTE header[8];
+    if (!ReadAt(hFile, 0, header, sizeof(header)))
+        return false;
+
+    if (header[0] == 'I' && header[1] == 'I')
+        m_bigEndian = false;
+    else if (header[0] == 'M' && header[1] == 'M')
+        m_bigEndian = true;
+    else
+        return false;
+
+    // 43 would be BigTIFF, which has 64-bit offsets throughout
+    if (Read16(header + 2) != 42)
+        return false;
+
+    UINT directoryOffset = Read32(header + 4);
+    BYTE countBytes[2];
+    if (directoryOffset < sizeof(header) || !ReadAt(hFile, directoryOffset, countBytes, sizeof(countBytes)))
+        return false;
+
+    UINT count = Read16(countBytes);
+    if (count == 0 || count > MAX_ENTRIES)
+        return false;
+
+    std::vector<BYTE> entries(count * 12);
+    if (!ReadAt(hFile, directoryOffset + 2ull, &entries[0], (DWORD)entries.size()))
+        return false;
+
+    m_entries.reserve(count);
+    for (UINT i = 0; i < count; i++)
+    {
+        const BYTE* p = &entries[i * 12];
+
+        TiffEntry entry;
+        entry.tag = (USHORT)Read16(p);
+        entry.type = (USHORT)Read16(p + 2);
+        entry.count = Read32(p + 4);
+
+        // Unknown types and values that would lie outside the file are
+        // dropped rather than trusted
+        ULONGLONG size = (ULONGLONG)GetTypeSize(entry.type) * entry.count;
+        if (size == 0)
+            continue;
+
+        ULONGLONG position = (size <= 4) ? directoryOffset + 2ull + i * 12 + 8 : Read32(p + 8);
+        if (position + size > m_fileSize)
+            continue;
+
+        entry.valuePosition = (UINT)position;
+        m_entries.push_back(entry);
+    }
+
+    return true;
+}
+
+const TiffEntry* TiffDirectory::Find(USHORT tag) const
+{
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        if (m_entries[i].tag == tag)
+            return &m_entries[i];
+    }
+    return NULL;
+}
+
+UINT TiffDirectory::GetValue(USHORT tag, UINT defaultValue) const
+{
+    const TiffEntry* entry = Find(tag);
+    if (entry == NULL)
+        return defaultValue;
+
+    BYTE value[4];
+    UINT size = GetTypeSize(entry->type);
+    if (!ReadAt(m_hFile, entry->valuePosition, value, size < 4 ? size : 4))
+        return defaultValue;
+
+    switch (entry->type)
+    {
+    case TIFF_BYTE: return value[0];
+    case TIFF_SHORT: return Read16(value);
+    case TIFF_LONG: return Read32(value);
+    default: return defaultValue;
+    }
+}
+
+bool TiffDirectory::GetValues(USHORT tag, std::vector<UINT>& values) const
+{
+    values.clear();
+
+    const TiffEntry* entry = Find(tag);
+    if (entry == NULL || entry->count > MAX_VALUES)
+        return false;
+
+    UINT size = GetTypeSize(entry->type);
+    if (entry->type != TIFF_BYTE && entry->type != TIFF_SHORT && entry->type != TIFF_LONG)
+        return false;
+
+    std::vector<BYTE> raw((size_t)size * entry->count);
+    if (!ReadAt(m_hFile, entry->valuePosition, &raw[0], (DWORD)raw.size()))
+        return false;
+
+    values.resize(entry->count);
+    for (UINT i = 0; i < entry->count; i++)
+    {
+        const BYTE* p = &raw[(size_t)i * size];
+        values[i] = (size == 1) ? p[0] : (size == 2) ? Read16(p) : Read32(p);
+    }
+    return true;
+}
+
+bool TiffDirectory::SetValue(HANDLE hFile, const TiffEntry& entry, UINT index, UINT value) const
+{
+    if (index >= entry.count)
+        return false;
+
+    BYTE bytes[4];
+    if (entry.type == TIFF_SHORT)
+    {
+        if (value > 0xFFFF)
+            return false;
+        bytes[0] = (BYTE)(m_bigEndian ? value >> 8 : value);
+        bytes[1] = (BYTE)(m_bigEndian ? value : value >> 8);
+        return WriteAt(hFile, entry.valuePosition + index * 2ull, bytes, 2);
+    }
+
+    if (entry.type == TIFF_LONG)
+    {
+        for (int i = 0; i < 4; i++)
+            bytes[i] = (BYTE)(value >> (m_bigEndian ? 24 - i * 8 : i * 8));
+        return WriteAt(hFile, entry.valuePosition + index * 4ull, bytes, 4);
+    }
+
+    return false;
+}
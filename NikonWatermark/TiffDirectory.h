@@ -0,0 +1,80 @@
+#pragma once
+#include "stdafx.h"
+#include <vector>
+
+// Baseline TIFF tags used by the probe and the tile patcher
+enum TiffTag : USHORT
+{
+    TIFFTAG_IMAGEWIDTH = 256,
+    TIFFTAG_IMAGELENGTH = 257,
+    TIFFTAG_BITSPERSAMPLE = 258,
+    TIFFTAG_COMPRESSION = 259,
+    TIFFTAG_PHOTOMETRIC = 262,
+    TIFFTAG_STRIPOFFSETS = 273,
+    TIFFTAG_SAMPLESPERPIXEL = 277,
+    TIFFTAG_ROWSPERSTRIP = 278,
+    TIFFTAG_STRIPBYTECOUNTS = 279,
+    TIFFTAG_PLANARCONFIG = 284,
+    TIFFTAG_PREDICTOR = 317,
+    TIFFTAG_TILEWIDTH = 322,
+    TIFFTAG_TILELENGTH = 323,
+    TIFFTAG_TILEOFFSETS = 324,
+    TIFFTAG_TILEBYTECOUNTS = 325,
+    TIFFTAG_EXTRASAMPLES = 338,
+    TIFFTAG_SAMPLEFORMAT = 339
+};
+
+struct TiffEntry
+{
+    USHORT tag;
+    USHORT type;
+    UINT count;
+    UINT valuePosition;   // File offset of the first value (inline or not)
+};
+
+// First image directory of a classic (32-bit offset) TIFF, read straight
+// from the file. Only the directory itself is loaded; value arrays such as
+// tile offsets are read on request, bounded by the file size.
+class TiffDirectory
+{
+public:
+    TiffDirectory();
+
+    bool Read(HANDLE hFile);
+
+    bool IsBigEndian() const { return m_bigEndian; }
+    const TiffEntry* Find(USHORT tag) const;
+
+    // First value of a BYTE, SHORT or LONG field
+    UINT GetValue(USHORT tag, UINT defaultValue) const;
+    bool GetValues(USHORT tag, std::vector<UINT>& values) const;
+
+    // Overwrites one element of a SHORT or LONG field in place
+    bool SetValue(HANDLE hFile, const TiffEntry& entry, UINT index, UINT value) const;
+
+    UINT Read16(const BYTE* p) const;
+    UINT Read32(const BYTE* p) const;
+
+    static UINT GetTypeSize(USHORT type);
+
+    // Positioned I/O on synchronous handles
+    static bool ReadAt(HANDLE hFile, ULONGLONG position, void* buffer, DWORD size);
+    static bool WriteAt(HANDLE hFile, ULONGLONG position, const void* buffer, DWORD size);
+
+    static const UINT MAX_ENTRIES = 1024;
+    static const UINT MAX_VALUES = 1 << 24;
+
+private:
+    HANDLE m_hFile;
+    bool m_bigEndian;
+    ULONGLONG m_fileSize;
+    std::vector<TiffEntry> m_entries;
+};
+
+// TIFF field types
+const USHORT TIFF_BYTE = 1;
+const USHORT TIFF_ASCII = 2;
+const USHORT TIFF_SHORT = 3;
+const USHORT TIFF_LONG = 4;
+const USHORT TIFF_RATIONAL = 5;
+const USHORT TIFF_IFD = 13;
@@ -0,0 +1,854 @@
+#include "stdafx.h"
+#include "TiledImageProcessor.h"
+#include "TiffCodec.h"
+#include "TiffDirectory.h"
+#include <algorithm>
+
+static const UINT TIFF_COMPRESSION_NONE = 1;
+static const UINT TIFF_COMPRESSION_LZW = 5;
+static const UINT TIFF_COMPRESSION_PACKBITS = 32773;
+
+// Floor for the patchable block size, so normal tiles of narrow images
+// are still patched
+static const UINT64 MIN_PATCH_BLOCK_BYTES = 4 * 1024 * 1024;
+
+// Everything the patcher needs to know about the first TIFF directory
+struct TiffLayout
+{
+    UINT width = 0;
+    UINT height = 0;
+    UINT compression = TIFF_COMPRESSION_NONE;
+    UINT predictor = 1;
+    bool tiled = false;
+    UINT blockWidth = 0;      // Tile width, or the image width for strips
+    UINT blockHeight = 0;     // Tile length, or rows per strip
+    UINT blocksAcross = 0;
+    UINT blocksDown = 0;
+    const TiffEntry* offsets = NULL;
+    const TiffEntry* byteCounts = NULL;
+    SampleLayout samples;
+};
+
+static bool ReadTiffLayout(const TiffDirectory& directory, TiffLayout& layout)
+{
+    layout.width = directory.GetValue(TIFFTAG_IMAGEWIDTH, 0);
+    layout.height = directory.GetValue(TIFFTAG_IMAGELENGTH, 0);
+    if (layout.width == 0 || layout.height == 0)
+        return false;
+
+    layout.compression = directory.GetValue(TIFFTAG_COMPRESSION, TIFF_COMPRESSION_NONE);
+    if (layout.compression != TIFF_COMPRESSION_NONE && layout.compression != TIFF_COMPRESSION_LZW &&
+        layout.compression != TIFF_COMPRESSION_PACKBITS)
+        return false;
+
+    layout.predictor = directory.GetValue(TIFFTAG_PREDICTOR, 1);
+    if (layout.predictor != 1 && layout.predictor != 2)
+        return false;
+
+    // Unsigned integer samples only
+    if (directory.GetValue(TIFFTAG_SAMPLEFORMAT, 1) != 1)
+        return false;
+
+    // BlackIsZero grey or RGB
+    UINT photometric = directory.GetValue(TIFFTAG_PHOTOMETRIC, 0);
+    UINT colourSamples = (photometric == 2) ? 3 : (photometric == 1) ? 1 : 0;
+    UINT samplesPerPixel = directory.GetValue(TIFFTAG_SAMPLESPERPIXEL, 1);
+    if (colourSamples == 0 || samplesPerPixel < colourSamples || samplesPerPixel > 8)
+        return false;
+
+    if (samplesPerPixel > 1 && directory.GetValue(TIFFTAG_PLANARCONFIG, 1) != 1)
+        return false;
+
+    std::vector<UINT> bits;
+    if (!directory.GetValues(TIFFTAG_BITSPERSAMPLE, bits) || bits.empty())
+        return false;
+    for (size_t i = 0; i < bits.size(); i++)
+    {
+        if (bits[i] != bits[0])
+            return false;
+    }
+    if (bits[0] != 8 && bits[0] != 16)
+        return false;
+
+    SampleLayout& samples = layout.samples;
+    samples.samples = samplesPerPixel;
+    samples.bytesPerSample = bits[0] / 8;
+    samples.bigEndian = directory.IsBigEndian();
+    samples.gray = (colourSamples == 1);
+    samples.bgr = false;
+    samples.alphaIndex = -1;
+    samples.premultiplied = false;
+
+    // ExtraSamples 1 is associated (premultiplied) alpha, 2 unassociated;
+    // anything else is carried through untouched
+    if (samplesPerPixel > colourSamples)
+    {
+        UINT extra = directory.GetValue(TIFFTAG_EXTRASAMPLES, 0);
+        if (extra == 1 || extra == 2)
+        {
+            samples.alphaIndex = (int)colourSamples;
+            samples.premultiplied = (extra == 1);
+        }
+    }
+
+    layout.tiled = (directory.Find(TIFFTAG_TILEWIDTH) != NULL);
+    if (layout.tiled)
+    {
+        layout.blockWidth = directory.GetValue(TIFFTAG_TILEWIDTH, 0);
+        layout.blockHeight = directory.GetValue(TIFFTAG_TILELENGTH, 0);
+        layout.offsets = directory.Find(TIFFTAG_TILEOFFSETS);
+        layout.byteCounts = directory.Find(TIFFTAG_TILEBYTECOUNTS);
+    }
+    else
+    {
+        layout.blockWidth = layout.width;
+        layout.blockHeight = min(directory.GetValue(TIFFTAG_ROWSPERSTRIP, layout.height), layout.height);
+        layout.offsets = directory.Find(TIFFTAG_STRIPOFFSETS);
+        layout.byteCounts = directory.Find(TIFFTAG_STRIPBYTECOUNTS);
+    }
+
+    if (layout.blockWidth == 0 || layout.blockHeight == 0 || layout.offsets == NULL || layout.byteCounts == NULL)
+        return false;
+
+    // A block much bigger than a band would bring back the whole-frame
+    // buffers this path exists to avoid
+    UINT pixelBytes = samplesPerPixel * samples.bytesPerSample;
+    UINT64 blockBytes = (UINT64)layout.blockWidth * layout.blockHeight * pixelBytes;
+    if (blockBytes > TiledImageProcessor::GetMaxPatchBlockBytes(layout.width, pixelBytes))
+        return false;
+
+    layout.blocksAcross = (UINT)(((UINT64)layout.width + layout.blockWidth - 1) / layout.blockWidth);
+    layout.blocksDown = (UINT)(((UINT64)layout.height + layout.blockHeight - 1) / layout.blockHeight);
+    UINT64 blockCount = (UINT64)layout.blocksAcross * layout.blocksDown;
+    if (layout.offsets->count < blockCount || layout.byteCounts->count < blockCount)
+        return false;
+
+    // Rewritten blocks may move to the end of the file, so their offsets
+    // and sizes must be patchable with any 32-bit value
+    if (layout.offsets->type != TIFF_LONG || layout.byteCounts->type != TIFF_LONG)
+        return false;
+
+    return true;
+}
+
+// Rounds the append position up to a word boundary, as TIFF asks for
+static ULONGLONG AlignWord(ULONGLONG position)
+{
+    return (position + 1) & ~1ull;
+}
+
+TiledImageProcessor::TiledImageProcessor()
+{
+}
+
+TiledImageProcessor::~TiledImageProcessor()
+{
+}
+
+bool TiledImageProcessor::Handles(const ImageHeaderInfo& info)
+{
+    return info.format == ImageFormat::Tiff || info.format == ImageFormat::Png;
+}
+
+UINT64 TiledImageProcessor::GetMaxPatchBlockBytes(UINT width, UINT pixelBytes)
+{
+    UINT64 bandBytes = (UINT64)width * pixelBytes * STREAM_BAND_ROWS;
+    return max(bandBytes * PATCH_BLOCK_BANDS, MIN_PATCH_BLOCK_BYTES);
+}
+
+UINT64 TiledImageProcessor::EstimateWorkingSet(const ImageHeaderInfo& info)
+{
+    // Streaming holds the converted band (up to 64bpp) and the encoder's
+    // copy of it (a packed band and its 32bpp working copies fit in the
+    // same); WIC's TIFF decoder also holds one decoded strip or tile
+    UINT64 bandBytes = (UINT64)info.width * 8 * STREAM_BAND_ROWS;
+    UINT64 streamBytes = bandBytes * 2 + info.blockBytes;
+
+    // Patching holds the decoded block, the compressed input (at most 2x)
+    // and the re-encoded output (at most 1.5x)
+    UINT pixelBytes = info.components * ((info.bitsPerComponent + 7) / 8);
+    UINT64 patchBytes = 0;
+    if (info.format == ImageFormat::Tiff && info.blockBytes <= GetMaxPatchBlockBytes(info.width, pixelBytes))
+        patchBytes = info.blockBytes * 9 / 2;
+
+    return max(streamBytes, patchBytes);
+}
+
+UINT64 TiledImageProcessor::GetRetainedBytes() const
+{
+    return m_compressed.capacity() + m_block.capacity() + m_encoded.capacity() + m_packed.capacity();
+}
+
+void TiledImageProcessor::ReleaseBuffers()
+{
+    std::vector<BYTE>().swap(m_compressed);
+    std::vector<BYTE>().swap(m_block);
+    std::vector<BYTE>().swap(m_encoded);
+    std::vector<BYTE>().swap(m_packed);
+}
+
+void TiledImageProcessor::TrimBuffers()
+{
+    if (m_compressed.capacity() > RETAINED_BUFFER_BYTES)
+        std::vector<BYTE>().swap(m_compressed);
+    if (m_block.capacity() > RETAINED_BUFFER_BYTES)
+        std::vector<BYTE>().swap(m_block);
+    if (m_encoded.capacity() > RETAINED_BUFFER_BYTES)
+        std::vector<BYTE>().swap(m_encoded);
+    if (m_packed.capacity() > RETAINED_BUFFER_BYTES)
+        std::vector<BYTE>().swap(m_packed);
+}
+
+bool TiledImageProcessor::Process(const std::wstring& inputPath, const std::wstring& outputPath,
+                                  const ImageHeaderInfo& info, const WatermarkOverlay* overlay, int x, int y)
+{
+    PatchResult result = PatchResult::Unsupported;
+    if (info.format == ImageFormat::Tiff)
+        result = PatchTiff(inputPath, outputPath, overlay, x, y);
+
+    bool success = (result == PatchResult::Unsupported) ? StreamWithWic(inputPath, outputPath, overlay, x, y)
+                                                         : (result == PatchResult::Patched);
+    TrimBuffers();
+    return success;
+}
+
+TiledImageProcessor::PatchResult TiledImageProcessor::PatchTiff(const std::wstring& inputPath,
+                                                                const std::wstring& outputPath,
+                                                                const WatermarkOverlay* overlay, int x, int y)
+{
+    // Check the layout on the input first so unsupported files are not copied
+    HANDLE hInput = CreateFileW(inputPath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hInput == INVALID_HANDLE_VALUE)
+        return PatchResult::Failed;
+
+    TiffDirectory inputDirectory;
+    TiffLayout inputLayout;
+    bool supported = inputDirectory.Read(hInput) && ReadTiffLayout(inputDirectory, inputLayout);
+    CloseHandle(hInput);
+    if (!supported)
+        return PatchResult::Unsupported;
+
+    // Untouched tiles and all metadata come across byte for byte
+    if (!CopyFileW(inputPath.c_str(), outputPath.c_str(), FALSE))
+        return PatchResult::Failed;
+
+    HANDLE hOutput = CreateFileW(outputPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hOutput == INVALID_HANDLE_VALUE)
+    {
+        DeleteFileW(outputPath.c_str());
+        return PatchResult::Failed;
+    }
+
+    TiffDirectory directory;
+    TiffLayout layout;
+    std::vector<UINT> offsets;
+    std::vector<UINT> byteCounts;
+    LARGE_INTEGER fileSize;
+    bool success = directory.Read(hOutput) && ReadTiffLayout(directory, layout) &&
+                   directory.GetValues(layout.offsets->tag, offsets) &&
+                   directory.GetValues(layout.byteCounts->tag, byteCounts) &&
+                   GetFileSizeEx(hOutput, &fileSize);
+
+    if (success && overlay != NULL)
+    {
+        // Overlay rectangle clipped to the image
+        LONGLONG left = max(x, 0);
+        LONGLONG top = max(y, 0);
+        LONGLONG right = min((LONGLONG)x + overlay->width, (LONGLONG)layout.width);
+        LONGLONG bottom = min((LONGLONG)y + overlay->height, (LONGLONG)layout.height);
+
+        // Writers may point several identical tiles at one copy; those
+        // must not be rewritten in place
+        std::vector<UINT> sortedOffsets(offsets);
+        std::sort(sortedOffsets.begin(), sortedOffsets.end());
+
+        ULONGLONG append = AlignWord((ULONGLONG)fileSize.QuadPart);
+        const SampleLayout& samples = layout.samples;
+        size_t rowBytes = (size_t)layout.blockWidth * samples.samples * samples.bytesPerSample;
+
+        for (LONGLONG blockY = top / layout.blockHeight;
+             success && right > left && blockY <= (bottom - 1) / layout.blockHeight; blockY++)
+        {
+            for (LONGLONG blockX = left / layout.blockWidth;
+                 success && blockX <= (right - 1) / layout.blockWidth; blockX++)
+            {
+                UINT index = (UINT)(blockY * layout.blocksAcross + blockX);
+                UINT firstRow = (UINT)(blockY * layout.blockHeight);
+
+                // The last strip stops at the image; tiles are always full size
+                UINT rows = layout.tiled ? layout.blockHeight : min(layout.blockHeight, layout.height - firstRow);
+                size_t rawSize = rowBytes * rows;
+                m_block.resize(rawSize);
+
+                if (layout.compression == TIFF_COMPRESSION_NONE)
+                {
+                    success = byteCounts[index] >= rawSize &&
+                              TiffDirectory::ReadAt(hOutput, offsets[index], &m_block[0], (DWORD)rawSize);
+                }
+                else
+                {
+                    // LZW expands by at most 1.5x, PackBits by under 1%
+                    UINT count = byteCounts[index];
+                    success = count > 0 && count <= rawSize * 2 + 4096;
+                    if (success)
+                    {
+                        m_compressed.resize(count);
+                        success = TiffDirectory::ReadAt(hOutput, offsets[index], &m_compressed[0], count);
+                    }
+                    if (success && layout.compression == TIFF_COMPRESSION_LZW)
+                        success = TiffCodec::LzwDecode(&m_compressed[0], count, &m_block[0], rawSize);
+                    else if (success)
+                        success = TiffCodec::PackBitsDecode(&m_compressed[0], count, &m_block[0], rawSize);
+                }
+                if (!success)
+                    break;
+
+                if (layout.predictor == 2)
+                {
+                    TiffCodec::UndoHorizontalPredictor(&m_block[0], rows, layout.blockWidth, samples.samples,
+                                                       samples.bytesPerSample, samples.bigEndian);
+                }
+
+                CompositeBlock(&m_block[0], rowBytes, (UINT)(blockX * layout.blockWidth), firstRow,
+                               layout.blockWidth, rows, layout.width, layout.height, *overlay, x, y, samples);
+
+                if (layout.predictor == 2)
+                {
+                    TiffCodec::ApplyHorizontalPredictor(&m_block[0], rows, layout.blockWidth, samples.samples,
+                                                        samples.bytesPerSample, samples.bigEndian);
+                }
+
+                const BYTE* data = &m_block[0];
+                size_t dataSize = rawSize;
+                if (layout.compression == TIFF_COMPRESSION_LZW)
+                    TiffCodec::LzwEncode(&m_block[0], rawSize, m_encoded);
+                else if (layout.compression == TIFF_COMPRESSION_PACKBITS)
+                    TiffCodec::PackBitsEncode(&m_block[0], rawSize, rowBytes, m_encoded);
+
+                if (layout.compression != TIFF_COMPRESSION_NONE)
+                {
+                    data = &m_encoded[0];
+                    dataSize = m_encoded.size();
+                }
+
+                bool shared = std::upper_bound(sortedOffsets.begin(), sortedOffsets.end(), offsets[index]) -
+                              std::lower_bound(sortedOffsets.begin(), sortedOffsets.end(), offsets[index]) > 1;
+
+                if (layout.compression == TIFF_COMPRESSION_NONE && !shared)
+                {
+                    // Same size, so the tile is overwritten where it is
+                    success = TiffDirectory::WriteAt(hOutput, offsets[index], data, (DWORD)dataSize);
+                }
+                else
+                {
+                    // Re-encoded data rarely fits the old slot; append it and
+                    // leave the old bytes as unreferenced padding
+                    success = append + dataSize <= 0xFFFFFFFFull &&
+                              TiffDirectory::WriteAt(hOutput, append, data, (DWORD)dataSize) &&
+                              directory.SetValue(hOutput, *layout.offsets, index, (UINT)append) &&
+                              directory.SetValue(hOutput, *layout.byteCounts, index, (UINT)dataSize);
+                    append = AlignWord(append + dataSize);
+                }
+            }
+        }
+    }
+
+    CloseHandle(hOutput);
+
+    if (!success)
+    {
+        DeleteFileW(outputPath.c_str());
+        return PatchResult::Failed;
+    }
+    return PatchResult::Patched;
+}
+
+// Pixel formats the compositor works on directly
+struct WicFormat
+{
+    const GUID* format;
+    UINT bitsPerPixel;
+    UINT samples;
+    UINT bytesPerSample;
+    bool bgr;
+    bool gray;
+    int alphaIndex;
+    bool premultiplied;
+};
+
+static const WicFormat WIC_FORMATS[] =
+{
+    { &GUID_WICPixelFormat24bppBGR, 24, 3, 1, true, false, -1, false },
+    { &GUID_WICPixelFormat32bppBGR, 32, 4, 1, true, false, -1, false },
+    { &GUID_WICPixelFormat32bppBGRA, 32, 4, 1, true, false, 3, false },
+    { &GUID_WICPixelFormat32bppPBGRA, 32, 4, 1, true, false, 3, true },
+    { &GUID_WICPixelFormat48bppRGB, 48, 3, 2, false, false, -1, false },
+    { &GUID_WICPixelFormat64bppRGBA, 64, 4, 2, false, false, 3, false },
+    { &GUID_WICPixelFormat64bppPRGBA, 64, 4, 2, false, false, 3, true },
+    { &GUID_WICPixelFormat8bppGray, 8, 1, 1, false, true, -1, false },
+    { &GUID_WICPixelFormat16bppGray, 16, 1, 2, false, true, -1, false }
+};
+
+static const WicFormat* FindWicFormat(const WICPixelFormatGUID& format)
+{
+    for (size_t i = 0; i < _countof(WIC_FORMATS); i++)
+    {
+        if (*WIC_FORMATS[i].format == format)
+            return &WIC_FORMATS[i];
+    }
+    return NULL;
+}
+
+// Closest format from WIC_FORMATS that keeps the source bit depth,
+// channel count and transparency
+static const WicFormat* SelectWicFormat(IWICImagingFactory* factory, const WICPixelFormatGUID& native)
+{
+    const WicFormat* format = FindWicFormat(native);
+    if (format != NULL)
+        return format;
+
+    ATL::CComPtr<IWICComponentInfo> componentInfo;
+    ATL::CComPtr<IWICPixelFormatInfo2> formatInfo;
+    if (FAILED(factory->CreateComponentInfo(native, &componentInfo)) ||
+        FAILED(componentInfo.QueryInterface(&formatInfo)))
+        return FindWicFormat(GUID_WICPixelFormat32bppBGRA);
+
+    UINT bitsPerPixel = 0;
+    UINT channels = 0;
+    BOOL transparency = FALSE;
+    WICPixelFormatNumericRepresentation representation = WICPixelFormatNumericRepresentationUnspecified;
+    formatInfo->GetBitsPerPixel(&bitsPerPixel);
+    formatInfo->GetChannelCount(&channels);
+    formatInfo->SupportsTransparency(&transparency);
+    formatInfo->GetNumericRepresentation(&representation);
+
+    bool deep = channels > 0 && bitsPerPixel / channels > 8;
+
+    if (channels == 1 && representation != WICPixelFormatNumericRepresentationIndexed)
+        return FindWicFormat(deep ? GUID_WICPixelFormat16bppGray : GUID_WICPixelFormat8bppGray);
+    if (transparency)
+        return FindWicFormat(deep ? GUID_WICPixelFormat64bppRGBA : GUID_WICPixelFormat32bppBGRA);
+    return FindWicFormat(deep ? GUID_WICPixelFormat48bppRGB : GUID_WICPixelFormat24bppBGR);
+}
+
+// Formats written back as they are although the compositor cannot work on
+// them: bands under the watermark are blended in a byte format from
+// WIC_FORMATS and converted back, other bands are copied unchanged
+struct PackedFormat
+{
+    const GUID* format;
+    UINT bitsPerPixel;
+    bool indexed;
+};
+
+static const PackedFormat PACKED_FORMATS[] =
+{
+    { &GUID_WICPixelFormatBlackWhite, 1, false },
+    { &GUID_WICPixelFormat2bppGray, 2, false },
+    { &GUID_WICPixelFormat4bppGray, 4, false },
+    { &GUID_WICPixelFormat1bppIndexed, 1, true },
+    { &GUID_WICPixelFormat2bppIndexed, 2, true },
+    { &GUID_WICPixelFormat4bppIndexed, 4, true },
+    { &GUID_WICPixelFormat8bppIndexed, 8, true }
+};
+
+static const PackedFormat* FindPackedFormat(const WICPixelFormatGUID& format)
+{
+    for (size_t i = 0; i < _countof(PACKED_FORMATS); i++)
+    {
+        if (*PACKED_FORMATS[i].format == format)
+            return &PACKED_FORMATS[i];
+    }
+    return NULL;
+}
+
+// Asks the TIFF encoder for the page's own compression. It has no JPEG or
+// predictor option, so JPEG pages are left to the encoder and LZW with
+// predictor 2 is written as plain LZW.
+static void CopyTiffCompression(IWICBitmapFrameDecode* frame, bool bilevel, IPropertyBag2* properties)
+{
+    ATL::CComPtr<IWICMetadataQueryReader> query;
+    if (FAILED(frame->GetMetadataQueryReader(&query)))
+        return;
+
+    PROPVARIANT compression;
+    PropVariantInit(&compression);
+    if (FAILED(query->GetMetadataByName(L"/ifd/{ushort=259}", &compression)) || compression.vt != VT_UI2)
+    {
+        PropVariantClear(&compression);
+        return;
+    }
+
+    BYTE method;
+    switch (compression.uiVal)
+    {
+    case TIFF_COMPRESSION_NONE:
+        method = WICTiffCompressionNone;
+        break;
+    case TIFF_COMPRESSION_LZW:
+        method = WICTiffCompressionLZW;
+        break;
+    case TIFF_COMPRESSION_PACKBITS:
+        method = WICTiffCompressionRLE;
+        break;
+    case 2:     // CCITT modified Huffman
+    case 3:     // CCITT T.4
+        method = bilevel ? WICTiffCompressionCCITT3 : WICTiffCompressionDontCare;
+        break;
+    case 4:     // CCITT T.6
+        method = bilevel ? WICTiffCompressionCCITT4 : WICTiffCompressionDontCare;
+        break;
+    case 8:     // Deflate
+    case 32946: // Deflate, old code
+        method = WICTiffCompressionZIP;
+        break;
+    default:
+        method = WICTiffCompressionDontCare;
+        break;
+    }
+    PropVariantClear(&compression);
+
+    PROPBAG2 option = {};
+    option.pstrName = const_cast<LPOLESTR>(L"TiffCompressionMethod");
+    VARIANT value;
+    VariantInit(&value);
+    value.vt = VT_UI1;
+    value.bVal = method;
+    properties->Write(1, &option, &value);
+}
+
+bool TiledImageProcessor::StreamWithWic(const std::wstring& inputPath, const std::wstring& outputPath,
+                                        const WatermarkOverlay* overlay, int x, int y)
+{
+    // Batch workers are plain threads; join the MTA for the duration of
+    // the file. A thread that already is an STA keeps its apartment.
+    HRESULT hrCom = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hrCom) && hrCom != RPC_E_CHANGED_MODE)
+        return false;
+
+    bool success = StreamFrames(inputPath, outputPath, overlay, x, y);
+
+    if (SUCCEEDED(hrCom))
+        CoUninitialize();
+
+    // The encoder stream is closed by now
+    if (!success)
+        DeleteFileW(outputPath.c_str());
+    return success;
+}
+
+bool TiledImageProcessor::StreamFrames(const std::wstring& inputPath, const std::wstring& outputPath,
+                                       const WatermarkOverlay* overlay, int x, int y)
+{
+    ATL::CComPtr<IWICImagingFactory> factory;
+    if (FAILED(factory.CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER)))
+        return false;
+
+    ATL::CComPtr<IWICBitmapDecoder> decoder;
+    GUID container;
+    UINT frameCount = 0;
+    if (FAILED(factory->CreateDecoderFromFilename(inputPath.c_str(), NULL, GENERIC_READ,
+                                                  WICDecodeMetadataCacheOnDemand, &decoder)) ||
+        FAILED(decoder->GetContainerFormat(&container)) ||
+        FAILED(decoder->GetFrameCount(&frameCount)) ||
+        frameCount == 0)
+        return false;
+
+    // Same container as the input
+    ATL::CComPtr<IWICStream> stream;
+    ATL::CComPtr<IWICBitmapEncoder> encoder;
+    if (FAILED(factory->CreateStream(&stream)) ||
+        FAILED(stream->InitializeFromFilename(outputPath.c_str(), GENERIC_WRITE)) ||
+        FAILED(factory->CreateEncoder(container, NULL, &encoder)) ||
+        FAILED(encoder->Initialize(stream, WICBitmapEncoderNoCache)))
+        return false;
+
+    // The overlay was laid out for the first frame; later pages (scans,
+    // reduced-resolution copies) are written back as they are
+    for (UINT i = 0; i < frameCount; i++)
+    {
+        if (!StreamFrame(factory, decoder, encoder, i, i == 0 ? overlay : NULL, x, y))
+            return false;
+    }
+
+    return SUCCEEDED(encoder->Commit());
+}
+
+bool TiledImageProcessor::StreamFrame(IWICImagingFactory* factory, IWICBitmapDecoder* decoder,
+                                      IWICBitmapEncoder* encoder, UINT index,
+                                      const WatermarkOverlay* overlay, int x, int y)
+{
+    ATL::CComPtr<IWICBitmapFrameDecode> frame;
+    if (FAILED(decoder->GetFrame(index, &frame)))
+        return false;
+
+    UINT width = 0;
+    UINT height = 0;
+    double dpiX = 96.0;
+    double dpiY = 96.0;
+    WICPixelFormatGUID nativeFormat;
+    if (FAILED(frame->GetSize(&width, &height)) || FAILED(frame->GetPixelFormat(&nativeFormat)))
+        return false;
+    frame->GetResolution(&dpiX, &dpiY);
+
+    GUID container;
+    if (FAILED(decoder->GetContainerFormat(&container)))
+        return false;
+
+    ATL::CComPtr<IWICBitmapFrameEncode> target;
+    ATL::CComPtr<IPropertyBag2> properties;
+    if (FAILED(encoder->CreateNewFrame(&target, &properties)))
+        return false;
+    if (container == GUID_ContainerFormatTiff)
+        CopyTiffCompression(frame, nativeFormat == GUID_WICPixelFormatBlackWhite, properties);
+    if (FAILED(target->Initialize(properties)) ||
+        FAILED(target->SetSize(width, height)) ||
+        FAILED(target->SetResolution(dpiX, dpiY)))
+        return false;
+
+    // Indexed and 1/2/4-bit grey frames keep their format; anything else is
+    // written in the closest format the compositor works on. The encoder
+    // may substitute the closest format it supports.
+    WICPixelFormatGUID outputFormat = nativeFormat;
+    if (FindPackedFormat(nativeFormat) == NULL)
+        outputFormat = *SelectWicFormat(factory, nativeFormat)->format;
+    if (FAILED(target->SetPixelFormat(&outputFormat)))
+        return false;
+
+    const PackedFormat* packed = FindPackedFormat(outputFormat);
+    const WicFormat* format = packed != NULL ? SelectWicFormat(factory, outputFormat) : FindWicFormat(outputFormat);
+    if (format == NULL)
+        return false;
+    WICPixelFormatGUID workingFormat = *format->format;
+
+    ATL::CComPtr<IWICPalette> palette;
+    if (packed != NULL && packed->indexed)
+    {
+        if (FAILED(factory->CreatePalette(&palette)) ||
+            FAILED(frame->CopyPalette(palette)) ||
+            FAILED(target->SetPalette(palette)))
+            return false;
+    }
+
+    // Metadata blocks (EXIF, XMP, IPTC) and the colour profile are carried
+    // across where the codec allows it; neither is worth failing the file
+    ATL::CComPtr<IWICMetadataBlockReader> blockReader;
+    ATL::CComPtr<IWICMetadataBlockWriter> blockWriter;
+    if (SUCCEEDED(frame.QueryInterface(&blockReader)) && SUCCEEDED(target.QueryInterface(&blockWriter)))
+        blockWriter->InitializeFromBlockReader(blockReader);
+
+    UINT contextCount = 0;
+    if (SUCCEEDED(frame->GetColorContexts(0, NULL, &contextCount)) && contextCount > 0)
+    {
+        std::vector<IWICColorContext*> contexts(contextCount, NULL);
+        bool created = true;
+        for (UINT i = 0; i < contextCount && created; i++)
+            created = SUCCEEDED(factory->CreateColorContext(&contexts[i]));
+
+        if (created && SUCCEEDED(frame->GetColorContexts(contextCount, &contexts[0], &contextCount)))
+            target->SetColorContexts(contextCount, &contexts[0]);
+
+        for (size_t i = 0; i < contexts.size(); i++)
+        {
+            if (contexts[i] != NULL)
+                contexts[i]->Release();
+        }
+    }
+
+    ATL::CComPtr<IWICBitmapSource> source;
+    if (FAILED(ConvertSource(factory, frame, nativeFormat, workingFormat, NULL, source)))
+        return false;
+
+    // Bands of a packed format the watermark misses are read as they are
+    ATL::CComPtr<IWICBitmapSource> packedSource;
+    if (packed != NULL && FAILED(ConvertSource(factory, frame, nativeFormat, outputFormat, palette, packedSource)))
+        return false;
+
+    SampleLayout layout;
+    layout.samples = format->samples;
+    layout.bytesPerSample = format->bytesPerSample;
+    layout.bigEndian = false;
+    layout.bgr = format->bgr;
+    layout.gray = format->gray;
+    layout.alphaIndex = format->alphaIndex;
+    layout.premultiplied = format->premultiplied;
+
+    UINT64 stride = ((UINT64)width * format->bitsPerPixel + 7) / 8;
+    if (stride * STREAM_BAND_ROWS > 0xFFFFFFFFull)
+        return false;
+    m_block.resize((size_t)stride * STREAM_BAND_ROWS);
+
+    UINT64 packedStride = 0;
+    if (packed != NULL)
+    {
+        packedStride = ((UINT64)width * packed->bitsPerPixel + 7) / 8;
+        m_packed.resize((size_t)packedStride * STREAM_BAND_ROWS);
+    }
+
+    // Only one band of rows is ever held
+    for (UINT row = 0; row < height; row += STREAM_BAND_ROWS)
+    {
+        UINT rows = min(STREAM_BAND_ROWS, height - row);
+        UINT bandBytes = (UINT)stride * rows;
+        WICRect rect = { 0, (INT)row, (INT)width, (INT)rows };
+
+        bool covered = overlay != NULL &&
+                       (LONGLONG)y < (LONGLONG)row + rows && (LONGLONG)y + overlay->height > (LONGLONG)row &&
+                       (LONGLONG)x < (LONGLONG)width && (LONGLONG)x + overlay->width > 0;
+
+        if (packed != NULL && !covered)
+        {
+            UINT packedBytes = (UINT)packedStride * rows;
+            if (FAILED(packedSource->CopyPixels(&rect, (UINT)packedStride, packedBytes, &m_packed[0])) ||
+                FAILED(target->WritePixels(rows, (UINT)packedStride, packedBytes, &m_packed[0])))
+                return false;
+            continue;
+        }
+
+        if (FAILED(source->CopyPixels(&rect, (UINT)stride, bandBytes, &m_block[0])))
+            return false;
+
+        if (covered)
+        {
+            CompositeBlock(&m_block[0], (size_t)stride, 0, row, width, rows, width, height,
+                           *overlay, x, y, layout);
+        }
+
+        if (packed == NULL)
+        {
+            if (FAILED(target->WritePixels(rows, (UINT)stride, bandBytes, &m_block[0])))
+                return false;
+            continue;
+        }
+
+        // Back to the packed format, nearest palette entry for indexed
+        ATL::CComPtr<IWICBitmap> band;
+        ATL::CComPtr<IWICBitmapSource> converted;
+        UINT packedBytes = (UINT)packedStride * rows;
+        if (FAILED(factory->CreateBitmapFromMemory(width, rows, workingFormat, (UINT)stride, bandBytes,
+                                                   &m_block[0], &band)) ||
+            FAILED(ConvertSource(factory, band, workingFormat, outputFormat, palette, converted)) ||
+            FAILED(converted->CopyPixels(NULL, (UINT)packedStride, packedBytes, &m_packed[0])) ||
+            FAILED(target->WritePixels(rows, (UINT)packedStride, packedBytes, &m_packed[0])))
+            return false;
+    }
+
+    return SUCCEEDED(target->Commit());
+}
+
+HRESULT TiledImageProcessor::ConvertSource(IWICImagingFactory* factory, IWICBitmapSource* input,
+                                           const WICPixelFormatGUID& inputFormat,
+                                           const WICPixelFormatGUID& outputFormat, IWICPalette* palette,
+                                           ATL::CComPtr<IWICBitmapSource>& output)
+{
+    if (inputFormat == outputFormat)
+    {
+        output = input;
+        return S_OK;
+    }
+
+    ATL::CComPtr<IWICFormatConverter> converter;
+    HRESULT hr = factory->CreateFormatConverter(&converter);
+    if (SUCCEEDED(hr))
+    {
+        hr = converter->Initialize(input, outputFormat, WICBitmapDitherTypeNone, palette, 0.0,
+                                   WICBitmapPaletteTypeCustom);
+    }
+    if (SUCCEEDED(hr))
+        output = converter;
+    return hr;
+}
+
+void TiledImageProcessor::CompositeBlock(BYTE* block, size_t blockStride, UINT blockX, UINT blockY,
+                                         UINT blockWidth, UINT blockRows, UINT imageWidth, UINT imageHeight,
+                                         const WatermarkOverlay& overlay, int x, int y, const SampleLayout& layout)
+{
+    // Intersection of block, image and overlay, in image pixels
+    LONGLONG left = max((LONGLONG)max(x, 0), (LONGLONG)blockX);
+    LONGLONG top = max((LONGLONG)max(y, 0), (LONGLONG)blockY);
+    LONGLONG right = min((LONGLONG)x + overlay.width, min((LONGLONG)blockX + blockWidth, (LONGLONG)imageWidth));
+    LONGLONG bottom = min((LONGLONG)y + overlay.height, min((LONGLONG)blockY + blockRows, (LONGLONG)imageHeight));
+    if (right <= left || bottom <= top)
+        return;
+
+    size_t pixelBytes = (size_t)layout.samples * layout.bytesPerSample;
+    for (LONGLONG row = top; row < bottom; row++)
+    {
+        BYTE* pixels = block + (size_t)(row - blockY) * blockStride + (size_t)(left - blockX) * pixelBytes;
+        const BYTE* source = &overlay.pixels[(size_t)(row - y) * overlay.stride + (size_t)(left - x) * 4];
+        CompositeSpan(pixels, source, (UINT)(right - left), layout);
+    }
+}
+
+static float LoadSample(const BYTE* p, const SampleLayout& layout)
+{
+    if (layout.bytesPerSample == 1)
+        return p[0];
+    return (float)(layout.bigEndian ? ((p[0] << 8) | p[1]) : (p[0] | (p[1] << 8)));
+}
+
+static void StoreSample(BYTE* p, float value, float maxValue, const SampleLayout& layout)
+{
+    UINT sample = (value <= 0.0f) ? 0 : (value >= maxValue) ? (UINT)maxValue : (UINT)(value + 0.5f);
+    if (layout.bytesPerSample == 1)
+    {
+        p[0] = (BYTE)sample;
+        return;
+    }
+    p[layout.bigEndian ? 0 : 1] = (BYTE)(sample >> 8);
+    p[layout.bigEndian ? 1 : 0] = (BYTE)sample;
+}
+
+void TiledImageProcessor::CompositeSpan(BYTE* pixels, const BYTE* overlay, UINT count, const SampleLayout& layout)
+{
+    const float maxValue = (layout.bytesPerSample == 2) ? 65535.0f : 255.0f;
+    const size_t sampleBytes = layout.bytesPerSample;
+    const size_t pixelBytes = layout.samples * sampleBytes;
+    const bool straightAlpha = layout.alphaIndex >= 0 && !layout.premultiplied;
+    const UINT colourSamples = layout.gray ? 1 : 3;
+
+    for (UINT i = 0; i < count; i++, pixels += pixelBytes, overlay += 4)
+    {
+        if (overlay[3] == 0)
+            continue;
+
+        // Overlay is premultiplied B, G, R, A
+        float coverage = overlay[3] / 255.0f;
+        float keep = 1.0f - coverage;
+        float colour[3] = { overlay[2] / 255.0f, overlay[1] / 255.0f, overlay[0] / 255.0f };
+
+        float sourceAlpha = 1.0f;
+        if (layout.alphaIndex >= 0)
+            sourceAlpha = LoadSample(pixels + layout.alphaIndex * sampleBytes, layout) / maxValue;
+        float outAlpha = coverage + sourceAlpha * keep;
+
+        for (UINT c = 0; c < colourSamples; c++)
+        {
+            float over;
+            BYTE* sample;
+            if (layout.gray)
+            {
+                over = 0.299f * colour[0] + 0.587f * colour[1] + 0.114f * colour[2];
+                sample = pixels;
+            }
+            else
+            {
+                over = colour[c];
+                sample = pixels + (layout.bgr ? 2 - c : c) * sampleBytes;
+            }
+
+            float value = LoadSample(sample, layout) / maxValue;
+            if (straightAlpha)
+                value = (over + value * sourceAlpha * keep) / outAlpha;
+            else
+                value = over + value * keep;
+
+            StoreSample(sample, value * maxValue, maxValue, layout);
+        }
+
+        if (layout.alphaIndex >= 0)
+            StoreSample(pixels + layout.alphaIndex * sampleBytes, outAlpha * maxValue, maxValue, layout);
+    }
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "stdafx.h"
+#include "ImageHeaderProbe.h"
+#include "OverlayCache.h"
+#include <string>
+#include <vector>
+
+// How samples are laid out in a tile, strip or WIC band buffer
+struct SampleLayout
+{
+    UINT samples = 3;
+    UINT bytesPerSample = 1;
+    bool bigEndian = false;     // 16-bit samples only
+    bool bgr = false;           // Colour order B, G, R instead of R, G, B
+    bool gray = false;
+    int alphaIndex = -1;        // Sample holding alpha, -1 if none
+    bool premultiplied = false;
+};
+
+// Watermarks TIFF and PNG input at its native bit depth without holding
+// the whole frame, and writes the same format back.
+//
+// Tiled or stripped TIFFs that are uncompressed, LZW or PackBits (8/16-bit,
+// chunky grey or RGB, optional alpha and predictor 2) are patched: the file
+// is copied, only the tiles or strips under the watermark band are decoded,
+// composited and re-encoded, and the new data is appended with its offsets
+// patched in the copy. Everything else (PNG, other TIFF compressions) is
+// streamed through WIC in bands of STREAM_BAND_ROWS rows. Streamed indexed
+// and 1/2/4-bit grey frames keep their format (and palette), and a TIFF
+// page keeps its compression where WIC's encoder has the method.
+//
+// Only the first frame is watermarked. Further frames of a multi-page TIFF
+// are carried over unchanged: the patcher copies them with the file, and
+// the WIC path re-encodes each one after the first.
+class TiledImageProcessor
+{
+public:
+    TiledImageProcessor();
+    ~TiledImageProcessor();
+
+    static bool Handles(const ImageHeaderInfo& info);
+
+    // overlay is the composed watermark band placed at (x, y); NULL copies
+    // the image unchanged
+    bool Process(const std::wstring& inputPath, const std::wstring& outputPath, const ImageHeaderInfo& info,
+                 const WatermarkOverlay* overlay, int x, int y);
+
+    // Peak memory Process needs for a file, beyond the fixed overhead
+    static UINT64 EstimateWorkingSet(const ImageHeaderInfo& info);
+
+    // Largest tile or strip the patcher decodes itself. Bigger blocks (the
+    // single strip many writers use for the whole image) are streamed.
+    static UINT64 GetMaxPatchBlockBytes(UINT width, UINT pixelBytes);
+
+    // Bytes held between files by the block buffers
+    UINT64 GetRetainedBytes() const;
+    void ReleaseBuffers();
+
+    // Source-over blend of a premultiplied BGRA overlay span
+    static void CompositeSpan(BYTE* pixels, const BYTE* overlay, UINT count, const SampleLayout& layout);
+
+    static const UINT STREAM_BAND_ROWS = 128;
+    static const UINT PATCH_BLOCK_BANDS = 4;
+
+    // Block buffers up to this size are kept for the next file
+    static const size_t RETAINED_BUFFER_BYTES = 16 * 1024 * 1024;
+
+private:
+    TiledImageProcessor(const TiledImageProcessor&);
+    TiledImageProcessor& operator=(const TiledImageProcessor&);
+
+    enum class PatchResult
+    {
+        Patched,
+        Unsupported,    // Layout the patcher does not handle; stream it instead
+        Failed
+    };
+
+    PatchResult PatchTiff(const std::wstring& inputPath, const std::wstring& outputPath,
+                          const WatermarkOverlay* overlay, int x, int y);
+    bool StreamWithWic(const std::wstring& inputPath, const std::wstring& outputPath,
+                       const WatermarkOverlay* overlay, int x, int y);
+    bool StreamFrames(const std::wstring& inputPath, const std::wstring& outputPath,
+                      const WatermarkOverlay* overlay, int x, int y);
+    bool StreamFrame(IWICImagingFactory* factory, IWICBitmapDecoder* decoder, IWICBitmapEncoder* encoder,
+                     UINT index, const WatermarkOverlay* overlay, int x, int y);
+
+    // input itself when the formats match, otherwise a WIC format converter
+    static HRESULT ConvertSource(IWICImagingFactory* factory, IWICBitmapSource* input,
+                                 const WICPixelFormatGUID& inputFormat, const WICPixelFormatGUID& outputFormat,
+                                 IWICPalette* palette, ATL::CComPtr<IWICBitmapSource>& output);
+
+    // Blends the overlay into the part of a block (tile, strip or band)
+    // it covers; block coordinates are in image pixels
+    static void CompositeBlock(BYTE* block, size_t blockStride, UINT blockX, UINT blockY, UINT blockWidth,
+                               UINT blockRows, UINT imageWidth, UINT imageHeight,
+                               const WatermarkOverlay& overlay, int x, int y, const SampleLayout& layout);
+
+    // Drops buffers that grew past RETAINED_BUFFER_BYTES
+    void TrimBuffers();
+
+    // Reused between files
+    std::vector<BYTE> m_compressed;
+    std::vector<BYTE> m_block;
+    std::vector<BYTE> m_encoded;
+    std::vector<BYTE> m_packed;     // WIC band converted back to an indexed or 1/2/4-bit format
+};
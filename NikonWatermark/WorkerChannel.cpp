@@ -0,0 +1,335 @@
+#include "stdafx.h"
+#include "WorkerChannel.h"
+
+const WCHAR* LocalProcessLauncher::WORKER_SWITCH = L"--worker";
+
+void WorkerProtocol::Serialize(const WorkerMessage& message, std::vector<BYTE>& frame)
+{
+    std::wstring text = message.type;
+    for (size_t i = 0; i < message.fields.size(); i++)
+    {
+        text += L'\t';
+        text += message.fields[i];
+    }
+
+    UINT length = (UINT)(text.length() * sizeof(WCHAR));
+    frame.resize(sizeof(length) + length);
+    memcpy(&frame[0], &length, sizeof(length));
+    if (length > 0)
+        memcpy(&frame[sizeof(length)], text.c_str(), length);
+}
+
+bool WorkerProtocol::Parse(std::vector<BYTE>& buffer, WorkerMessage& message, bool& malformed)
+{
+    malformed = false;
+
+    UINT length = 0;
+    if (buffer.size() < sizeof(length))
+        return false;
+
+    memcpy(&length, &buffer[0], sizeof(length));
+    if (length > MAX_FRAME_BYTES || length % sizeof(WCHAR) != 0)
+    {
+        malformed = true;
+        return false;
+    }
+
+    if (buffer.size() < sizeof(length) + length)
+        return false;
+
+    const WCHAR* text = (const WCHAR*)&buffer[sizeof(length)];
+    size_t count = length / sizeof(WCHAR);
+
+    message.Clear();
+    size_t start = 0;
+    bool first = true;
+    for (size_t i = 0; i <= count; i++)
+    {
+        if (i < count && text[i] != L'\t')
+            continue;
+
+        if (first)
+            message.type.assign(text + start, i - start);
+        else
+            message.fields.push_back(std::wstring(text + start, i - start));
+
+        first = false;
+        start = i + 1;
+    }
+
+    buffer.erase(buffer.begin(), buffer.begin() + sizeof(length) + length);
+    return true;
+}
+
+bool WorkerProtocol::Write(HANDLE hPipe, const WorkerMessage& message)
+{
+    std::vector<BYTE> frame;
+    Serialize(message, frame);
+
+    size_t offset = 0;
+    while (offset < frame.size())
+    {
+        DWORD written = 0;
+        if (!WriteFile(hPipe, &frame[offset], (DWORD)(frame.size() - offset), &written, NULL))
+            return false;
+        offset += written;
+    }
+    return true;
+}
+
+static bool ReadExact(HANDLE hPipe, BYTE* buffer, DWORD size)
+{
+    DWORD offset = 0;
+    while (offset < size)
+    {
+        DWORD read = 0;
+        if (!ReadFile(hPipe, buffer + offset, size - offset, &read, NULL) || read == 0)
+            return false;
+        offset += read;
+    }
+    return true;
+}
+
+bool WorkerProtocol::Read(HANDLE hPipe, WorkerMessage& message)
+{
+    std::vector<BYTE> buffer(sizeof(UINT));
+    if (!ReadExact(hPipe, &buffer[0], sizeof(UINT)))
+        return false;
+
+    UINT length = 0;
+    memcpy(&length, &buffer[0], sizeof(length));
+    if (length > MAX_FRAME_BYTES)
+        return false;
+
+    buffer.resize(sizeof(UINT) + length);
+    if (length > 0 && !ReadExact(hPipe, &buffer[sizeof(UINT)], length))
+        return false;
+
+    bool malformed = false;
+    return Parse(buffer, message, malformed);
+}
+
+// Coordinator's end of a local worker's stdin/stdout pipes. One overlapped
+// read on stdout is always outstanding; its event is what the coordinator
+// waits on, along with the process handle.
+class LocalProcessChannel : public IWorkerChannel
+{
+public:
+    LocalProcessChannel(HANDLE hProcess, HANDLE hInput, HANDLE hOutput, HANDLE hReadEvent)
+        : m_hProcess(hProcess), m_hInput(hInput), m_hOutput(hOutput), m_hReadEvent(hReadEvent), 
+          m_reading(false), m_broken(false), m_closed(false)
+    {
+        ZeroMemory(&m_overlapped, sizeof(m_overlapped));
+        m_overlapped.hEvent = m_hReadEvent;
+        StartRead();
+    }
+
+    ~LocalProcessChannel()
+    {
+        // The pending read must finish before its buffer goes away
+        if (m_reading)
+        {
+            DWORD read = 0;
+            CancelIoEx(m_hOutput, &m_overlapped);
+            GetOverlappedResult(m_hOutput, &m_overlapped, &read, TRUE);
+        }
+
+        // Closing its stdin makes an idle worker exit on its own
+        CloseHandle(m_hInput);
+        CloseHandle(m_hOutput);
+        CloseHandle(m_hReadEvent);
+        CloseHandle(m_hProcess);
+    }
+
+    bool Send(const WorkerMessage& message) override
+    {
+        return !m_closed && WorkerProtocol::Write(m_hInput, message);
+    }
+
+    ChannelState Poll(WorkerMessage& message) override
+    {
+        if (m_closed)
+            return ChannelState::Closed;
+
+        for (;;)
+        {
+            // Deliver everything already buffered before reporting a broken pipe
+            if (TakeMessage(message))
+                return ChannelState::Message;
+            if (m_closed || m_broken)
+            {
+                // The worker has exited and all of its output has been read
+                m_closed = true;
+                return ChannelState::Closed;
+            }
+
+            DWORD read = 0;
+            if (!GetOverlappedResult(m_hOutput, &m_overlapped, &read, FALSE))
+            {
+                if (GetLastError() == ERROR_IO_INCOMPLETE)
+                    return ChannelState::Empty;
+
+                m_reading = false;
+                m_broken = true;
+                continue;
+            }
+
+            m_reading = false;
+            m_buffer.insert(m_buffer.end(), m_chunk, m_chunk + read);
+            StartRead();
+        }
+    }
+
+    void GetWaitHandles(std::vector<HANDLE>& handles) override
+    {
+        if (m_closed)
+            return;
+
+        handles.push_back(m_hReadEvent);
+        handles.push_back(m_hProcess);
+    }
+
+    void Terminate() override
+    {
+        TerminateProcess(m_hProcess, 1);
+        WaitForSingleObject(m_hProcess, TERMINATE_WAIT_MS);
+        m_closed = true;
+    }
+
+private:
+    void StartRead()
+    {
+        // A read that completes at once still signals the event and is
+        // collected by the next Poll
+        if (ReadFile(m_hOutput, m_chunk, sizeof(m_chunk), NULL, &m_overlapped) || 
+            GetLastError() == ERROR_IO_PENDING)
+            m_reading = true;
+        else
+            m_broken = true;
+    }
+
+    bool TakeMessage(WorkerMessage& message)
+    {
+        bool malformed = false;
+        if (WorkerProtocol::Parse(m_buffer, message, malformed))
+            return true;
+
+        // A corrupt stream cannot be resynchronised
+        if (malformed)
+            Terminate();
+        return false;
+    }
+
+    static const DWORD CHUNK_BYTES = 16 * 1024;
+    static const DWORD TERMINATE_WAIT_MS = 1000;
+
+    HANDLE m_hProcess;
+    HANDLE m_hInput;
+    HANDLE m_hOutput;
+    HANDLE m_hReadEvent;
+    OVERLAPPED m_overlapped;
+    BYTE m_chunk[CHUNK_BYTES];
+    std::vector<BYTE> m_buffer;
+    bool m_reading;
+    bool m_broken;
+    bool m_closed;
+};
+
+LocalProcessLauncher::LocalProcessLauncher() : m_nextPipe(0)
+{
+    m_hJob = CreateJobObjectW(NULL, NULL);
+    if (m_hJob != NULL)
+    {
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+        ZeroMemory(&limits, sizeof(limits));
+        limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+        SetInformationJobObject(m_hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+    }
+}
+
+LocalProcessLauncher::~LocalProcessLauncher()
+{
+    if (m_hJob != NULL)
+        CloseHandle(m_hJob);
+}
+
+std::unique_ptr<IWorkerChannel> LocalProcessLauncher::Launch()
+{
+    WCHAR exePath[MAX_PATH];
+    if (GetModuleFileNameW(NULL, exePath, MAX_PATH) == 0)
+        return nullptr;
+
+    // Only the child's ends of the pipes may be inherited
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = NULL;
+    sa.bInheritHandle = TRUE;
+
+    HANDLE hChildInput = NULL;
+    HANDLE hInput = NULL;
+    if (!CreatePipe(&hChildInput, &hInput, &sa, 0))
+        return nullptr;
+
+    // The worker writes to its end synchronously; only ours is overlapped
+    WCHAR pipeName[64];
+    swprintf_s(pipeName, L"\\\\.\\pipe\\NikonWatermark.%u.%u", GetCurrentProcessId(), m_nextPipe++);
+
+    HANDLE hOutput = CreateNamedPipeW(pipeName, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                      1, 0, 0, 0, NULL);
+    HANDLE hChildOutput = INVALID_HANDLE_VALUE;
+    if (hOutput != INVALID_HANDLE_VALUE)
+        hChildOutput = CreateFileW(pipeName, GENERIC_WRITE, 0, &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    HANDLE hReadEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+    if (hChildOutput == INVALID_HANDLE_VALUE || hReadEvent == NULL)
+    {
+        if (hOutput != INVALID_HANDLE_VALUE)
+            CloseHandle(hOutput);
+        if (hReadEvent != NULL)
+            CloseHandle(hReadEvent);
+        CloseHandle(hChildInput);
+        CloseHandle(hInput);
+        return nullptr;
+    }
+
+    SetHandleInformation(hInput, HANDLE_FLAG_INHERIT, 0);
+
+    std::wstring commandLine = L"\"";
+    commandLine += exePath;
+    commandLine += L"\" ";
+    commandLine += WORKER_SWITCH;
+
+    STARTUPINFOW si;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = hChildInput;
+    si.hStdOutput = hChildOutput;
+    si.hStdError = NULL;
+
+    // Suspended until it is in the job, so it cannot outlive us even briefly
+    PROCESS_INFORMATION pi;
+    BOOL created = CreateProcessW(NULL, &commandLine[0], NULL, NULL, TRUE,
+                                  CREATE_NO_WINDOW | CREATE_SUSPENDED, NULL, NULL, &si, &pi);
+
+    CloseHandle(hChildInput);
+    CloseHandle(hChildOutput);
+
+    if (!created)
+    {
+        CloseHandle(hInput);
+        CloseHandle(hOutput);
+        CloseHandle(hReadEvent);
+        return nullptr;
+    }
+
+    if (m_hJob != NULL)
+        AssignProcessToJobObject(m_hJob, pi.hProcess);
+
+    ResumeThread(pi.hThread);
+    CloseHandle(pi.hThread);
+
+    return std::unique_ptr<IWorkerChannel>(new LocalProcessChannel(pi.hProcess, hInput, hOutput, hReadEvent));
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include "stdafx.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+// One protocol message: a type word and tab-separated fields, sent as a
+// 32-bit byte count followed by UTF-16 text. File paths cannot contain
+// tabs, so no escaping is needed.
+//
+//   Coordinator -> worker   CONFIG outputFolder aperture iso shutter position
+//                           SHARD  shardId (fileIndex path outputName)...
+//   Worker -> coordinator   RESULT shardId fileIndex success milliseconds
+struct WorkerMessage
+{
+    std::wstring type;
+    std::vector<std::wstring> fields;
+
+    void Clear() { type.clear(); fields.clear(); }
+};
+
+namespace WorkerProtocol
+{
+    // Largest frame either side accepts; anything bigger is a broken peer
+    static const UINT MAX_FRAME_BYTES = 16 * 1024 * 1024;
+
+    void Serialize(const WorkerMessage& message, std::vector<BYTE>& frame);
+
+    // Consumes one complete frame from the front of buffer. Returns false
+    // if no complete frame is buffered yet; malformed sets the flag.
+    bool Parse(std::vector<BYTE>& buffer, WorkerMessage& message, bool& malformed);
+
+    // Blocking helpers for the worker side, which only ever talks to one peer
+    bool Write(HANDLE hPipe, const WorkerMessage& message);
+    bool Read(HANDLE hPipe, WorkerMessage& message);
+}
+
+enum class ChannelState
+{
+    Message,    // A message was returned
+    Empty,      // Nothing complete has arrived yet
+    Closed      // The worker is gone (exited, crashed or sent garbage)
+};
+
+// Coordinator's end of the link to one worker. Everything the coordinator
+// needs goes through this interface, so workers on other machines only
+// need another channel and launcher.
+class IWorkerChannel
+{
+public:
+    virtual ~IWorkerChannel() {}
+
+    virtual bool Send(const WorkerMessage& message) = 0;
+
+    // Never blocks
+    virtual ChannelState Poll(WorkerMessage& message) = 0;
+
+    // Appends handles that are signalled once Poll has something new to
+    // report, so the coordinator can wait on them instead of polling
+    virtual void GetWaitHandles(std::vector<HANDLE>& handles) = 0;
+
+    // Kills a worker that overran its lease or whose batch was cancelled.
+    // Returns once the process is gone (or after a short bound), so the
+    // files it had open can be deleted.
+    virtual void Terminate() = 0;
+};
+
+class IWorkerLauncher
+{
+public:
+    virtual ~IWorkerLauncher() {}
+
+    virtual std::unique_ptr<IWorkerChannel> Launch() = 0;
+};
+
+// Starts this executable with --worker and talks to it over its standard
+// input and output. Its output arrives on a named pipe read with overlapped
+// I/O, which, unlike an anonymous pipe, has an event to wait on. Workers
+// are placed in a job object so they die with the coordinator.
+class LocalProcessLauncher : public IWorkerLauncher
+{
+public:
+    LocalProcessLauncher();
+    ~LocalProcessLauncher();
+
+    std::unique_ptr<IWorkerChannel> Launch() override;
+
+    static const WCHAR* WORKER_SWITCH;
+
+private:
+    LocalProcessLauncher(const LocalProcessLauncher&);
+    LocalProcessLauncher& operator=(const LocalProcessLauncher&);
+
+    HANDLE m_hJob;
+    UINT m_nextPipe;
+};
@@ -0,0 +1,136 @@
+#include "stdafx.h"
+#include "WorkerProcess.h"
+
+void WorkerProcess::MakeConfigMessage(const std::wstring& outputFolder, const WatermarkConfig& config,
+                                      UINT encoderThreads, WorkerMessage& message)
+{
+    message.Clear();
+    message.type = L"CONFIG";
+    message.fields.push_back(outputFolder);
+    message.fields.push_back(config.showAperture ? L"1" : L"0");
+    message.fields.push_back(config.showISO ? L"1" : L"0");
+    message.fields.push_back(config.showShutterSpeed ? L"1" : L"0");
+    message.fields.push_back(config.position == WatermarkPosition::Top ? L"top" : L"bottom");
+    message.fields.push_back(std::to_wstring(encoderThreads));
+}
+
+bool WorkerProcess::ParseConfigMessage(const WorkerMessage& message, std::wstring& outputFolder,
+                                       WatermarkConfig& config, UINT& encoderThreads)
+{
+    if (message.type != L"CONFIG" || message.fields.size() != 6)
+        return false;
+
+    outputFolder = message.fields[0];
+    config.showAperture = (message.fields[1] == L"1");
+    config.showISO = (message.fields[2] == L"1");
+    config.showShutterSpeed = (message.fields[3] == L"1");
+    config.position = (message.fields[4] == L"top") ? WatermarkPosition::Top : WatermarkPosition::Bottom;
+    encoderThreads = wcstoul(message.fields[5].c_str(), NULL, 10);
+    return !outputFolder.empty() && encoderThreads > 0;
+}
+
+std::wstring WorkerProcess::FormatHeader(const ImageHeaderInfo& header)
+{
+    WCHAR field[128];
+    swprintf_s(field, L"%u %u %u %u %u %u %I64u", (UINT)header.format, header.width, header.height,
+               header.components, header.bitsPerComponent, header.hasAlpha ? 1 : 0, header.blockBytes);
+    return field;
+}
+
+bool WorkerProcess::ParseHeader(const std::wstring& field, ImageHeaderInfo& header)
+{
+    UINT format = 0;
+    UINT hasAlpha = 0;
+    if (swscanf_s(field.c_str(), L"%u %u %u %u %u %u %I64u", &format, &header.width, &header.height,
+                  &header.components, &header.bitsPerComponent, &hasAlpha, &header.blockBytes) != 7 ||
+        format > (UINT)ImageFormat::Tiff)
+        return false;
+
+    header.format = (ImageFormat)format;
+    header.hasAlpha = (hasAlpha != 0);
+    return true;
+}
+
+int WorkerProcess::Run()
+{
+    // A crash must end the process at once rather than wait on an error
+    // dialog nobody will see; the coordinator retries the file elsewhere
+    SetErrorMode(SEM_FAILCRITICALERRORS | SEM_NOGPFAULTERRORBOX | SEM_NOOPENFILEERRORBOX);
+
+    HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE hOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (hInput == NULL || hInput == INVALID_HANDLE_VALUE || hOutput == NULL || hOutput == INVALID_HANDLE_VALUE)
+        return 1;
+
+    ImageProcessor processor;
+    WatermarkConfig config;
+    std::wstring outputPath;
+    size_t folderLength = 0;
+    bool configured = false;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+    ImageHeaderInfo header;
+    WorkerMessage message;
+    WorkerMessage result;
+    result.type = L"RESULT";
+    result.fields.resize(4);
+
+    // Ends cleanly when the coordinator closes our stdin
+    while (WorkerProtocol::Read(hInput, message))
+    {
+        if (message.type == L"CONFIG")
+        {
+            UINT encoderThreads = 0;
+            if (!ParseConfigMessage(message, outputPath, config, encoderThreads))
+                return 1;
+
+            processor.SetEncoderThreads(encoderThreads);
+
+            outputPath += L"\\";
+            folderLength = outputPath.length();
+            configured = true;
+            continue;
+        }
+
+        // SHARD id, then (index, path, output name, header) quadruples
+        if (message.type != L"SHARD" || !configured || message.fields.size() % 4 != 1)
+            return 1;
+
+        result.fields[0] = message.fields[0];
+
+        for (size_t i = 1; i + 3 < message.fields.size(); i += 4)
+        {
+            const std::wstring& inputPath = message.fields[i + 1];
+
+            outputPath.resize(folderLength);
+            outputPath += message.fields[i + 2];
+
+            if (!ParseHeader(message.fields[i + 3], header))
+                return 1;
+
+            LARGE_INTEGER start;
+            LARGE_INTEGER end;
+            QueryPerformanceCounter(&start);
+            bool success = processor.ProcessImage(inputPath, outputPath, header, config);
+            QueryPerformanceCounter(&end);
+
+            WCHAR milliseconds[32];
+            swprintf_s(milliseconds, L"%.1f", (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart);
+
+            result.fields[1] = message.fields[i];
+            result.fields[2] = success ? L"1" : L"0";
+            result.fields[3] = milliseconds;
+
+            if (!WorkerProtocol::Write(hOutput, result))
+                return 1;
+        }
+
+        // The coordinator only charges busy workers against the memory
+        // budget, so an idle one must not sit on a large frame buffer
+        processor.ReleaseBuffers();
+    }
+
+    return 0;
+}
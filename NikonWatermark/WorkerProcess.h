@@ -0,0 +1,25 @@
+#pragma once
+#include "stdafx.h"
+#include "WorkerChannel.h"
+#include "ImageProcessor.h"
+#include <string>
+
+// Body of a process started with --worker: takes shards from the
+// coordinator on stdin, processes them with a single ImageProcessor and
+// reports every file on stdout as soon as it is done, so a crash can be
+// pinned on the file that caused it.
+class WorkerProcess
+{
+public:
+    // Returns the process exit code
+    static int Run();
+
+    static void MakeConfigMessage(const std::wstring& outputFolder, const WatermarkConfig& config,
+                                  UINT encoderThreads, WorkerMessage& message);
+    static bool ParseConfigMessage(const WorkerMessage& message, std::wstring& outputFolder,
+                                   WatermarkConfig& config, UINT& encoderThreads);
+
+    // The header the coordinator probed, so the worker does not read it again
+    static std::wstring FormatHeader(const ImageHeaderInfo& header);
+    static bool ParseHeader(const std::wstring& field, ImageHeaderInfo& header);
+};
@@ -1,16 +1,25 @@
 #include "stdafx.h"
 #include "resource.h"
 #include "MainFrame.h"
+#include "WorkerProcess.h"
 
 ATL::CAppModule _Module;
 
-int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPWSTR /*lpCmdLine*/, int nCmdShow)
+int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPWSTR lpCmdLine, int nCmdShow)
 {
     // Initialize GDI+
     Gdiplus::GdiplusStartupInput gdiplusStartupInput;
     ULONG_PTR gdiplusToken;
     Gdiplus::GdiplusStartup(&gdiplusToken, &gdiplusStartupInput, NULL);
     
+    // Batch worker started by ShardCoordinator: no window, no COM
+    if (lpCmdLine != NULL && wcscmp(lpCmdLine, LocalProcessLauncher::WORKER_SWITCH) == 0)
+    {
+        int exitCode = WorkerProcess::Run();
+        Gdiplus::GdiplusShutdown(gdiplusToken);
+        return exitCode;
+    }
+    
     // Initialize COM
     HRESULT hRes = ::CoInitialize(NULL);
     ATLASSERT(SUCCEEDED(hRes));
@@ -27,30 +36,34 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE /*hPrevInstance*/, LPWSTR /*l
     
     int nRet = 0;
     
-    // Create main window
-    CMainFrame wndMain;
-    
-    RECT rcWindow = { 0, 0, 1000, 700 };
-    
-    if (wndMain.CreateEx(NULL, rcWindow) == NULL)
+    // The window owns GDI+ objects (cached fonts, pooled bitmaps), so it
+    // must be destroyed before GDI+ is shut down below
     {
-        ATLTRACE(L"Main window creation failed!\n");
-        return 0;
+        // Create main window
+        CMainFrame wndMain;
+        
+        RECT rcWindow = { 0, 0, 1000, 700 };
+        
+        if (wndMain.CreateEx(NULL, rcWindow) == NULL)
+        {
+            ATLTRACE(L"Main window creation failed!\n");
+            return 0;
+        }
+        
+        wndMain.ShowWindow(nCmdShow);
+        wndMain.UpdateWindow();
+        
+        // Message loop
+        WTL::CMessageLoop theLoop;
+        _Module.AddMessageLoop(&theLoop);
+        theLoop.AddMessageFilter(&wndMain);
+        theLoop.AddIdleHandler(&wndMain);
+        
+        nRet = theLoop.Run();
+        
+        _Module.RemoveMessageLoop();
     }
     
-    wndMain.ShowWindow(nCmdShow);
-    wndMain.UpdateWindow();
-    
-    // Message loop
-    WTL::CMessageLoop theLoop;
-    _Module.AddMessageLoop(&theLoop);
-    theLoop.AddMessageFilter(&wndMain);
-    theLoop.AddIdleHandler(&wndMain);
-    
-    nRet = theLoop.Run();
-    
-    _Module.RemoveMessageLoop();
-    
     // Cleanup
     _Module.Term();
     ::CoUninitialize();
@@ -12,3 +12,6 @@
 #define IDC_EXIF_APERTURE       1007
 #define IDC_EXIF_ISO            1008
 #define IDC_EXIF_SHUTTER        1009
+#define IDC_IMPORT_FOLDER_BUTTON 1011
+#define IDC_WATCH_BUTTON        1012
+#define IDC_ISOLATE_CHECK       1013
@@ -20,11 +20,15 @@ extern ATL::CAppModule _Module;
 #include <windows.h>
 #include <commctrl.h>
 #include <gdiplus.h>
+#include <wincodec.h>
+#include <wincodecsdk.h>
 #include <string>
 #include <vector>
 #include <memory>
 
 #pragma comment(lib, "comctl32.lib")
 #pragma comment(lib, "gdiplus.lib")
+#pragma comment(lib, "windowscodecs.lib")
+#pragma comment(lib, "shlwapi.lib")
 
 using namespace Gdiplus;
@@ -0,0 +1,174 @@
+// Throughput of the EXIF parser on a normal camera file and on crafted
+// worst cases. Every case should cost about the same as the normal one:
+// the parser's work is bounded by its limits, not by the input.
+// See "Fuzzing and Benchmarks" in docs/DEVELOPMENT.md for the build line.
+#include "stdafx.h"
+#include "ExifParser.h"
+#include "TiffDirectory.h"
+#include <cstdio>
+
+static const UINT ITERATIONS = 20000;
+
+static const USHORT TAG_MAKE = 0x010F;
+static const USHORT TAG_MODEL = 0x0110;
+static const USHORT TAG_EXIF_IFD = 0x8769;
+static const USHORT TAG_EXPOSURE_TIME = 0x829A;
+static const USHORT TAG_FNUMBER = 0x829D;
+static const USHORT TAG_ISO = 0x8827;
+
+// Little-endian TIFF writer, just enough for IFD0 and the Exif IFD
+class TiffBuilder
+{
+public:
+    std::vector<BYTE> data;
+
+    TiffBuilder()
+    {
+        const BYTE header[8] = { 'I', 'I', 42, 0, 8, 0, 0, 0 };
+        data.assign(header, header + sizeof(header));
+    }
+
+    void Put16(UINT value)
+    {
+        data.push_back((BYTE)value);
+        data.push_back((BYTE)(value >> 8));
+    }
+
+    void Put32(UINT value)
+    {
+        Put16(value & 0xFFFF);
+        Put16(value >> 16);
+    }
+
+    void Patch32(size_t position, UINT value)
+    {
+        for (int i = 0; i < 4; i++)
+            data[position + i] = (BYTE)(value >> (i * 8));
+    }
+
+    void Entry(USHORT tag, USHORT type, UINT count, UINT value)
+    {
+        Put16(tag);
+        Put16(type);
+        Put32(count);
+        Put32(value);
+    }
+};
+
+static std::vector<BYTE> WrapInJpeg(const std::vector<BYTE>& tiff)
+{
+    static const BYTE EXIF_HEADER[6] = { 'E', 'x', 'i', 'f', 0, 0 };
+
+    std::vector<BYTE> jpeg = { 0xFF, 0xD8, 0xFF, 0xE1 };
+    UINT length = (UINT)min(tiff.size() + sizeof(EXIF_HEADER) + 2, (size_t)0xFFFF);
+    jpeg.push_back((BYTE)(length >> 8));
+    jpeg.push_back((BYTE)length);
+    jpeg.insert(jpeg.end(), EXIF_HEADER, EXIF_HEADER + sizeof(EXIF_HEADER));
+    jpeg.insert(jpeg.end(), tiff.begin(), tiff.end());
+
+    const BYTE END[4] = { 0xFF, 0xDA, 0xFF, 0xD9 };
+    jpeg.insert(jpeg.end(), END, END + sizeof(END));
+    return jpeg;
+}
+
+// IFD0 with make, model and the Exif IFD; the Exif IFD with the exposure
+static std::vector<BYTE> BuildCameraFile()
+{
+    TiffBuilder tiff;
+    tiff.Put16(3);
+    tiff.Entry(TAG_MAKE, TIFF_ASCII, 18, 0);
+    size_t makeOffset = tiff.data.size() - 4;
+    tiff.Entry(TAG_MODEL, TIFF_ASCII, 4, 0);
+    tiff.Patch32(tiff.data.size() - 4, 'Z' | (' ' << 8) | ('8' << 16));
+    tiff.Entry(TAG_EXIF_IFD, TIFF_LONG, 1, 0);
+    size_t exifPointer = tiff.data.size() - 4;
+    tiff.Put32(0);
+
+    tiff.Patch32(makeOffset, (UINT)tiff.data.size());
+    const char make[18] = "NIKON CORPORATION";
+    tiff.data.insert(tiff.data.end(), make, make + sizeof(make));
+
+    tiff.Patch32(exifPointer, (UINT)tiff.data.size());
+    tiff.Put16(3);
+    UINT values = (UINT)tiff.data.size() + 3 * 12 + 4;
+    tiff.Entry(TAG_EXPOSURE_TIME, TIFF_RATIONAL, 1, values);
+    tiff.Entry(TAG_FNUMBER, TIFF_RATIONAL, 1, values + 8);
+    tiff.Entry(TAG_ISO, TIFF_SHORT, 1, 400);
+    tiff.Put32(0);
+    tiff.Put32(1);
+    tiff.Put32(250);
+    tiff.Put32(56);
+    tiff.Put32(10);
+
+    return WrapInJpeg(tiff.data);
+}
+
+// Fill bytes and empty segments up to the end of a 64 KB file; the scan
+// stops at MAX_JPEG_SEGMENTS
+static std::vector<BYTE> BuildMarkerFlood()
+{
+    std::vector<BYTE> jpeg = { 0xFF, 0xD8 };
+    while (jpeg.size() < 32 * 1024)
+        jpeg.push_back(0xFF);
+    while (jpeg.size() < 64 * 1024)
+    {
+        const BYTE segment[4] = { 0xFF, 0xE2, 0x00, 0x02 };
+        jpeg.insert(jpeg.end(), segment, segment + sizeof(segment));
+    }
+    return jpeg;
+}
+
+// A directory that declares 65535 entries, all of them present
+static std::vector<BYTE> BuildHugeIfd()
+{
+    TiffBuilder tiff;
+    tiff.Put16(0xFFFF);
+    for (UINT i = 0; i < 0xFFFF; i++)
+        tiff.Entry(TAG_MAKE, TIFF_ASCII, 64, 8);
+    tiff.Put32(0);
+    return tiff.data;
+}
+
+// MAX_IFD_ENTRIES entries, each a wanted tag whose value lies past the
+// end of the block, and an Exif IFD pointer back to IFD0
+static std::vector<BYTE> BuildOutOfRangeOffsets()
+{
+    static const USHORT TAGS[5] = { TAG_MAKE, TAG_MODEL, TAG_FNUMBER, TAG_EXPOSURE_TIME, TAG_ISO };
+    static const USHORT TYPES[5] = { TIFF_ASCII, TIFF_ASCII, TIFF_RATIONAL, TIFF_RATIONAL, TIFF_LONG };
+
+    TiffBuilder tiff;
+    tiff.Put16(ExifParser::MAX_IFD_ENTRIES);
+    tiff.Entry(TAG_EXIF_IFD, TIFF_LONG, 1, 8);
+    for (UINT i = 1; i < ExifParser::MAX_IFD_ENTRIES; i++)
+        tiff.Entry(TAGS[i % 5], TYPES[i % 5], 0x40000000, 0xFFFFFFF0 - i);
+    tiff.Put32(0);
+    return WrapInJpeg(tiff.data);
+}
+
+static void Run(const char* name, const std::vector<BYTE>& input)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceFrequency(&frequency);
+
+    ExifFields fields;
+    ExifParseStatus status = ExifParser::ParseBuffer(&input[0], input.size(), fields);
+
+    QueryPerformanceCounter(&start);
+    for (UINT i = 0; i < ITERATIONS; i++)
+        ExifParser::ParseBuffer(&input[0], input.size(), fields);
+    QueryPerformanceCounter(&end);
+
+    double nanoseconds = (end.QuadPart - start.QuadPart) * 1e9 / frequency.QuadPart / ITERATIONS;
+    printf("%-24s %8u bytes  status %d  %10.0f ns/parse\n", name, (UINT)input.size(), (int)status, nanoseconds);
+}
+
+int main()
+{
+    Run("camera file", BuildCameraFile());
+    Run("marker flood", BuildMarkerFlood());
+    Run("65535-entry IFD", BuildHugeIfd());
+    Run("out-of-range offsets", BuildOutOfRangeOffsets());
+    return 0;
+}
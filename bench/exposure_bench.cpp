@@ -0,0 +1,71 @@
+// Cost of formatting the exposure line: f-numbers and shutter speeds as
+// cameras record them (exact tenths and 1/n) and as APEX-derived rationals,
+// which go through the stop-table search. See "Fuzzing and Benchmarks" in
+// docs/DEVELOPMENT.md for the build line.
+#include "stdafx.h"
+#include "ExposureFormatter.h"
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static const UINT ITERATIONS = 200;
+
+struct Rational
+{
+    UINT numerator;
+    UINT denominator;
+};
+
+typedef size_t (*FormatFunction)(UINT numerator, UINT denominator, WCHAR* buffer, size_t bufferLength);
+
+static void Run(const char* name, FormatFunction format, const std::vector<Rational>& values)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    QueryPerformanceFrequency(&frequency);
+
+    WCHAR buffer[ExposureFormatter::MAX_LENGTH];
+    size_t characters = 0;
+
+    QueryPerformanceCounter(&start);
+    for (UINT i = 0; i < ITERATIONS; i++)
+    {
+        for (size_t j = 0; j < values.size(); j++)
+            characters += format(values[j].numerator, values[j].denominator, buffer, ExposureFormatter::MAX_LENGTH);
+    }
+    QueryPerformanceCounter(&end);
+
+    double nanoseconds = (end.QuadPart - start.QuadPart) * 1e9 / frequency.QuadPart / ITERATIONS / values.size();
+    printf("%-28s %6u values  %8.1f ns/value  (%u chars)\n", name, (UINT)values.size(), nanoseconds,
+           (UINT)(characters / ITERATIONS));
+}
+
+int main()
+{
+    // f/0.5 to f/99.9 as lenses report them
+    std::vector<Rational> tenths;
+    for (UINT i = 5; i < 1000; i++)
+        tenths.push_back(Rational { i, 10 });
+
+    // Av 0 to 12 in 1/100 stops, as a converter writes them
+    std::vector<Rational> apertureApex;
+    for (UINT i = 0; i <= 1200; i++)
+        apertureApex.push_back(Rational { (UINT)(pow(2.0, i / 200.0) * 1000 + 0.5), 1000 });
+
+    // 1/32000 to 30s in 1/100 stops, 1/n below a second
+    std::vector<Rational> shutterApex;
+    for (UINT i = 0; i <= 2000; i++)
+    {
+        double seconds = pow(2.0, 5 - i / 100.0);
+        if (seconds < 1.0)
+            shutterApex.push_back(Rational { 1, (UINT)(1 / seconds + 0.5) });
+        else
+            shutterApex.push_back(Rational { (UINT)(seconds * 10 + 0.5), 10 });
+    }
+
+    Run("aperture, exact tenths", ExposureFormatter::FormatAperture, tenths);
+    Run("aperture, APEX-derived", ExposureFormatter::FormatAperture, apertureApex);
+    Run("shutter speed, APEX-derived", ExposureFormatter::FormatShutterSpeed, shutterApex);
+    return 0;
+}
@@ -0,0 +1,215 @@
+// Heap allocations per file once a worker has seen a frame of the same
+// size: every operator new, and in a debug build every CRT heap call, while
+// one JPEG goes through one ImageProcessor ITERATIONS times. GDI+ allocates
+// the decoded source on its own heap, which neither counter sees. Pass a
+// camera JPEG for the EXIF text; without one a plain 24 MP frame is
+// generated. See "Fuzzing and Benchmarks" in docs/DEVELOPMENT.md for the
+// build line.
+#include "stdafx.h"
+#include "ImageProcessor.h"
+#include <crtdbg.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+ATL::CAppModule _Module;
+
+static const UINT ITERATIONS = 20;
+static const UINT SYNTHETIC_WIDTH = 6000;
+static const UINT SYNTHETIC_HEIGHT = 4000;
+
+// Encoder band threads allocate too
+static volatile LONG64 g_newCalls = 0;
+static volatile LONG64 g_newBytes = 0;
+static volatile LONG64 g_crtCalls = 0;
+
+void* operator new(size_t size)
+{
+    InterlockedIncrement64(&g_newCalls);
+    InterlockedExchangeAdd64(&g_newBytes, (LONG64)size);
+    void* p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    InterlockedIncrement64(&g_newCalls);
+    InterlockedExchangeAdd64(&g_newBytes, (LONG64)size);
+    return malloc(size ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
+#ifdef _DEBUG
+static int __cdecl CountCrtAllocation(int type, void*, size_t, int, long, const unsigned char*, int)
+{
+    if (type == _HOOK_ALLOC || type == _HOOK_REALLOC)
+        InterlockedIncrement64(&g_crtCalls);
+    return TRUE;
+}
+#endif
+
+static CLSID FindJpegEncoder()
+{
+    UINT count = 0;
+    UINT size = 0;
+    Gdiplus::GetImageEncodersSize(&count, &size);
+
+    std::vector<BYTE> buffer(size);
+    Gdiplus::ImageCodecInfo* codecs = (Gdiplus::ImageCodecInfo*)&buffer[0];
+    Gdiplus::GetImageEncoders(count, size, codecs);
+
+    for (UINT i = 0; i < count; i++)
+    {
+        if (wcscmp(codecs[i].MimeType, L"image/jpeg") == 0)
+            return codecs[i].Clsid;
+    }
+    return CLSID_NULL;
+}
+
+static bool WriteSyntheticJpeg(const std::wstring& path)
+{
+    Gdiplus::Bitmap bitmap(SYNTHETIC_WIDTH, SYNTHETIC_HEIGHT, PixelFormat24bppRGB);
+    Gdiplus::Rect rect(0, 0, SYNTHETIC_WIDTH, SYNTHETIC_HEIGHT);
+    Gdiplus::BitmapData data;
+    if (bitmap.LockBits(&rect, Gdiplus::ImageLockModeWrite, PixelFormat24bppRGB, &data) != Gdiplus::Ok)
+        return false;
+
+    // A gradient, so the encoder has something other than flat blocks
+    for (UINT y = 0; y < SYNTHETIC_HEIGHT; y++)
+    {
+        BYTE* row = (BYTE*)data.Scan0 + (INT_PTR)y * data.Stride;
+        for (UINT x = 0; x < SYNTHETIC_WIDTH; x++)
+        {
+            row[x * 3] = (BYTE)(x * 255 / SYNTHETIC_WIDTH);
+            row[x * 3 + 1] = (BYTE)(y * 255 / SYNTHETIC_HEIGHT);
+            row[x * 3 + 2] = (BYTE)((x + y) & 0xFF);
+        }
+    }
+    bitmap.UnlockBits(&data);
+
+    CLSID jpegClsid = FindJpegEncoder();
+    return jpegClsid != CLSID_NULL && bitmap.Save(path.c_str(), &jpegClsid, NULL) == Gdiplus::Ok;
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+    Gdiplus::GdiplusStartupInput startupInput;
+    ULONG_PTR token;
+    Gdiplus::GdiplusStartup(&token, &startupInput, NULL);
+
+    WCHAR tempPath[MAX_PATH];
+    GetTempPathW(MAX_PATH, tempPath);
+    std::wstring folder = std::wstring(tempPath) + L"process_bench";
+    CreateDirectoryW(folder.c_str(), NULL);
+
+    std::wstring inputPath = argc > 1 ? argv[1] : folder + L"\\input.jpg";
+    if (argc <= 1 && !WriteSyntheticJpeg(inputPath))
+    {
+        printf("could not write the synthetic input\n");
+        return 1;
+    }
+
+    ImageHeaderInfo header;
+    if (!ImageHeaderProbe::Probe(inputPath, header) || header.format != ImageFormat::Jpeg)
+    {
+        printf("input is not a readable JPEG\n");
+        return 1;
+    }
+
+    std::wstring outputPath = folder + L"\\output.jpg";
+    WatermarkConfig config;
+
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+
+#ifdef _DEBUG
+    _CrtSetAllocHook(CountCrtAllocation);
+#endif
+
+    printf("%ux%u, %u files through one ImageProcessor\n", header.width, header.height, ITERATIONS);
+    printf("%-6s %10s %12s %10s %10s %10s\n", "file", "new", "new bytes", "crt", "pooled", "ms");
+
+    {
+        ImageProcessor processor;
+        UINT64 steadyNewCalls = 0;
+        UINT64 steadyCrtCalls = 0;
+
+        for (UINT i = 0; i < ITERATIONS; i++)
+        {
+            LONG64 newCalls = g_newCalls;
+            LONG64 newBytes = g_newBytes;
+            LONG64 crtCalls = g_crtCalls;
+            UINT64 pooled = processor.GetAllocationStats().allocations;
+
+            LARGE_INTEGER start;
+            LARGE_INTEGER end;
+            QueryPerformanceCounter(&start);
+            bool success = processor.ProcessImage(inputPath, outputPath, header, config);
+            QueryPerformanceCounter(&end);
+
+            if (!success)
+            {
+                printf("file %u failed\n", i);
+                return 1;
+            }
+
+            UINT64 fileNewCalls = (UINT64)(g_newCalls - newCalls);
+            UINT64 fileCrtCalls = (UINT64)(g_crtCalls - crtCalls);
+            printf("%-6u %10I64u %12I64u %10I64u %10I64u %10.1f\n", i, fileNewCalls,
+                   (UINT64)(g_newBytes - newBytes), fileCrtCalls,
+                   processor.GetAllocationStats().allocations - pooled,
+                   (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart);
+
+            // The first file sizes the pools and builds the overlay
+            if (i > 0)
+            {
+                steadyNewCalls += fileNewCalls;
+                steadyCrtCalls += fileCrtCalls;
+            }
+        }
+
+        printf("steady state: %.1f new/file", (double)steadyNewCalls / (ITERATIONS - 1));
+#ifdef _DEBUG
+        printf(", %.1f crt/file", (double)steadyCrtCalls / (ITERATIONS - 1));
+#endif
+        printf("\n");
+    }
+
+#ifdef _DEBUG
+    _CrtSetAllocHook(NULL);
+#endif
+
+    Gdiplus::GdiplusShutdown(token);
+    return 0;
+}
@@ -0,0 +1,31 @@
+// libFuzzer target for the EXIF parser. Every input is parsed as a
+// complete file image, exactly as ExifReader does with a file from disk.
+// See "Fuzzing and Benchmarks" in docs/DEVELOPMENT.md for the build line.
+#include "stdafx.h"
+#include "ExifParser.h"
+#include <cstdint>
+#include <cstdlib>
+
+static void Check(bool condition)
+{
+    if (!condition)
+        abort();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    ExifFields fields;
+    ExifParseStatus status = ExifParser::ParseBuffer(data, size, fields);
+
+    // Whatever the input, strings stay terminated inside their buffers and
+    // only validated values are reported
+    Check(memchr(fields.make, 0, sizeof(fields.make)) != NULL);
+    Check(memchr(fields.model, 0, sizeof(fields.model)) != NULL);
+    Check(!fields.hasFNumber || (fields.fNumber[0] != 0 && fields.fNumber[1] != 0));
+    Check(!fields.hasExposureTime || (fields.exposureTime[0] != 0 && fields.exposureTime[1] != 0));
+    Check(!fields.hasISO || fields.iso != 0);
+
+    // A buffer never fails to read, only to parse
+    Check(status != ExifParseStatus::ReadError);
+    return 0;
+}
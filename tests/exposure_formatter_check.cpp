@@ -0,0 +1,148 @@
+// Exhaustive check of ExposureFormatter against its stop tables: every
+// 1/3- and 1/2-stop f-number and every 1/3-stop shutter speed, as APEX
+// values and with rounding error either side, prints as its marking, and
+// every f-number that is an exact number of tenths prints unchanged.
+// Exits non-zero on the first run that finds a mismatch. See "Fuzzing and
+// Benchmarks" in docs/DEVELOPMENT.md for the build line.
+#include "stdafx.h"
+#include "ExposureFormatter.h"
+#include <cmath>
+#include <cstdio>
+
+typedef size_t (*FormatFunction)(UINT numerator, UINT denominator, WCHAR* buffer, size_t bufferLength);
+
+// Markings from f/1 (Av 0) to f/64 (Av 12)
+static const WCHAR* const APERTURE_THIRDS[] =
+{
+    L"f/1", L"f/1.1", L"f/1.2", L"f/1.4", L"f/1.6", L"f/1.8", L"f/2", L"f/2.2", L"f/2.5", L"f/2.8",
+    L"f/3.2", L"f/3.5", L"f/4", L"f/4.5", L"f/5", L"f/5.6", L"f/6.3", L"f/7.1", L"f/8", L"f/9",
+    L"f/10", L"f/11", L"f/13", L"f/14", L"f/16", L"f/18", L"f/20", L"f/22", L"f/25", L"f/29",
+    L"f/32", L"f/36", L"f/40", L"f/45", L"f/51", L"f/57", L"f/64"
+};
+
+static const WCHAR* const APERTURE_HALVES[] =
+{
+    L"f/1", L"f/1.2", L"f/1.4", L"f/1.7", L"f/2", L"f/2.4", L"f/2.8", L"f/3.3", L"f/4", L"f/4.8",
+    L"f/5.6", L"f/6.7", L"f/8", L"f/9.5", L"f/11", L"f/13", L"f/16", L"f/19", L"f/22", L"f/27",
+    L"f/32", L"f/38", L"f/45", L"f/54", L"f/64"
+};
+
+// Markings from 30s (Tv -5) to 1/32000 (Tv 15)
+static const WCHAR* const SHUTTER_THIRDS[] =
+{
+    L"30s", L"25s", L"20s", L"15s", L"13s", L"10s", L"8s", L"6s", L"5s", L"4s",
+    L"3.2s", L"2.5s", L"2s", L"1.6s", L"1.3s", L"1s", L"0.8s", L"0.6s", L"0.5s", L"0.4s",
+    L"0.3s", L"1/4", L"1/5", L"1/6", L"1/8", L"1/10", L"1/13", L"1/15", L"1/20", L"1/25",
+    L"1/30", L"1/40", L"1/50", L"1/60", L"1/80", L"1/100", L"1/125", L"1/160", L"1/200", L"1/250",
+    L"1/320", L"1/400", L"1/500", L"1/640", L"1/800", L"1/1000", L"1/1250", L"1/1600", L"1/2000", L"1/2500",
+    L"1/3200", L"1/4000", L"1/5000", L"1/6400", L"1/8000", L"1/10000", L"1/12500", L"1/16000", L"1/20000", L"1/25000",
+    L"1/32000"
+};
+
+// How far an APEX-derived value may be off its stop, in stops: APEX values
+// are recorded to the nearest hundredth of a stop or better
+static const double APEX_ERROR = 0.005;
+
+// Fixed-point denominators converters use for APEX-derived f-numbers and
+// long exposures; short exposures come out as 1/n or 10/n instead
+static const UINT APEX_DENOMINATORS[] = { 100, 1000, 65536 };
+static const UINT RECIPROCAL_NUMERATORS[] = { 1, 10 };
+
+static UINT s_checks = 0;
+static UINT s_failures = 0;
+
+static void Expect(FormatFunction format, UINT numerator, UINT denominator, const WCHAR* expected)
+{
+    WCHAR buffer[ExposureFormatter::MAX_LENGTH];
+    size_t length = format(numerator, denominator, buffer, ExposureFormatter::MAX_LENGTH);
+
+    s_checks++;
+    if (length == 0 || wcscmp(buffer, expected) != 0)
+    {
+        s_failures++;
+        printf("%u/%u: expected %ls, got %ls\n", numerator, denominator, expected, length ? buffer : L"(nothing)");
+    }
+}
+
+// Expects an encoding of value only if it is precise to 0.1%, as a
+// converter would write it. Exact tenths of f-numbers other than the
+// stop itself are skipped: they are reported as recorded, not snapped.
+static void ExpectEncoding(FormatFunction format, UINT numerator, UINT denominator, double value,
+                           double stop, const WCHAR* expected)
+{
+    if (numerator == 0 || denominator == 0 || fabs((double)numerator / denominator - value) > value / 1000)
+        return;
+
+    if (format == ExposureFormatter::FormatAperture && (UINT64)numerator * 10 % denominator == 0 &&
+        fabs((double)numerator / denominator - stop) > 1e-9)
+        return;
+
+    Expect(format, numerator, denominator, expected);
+}
+
+// The stop, and the stop off by the APEX rounding error either way
+static void ExpectStop(FormatFunction format, double stop, const WCHAR* expected)
+{
+    for (int nudge = -1; nudge <= 1; nudge++)
+    {
+        double value = stop * pow(2.0, nudge * APEX_ERROR);
+
+        for (size_t i = 0; i < _countof(APEX_DENOMINATORS); i++)
+        {
+            UINT denominator = APEX_DENOMINATORS[i];
+            ExpectEncoding(format, (UINT)(value * denominator + 0.5), denominator, value, stop, expected);
+        }
+
+        for (size_t i = 0; i < _countof(RECIPROCAL_NUMERATORS); i++)
+        {
+            UINT numerator = RECIPROCAL_NUMERATORS[i];
+            ExpectEncoding(format, numerator, (UINT)(numerator / value + 0.5), value, stop, expected);
+        }
+    }
+}
+
+static void CheckApertureStops()
+{
+    for (UINT i = 0; i < _countof(APERTURE_THIRDS); i++)
+        ExpectStop(ExposureFormatter::FormatAperture, pow(2.0, i / 6.0), APERTURE_THIRDS[i]);
+
+    for (UINT i = 0; i < _countof(APERTURE_HALVES); i++)
+        ExpectStop(ExposureFormatter::FormatAperture, pow(2.0, i / 4.0), APERTURE_HALVES[i]);
+}
+
+// f/0.5 to f/99.9 in every exact-tenths encoding prints as recorded
+static void CheckApertureTenths()
+{
+    for (UINT tenths = 5; tenths < 1000; tenths++)
+    {
+        WCHAR expected[ExposureFormatter::MAX_LENGTH];
+        if (tenths % 10 == 0)
+            swprintf_s(expected, L"f/%u", tenths / 10);
+        else
+            swprintf_s(expected, L"f/%u.%u", tenths / 10, tenths % 10);
+
+        Expect(ExposureFormatter::FormatAperture, tenths, 10, expected);
+        Expect(ExposureFormatter::FormatAperture, tenths * 10, 100, expected);
+        Expect(ExposureFormatter::FormatAperture, tenths * 100, 1000, expected);
+        if (tenths % 10 == 0)
+            Expect(ExposureFormatter::FormatAperture, tenths / 10, 1, expected);
+        if (tenths % 2 == 0)
+            Expect(ExposureFormatter::FormatAperture, tenths / 2, 5, expected);
+    }
+}
+
+static void CheckShutterStops()
+{
+    for (UINT i = 0; i < _countof(SHUTTER_THIRDS); i++)
+        ExpectStop(ExposureFormatter::FormatShutterSpeed, pow(2.0, 5 - i / 3.0), SHUTTER_THIRDS[i]);
+}
+
+int main()
+{
+    CheckApertureStops();
+    CheckApertureTenths();
+    CheckShutterStops();
+
+    printf("%u checks, %u failures\n", s_checks, s_failures);
+    return s_failures == 0 ? 0 : 1;
+}